@@ -63,6 +63,7 @@ int ez_init (void)
     /* Graphical context gc; suppress events NoExpose and GraphicsExpose */
     ezx.gc = DefaultGC (ezx.display, ezx.screen_num);
     XSetGraphicsExposures(ezx.display, ezx.gc, False);
+    ez_gc_init ();
 
     /* Create an xid to store data in a window */
     ezx.info_prop = XUniqueContext ();
@@ -117,6 +118,14 @@ int ez_init (void)
     /* Handling of time */
     ez_init_timeofday ();
 
+#elif defined EZ_BASE_MEMORY
+
+    /* No display: the screen is as large as the biggest surface */
+    ezx.display_width  = 32767;
+    ezx.display_height = 32767;
+    ezx.root_win = None;
+    ezx.win_id = 0;
+
 #endif /* EZ_BASE_ */
 
     /* Initialize the double buffer for windows displaying */
@@ -131,12 +140,17 @@ int ez_init (void)
     ez_set_color (ez_black);
     ez_set_thick (1);
 
-    /* Timers list */
-    ezx.timer_nb = 0;
+    /* Timers heap */
+    ezx.timer_l = NULL;
+    ezx.timer_pos = NULL;
+    ezx.timer_nb = ezx.timer_max = ezx.timer_slots = 0;
+    ezx.timer_free = -1;
+    ezx.timer_serial = 0;
 
     /* Configure event loop */
     ezx.main_loop = 1;    /* Set to 0 to break the event loop */
     ezx.last_expose = 1;  /* Set to 0 to deactivate waiting of last Expose */
+    ezx.clip_win = None;  /* No damaged area being redrawn */
     ezx.auto_quit = 1;    /* Button Close will exit program */
     ezx.mouse_b = 0;      /* Used for MotionNotify */
     ezx.win_nb = 0;       /* Break also event loop */
@@ -211,6 +225,15 @@ Ez_window ez_window_create (int w, int h, const char *name, Ez_func func)
         return NULL;
     }
 
+#elif defined EZ_BASE_MEMORY
+
+    /* Create a surface, white as a new X11 window */
+    win = ez_mem_create (w, h);
+    if (win == NULL) {
+        ez_error ("ez_window_create: out of memory for \"%s\"\n", name);
+        return None;
+    }
+
 #endif /* EZ_BASE_ */
 
     /* To store data in the window */
@@ -221,6 +244,8 @@ Ez_window ez_window_create (int w, int h, const char *name, Ez_func func)
         XDestroyWindow (ezx.display, win);
 #elif defined EZ_BASE_WIN32
         DestroyWindow (win);
+#elif defined EZ_BASE_MEMORY
+        ez_mem_destroy (win);
 #endif /* EZ_BASE_ */
         return None;
     }
@@ -233,12 +258,18 @@ Ez_window ez_window_create (int w, int h, const char *name, Ez_func func)
         XDestroyWindow (ezx.display, win);
 #elif defined EZ_BASE_WIN32
         DestroyWindow (win);
+#elif defined EZ_BASE_MEMORY
+        ez_mem_destroy (win);
 #endif /* EZ_BASE_ */
         return None;
     }
     info->func = func;
     info->data = NULL;
     info->dbuf = None;
+    info->dmg_x1 = info->dmg_y1 = info->dmg_x2 = info->dmg_y2 = 0;
+    info->timer_id = 0;
+    info->frame_id = 0;
+    info->width = w; info->height = h;
     ez_window_show (win, 1);
 
     /* Store the window */
@@ -257,6 +288,10 @@ Ez_window ez_window_createex (int x, int y,int w, int h, const char *name, Ez_fu
 
     if (ez_check_state ("ez_window_create") < 0) return None;
 
+#ifdef EZ_BASE_MEMORY
+    (void) x; (void) y;  /* A surface has no position */
+#endif /* EZ_BASE_ */
+
 #ifdef EZ_BASE_XLIB
 
     /* Create a main window, child of the root window */
@@ -301,6 +336,15 @@ Ez_window ez_window_createex (int x, int y,int w, int h, const char *name, Ez_fu
         return NULL;
     }
 
+#elif defined EZ_BASE_MEMORY
+
+    /* Create a surface, white as a new X11 window */
+    win = ez_mem_create (w, h);
+    if (win == NULL) {
+        ez_error ("ez_window_create: out of memory for \"%s\"\n", name);
+        return None;
+    }
+
 #endif /* EZ_BASE_ */
 
     /* To store data in the window */
@@ -311,6 +355,8 @@ Ez_window ez_window_createex (int x, int y,int w, int h, const char *name, Ez_fu
         XDestroyWindow (ezx.display, win);
 #elif defined EZ_BASE_WIN32
         DestroyWindow (win);
+#elif defined EZ_BASE_MEMORY
+        ez_mem_destroy (win);
 #endif /* EZ_BASE_ */
         return None;
     }
@@ -323,12 +369,18 @@ Ez_window ez_window_createex (int x, int y,int w, int h, const char *name, Ez_fu
         XDestroyWindow (ezx.display, win);
 #elif defined EZ_BASE_WIN32
         DestroyWindow (win);
+#elif defined EZ_BASE_MEMORY
+        ez_mem_destroy (win);
 #endif /* EZ_BASE_ */
         return None;
     }
     info->func = func;
     info->data = NULL;
     info->dbuf = None;
+    info->dmg_x1 = info->dmg_y1 = info->dmg_x2 = info->dmg_y2 = 0;
+    info->timer_id = 0;
+    info->frame_id = 0;
+    info->width = w; info->height = h;
     ez_window_show (win, 1);
 
     /* Store the window */
@@ -351,6 +403,8 @@ int ez_window_get_id (Ez_window win)
     return win;
 #elif defined EZ_BASE_WIN32
     return PtrToInt (win);
+#elif defined EZ_BASE_MEMORY
+    return win == None ? 0 : win->id;
 #endif /* EZ_BASE_ */
 }
 
@@ -398,10 +452,13 @@ void ez_window_show (Ez_window win, int val)
 #elif defined EZ_BASE_WIN32
     if (val) {
         ShowWindow (win, SW_SHOWNORMAL);
-        PostMessage (win, WM_PAINT, 0, 0);
+        ez_send_expose (win);
     } else {
         ShowWindow (win, SW_HIDE);
     }
+#elif defined EZ_BASE_MEMORY
+    win->mapped = val;
+    if (val) ez_send_expose (win);
 #endif /* EZ_BASE_ */
 }
 
@@ -419,6 +476,8 @@ void ez_window_set_size (Ez_window win, int w, int h)
     wc.width = w > 1 ? w : 1;
     wc.height = h > 1 ? h : 1;
     XConfigureWindow (ezx.display, win, CWWidth|CWHeight, &wc);
+    /* Corrected by ConfigureNotify if the window manager changes it */
+    ez_size_cache (win, wc.width, wc.height);
 
 #elif defined EZ_BASE_WIN32
 
@@ -430,6 +489,18 @@ void ez_window_set_size (Ez_window win, int w, int h)
               + GetSystemMetrics (SM_CYCAPTION),
         SWP_NOMOVE | SWP_NOZORDER );
 
+#elif defined EZ_BASE_MEMORY
+
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    if (w == win->width && h == win->height) return;
+    if (ez_mem_resize (win, w, h) < 0) {
+        ez_error ("ez_window_set_size: out of memory\n");
+        return;
+    }
+    win->configure = 1;
+    ez_send_expose (win);
+
 #endif /* EZ_BASE_ */
 }
 
@@ -437,12 +508,13 @@ void ez_window_get_size (Ez_window win, int *w, int *h)
 {
 #ifdef EZ_BASE_XLIB
 
-    Ez_window root_ret;
-    unsigned int w_ret, h_ret, b_ret, d_ret;
-    int x_ret, y_ret;
+    Ez_win_info *info;
+    int w_ret, h_ret;
 
-    XGetGeometry (ezx.display, win, &root_ret, &x_ret, &y_ret,
-        &w_ret, &h_ret, &b_ret, &d_ret);
+    /* The size is cached to avoid a round-trip to the server */
+    if (ez_info_get (win, &info) == 0) {
+        w_ret = info->width; h_ret = info->height;
+    } else ez_geometry_get (win, &w_ret, &h_ret);
 
 #elif defined EZ_BASE_WIN32
 
@@ -459,6 +531,10 @@ void ez_window_get_size (Ez_window win, int *w, int *h)
             - GetSystemMetrics (SM_CYCAPTION);
     if (h_ret < 0) h_ret = 0;
 
+#elif defined EZ_BASE_MEMORY
+
+    int w_ret = win->width, h_ret = win->height;
+
 #endif /* EZ_BASE_ */
 
     if (w) *w = w_ret;
@@ -466,6 +542,25 @@ void ez_window_get_size (Ez_window win, int *w, int *h)
 }
 
 
+/*
+ * Resynchronize the size of the window given by ez_window_get_size, which
+ * is cached from the ConfigureNotify events on X11. Only useful if these
+ * events were lost, e.g. when another client resizes the window.
+*/
+
+void ez_window_sync_size (Ez_window win)
+{
+#ifdef EZ_BASE_XLIB
+    int w, h;
+
+    ez_geometry_get (win, &w, &h);
+    ez_size_cache (win, w, h);
+#else
+    (void) win;
+#endif /* EZ_BASE_ */
+}
+
+
 /*
  * Clear a window and initialize again drawings parameters.
 */
@@ -474,9 +569,15 @@ void ez_window_clear (Ez_window win)
 {
     int w, h;
 
-    ez_window_get_size (win, &w, &h);
     ez_set_color (ez_white);
-    ez_fill_rectangle (win, 0, 0, w, h);
+    if (win == ezx.clip_win) {
+        /* Only the damaged area is redrawn */
+        ez_fill_rectangle (win, ezx.clip_x, ezx.clip_y,
+            ezx.clip_x + ezx.clip_w - 1, ezx.clip_y + ezx.clip_h - 1);
+    } else {
+        ez_window_get_size (win, &w, &h);
+        ez_fill_rectangle (win, 0, 0, w, h);
+    }
     ez_set_color (ez_black);
     ez_set_thick (1);
     ez_set_nfont (0);
@@ -501,8 +602,16 @@ void ez_window_dbuf (Ez_window win, int val)
 #elif defined EZ_BASE_WIN32
         ez_cur_win (win);
         dbuf = CreateCompatibleDC (ezx.hdc);
+#elif defined EZ_BASE_MEMORY
+        dbuf = malloc (win->width * win->height * 4);
+        if (dbuf == None) {
+            ez_error ("ez_window_dbuf: out of memory\n");
+            return;
+        }
 #endif /* EZ_BASE_ */
         ez_dbuf_set (win, dbuf);
+        /* The back buffer is undefined: the whole window must be redrawn */
+        ez_send_expose (win);
 
     } else {
 
@@ -512,6 +621,9 @@ void ez_window_dbuf (Ez_window win, int val)
 #elif defined EZ_BASE_WIN32
         ez_cur_win (None);
         DeleteDC (dbuf);
+#elif defined EZ_BASE_MEMORY
+        if (win == ezx.dbuf_win) { ezx.dbuf_win = None; ezx.dbuf_pix = None; }
+        free (dbuf);
 #endif /* EZ_BASE_ */
         ez_dbuf_set (win, None);
     }
@@ -576,20 +688,44 @@ void ez_auto_quit (int val)
 
 void ez_send_expose (Ez_window win)
 {
-#ifdef EZ_BASE_XLIB
+    /* The damaged area is confined to the window on Expose */
+    ez_window_invalidate (win, 0, 0, 32767, 32767);
+}
+
+
+/*
+ * Mark the area x,y,w,h of the window as damaged, to force its redraw.
+ * The damaged areas are merged until the next Expose, whose drawings are
+ * clipped to their bounding box, given in ev->clip_x, clip_y, clip_w, clip_h.
+*/
+
+void ez_window_invalidate (Ez_window win, int x, int y, int w, int h)
+{
+    if (win == None) return;
 
-    XEvent ev;
+    /* An Expose is already pending if the area was not empty */
+    if (ez_damage_add (win, x, y, w, h) != 1) return;
 
-    ev.type = Expose;
-    ev.xexpose.window = win;
-    ev.xexpose.count = 0;
+#ifdef EZ_BASE_XLIB
+    {
+        XEvent ev;
 
-    XSendEvent (ezx.display, win, False, 0L, &ev);
+        ev.type = Expose;
+        ev.xexpose.window = win;
+        ev.xexpose.x = ev.xexpose.y = 0;
+        ev.xexpose.width = ev.xexpose.height = 0;  /* Already in damage */
+        ev.xexpose.count = 0;
 
+        XSendEvent (ezx.display, win, False, 0L, &ev);
+    }
 #elif defined EZ_BASE_WIN32
 
     PostMessage (win, EZ_MSG_PAINT, 0, 0);
 
+#elif defined EZ_BASE_MEMORY
+
+    win->expose = 1;
+
 #endif /* EZ_BASE_ */
 }
 
@@ -602,13 +738,102 @@ void ez_send_expose (Ez_window win)
 
 void ez_start_timer (Ez_window win, int delay)
 {
-    if (delay < 0) {
-        ez_timer_remove (win);
-    } else {
-        if (ez_timer_add (win, delay) < 0)
-            ez_error ("ez_start_timer: could not set timer delay"
-                " = %d ms for win 0x%x\n", delay, ez_window_get_id(win));
+    Ez_win_info *info;
+
+    if (ez_info_get (win, &info) < 0) return;
+    if (info->timer_id > 0) ez_timer_cancel (info->timer_id);
+    info->timer_id = 0;
+    if (delay < 0) return;
+
+    info->timer_id = ez_timer_add (win, (Ez_int64) delay * 1000000, 0);
+    if (info->timer_id < 0) {
+        info->timer_id = 0;
+        ez_error ("ez_start_timer: could not set timer delay"
+            " = %d ms for win 0x%x\n", delay, ez_window_get_id(win));
+    }
+}
+
+
+/*
+ * Start a new timer for the window win, independent from the other ones,
+ * with the delay expressed in millisecs; if period > 0, the timer is then
+ * repeated every period millisecs until ez_stop_timer.
+ * The TimerNotify events give the identifier of the timer in ev->timer_id.
+ * Return the identifier, else -1 on error.
+*/
+
+int ez_start_timer_ex (Ez_window win, int delay, int period)
+{
+    Ez_win_info *info;
+    int id;
+
+    if (ez_info_get (win, &info) < 0) return -1;
+    id = ez_timer_add (win, (Ez_int64) delay * 1000000,
+                            (Ez_int64) period * 1000000);
+    if (id < 0)
+        ez_error ("ez_start_timer_ex: could not set timer delay"
+            " = %d ms for win 0x%x\n", delay, ez_window_get_id(win));
+    return id;
+}
+
+
+/*
+ * Stop the timer id, started by ez_start_timer_ex or ez_start_timer.
+*/
+
+void ez_stop_timer (int id)
+{
+    ez_timer_cancel (id);
+}
+
+
+/*
+ * Animate the window win at fps frames per second, on a fixed cadence which
+ * does not drift; if fps <= 0, the animation is stopped.
+ * At each frame, the callback receives a TimerNotify with ev->timer_id set
+ * to the identifier returned, then an Expose to redraw the window.
+ * When the callback is late, the missed frames are skipped.
+ * Return the identifier on success, 0 if stopped, -1 on error.
+*/
+
+int ez_set_frame_rate (Ez_window win, double fps)
+{
+    Ez_win_info *info;
+
+    if (ez_info_get (win, &info) < 0) return -1;
+    if (info->frame_id > 0) ez_timer_cancel (info->frame_id);
+    info->frame_id = 0;
+    if (fps <= 0) return 0;
+
+    info->frame_period = 1E9 / fps + 0.5;
+    if (info->frame_period < 1) info->frame_period = 1;
+    info->frame_last = 0;
+    memset (&info->frame_st, 0, sizeof(Ez_frame_stats));
+    info->frame_st.fps = fps;
+
+    info->frame_id = ez_timer_add (win, info->frame_period, info->frame_period);
+    if (info->frame_id < 0) {
+        info->frame_id = 0;
+        ez_error ("ez_set_frame_rate: could not set %g fps for win 0x%x\n",
+            fps, ez_window_get_id(win));
+        return -1;
     }
+    return info->frame_id;
+}
+
+
+/*
+ * Retrieve the statistics of the frames of ez_set_frame_rate for the window.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_get_frame_stats (Ez_window win, Ez_frame_stats *st)
+{
+    Ez_win_info *info;
+
+    if (st == NULL || ez_info_get (win, &info) < 0) return -1;
+    *st = info->frame_st;
+    return 0;
 }
 
 
@@ -622,7 +847,7 @@ void ez_start_timer (Ez_window win, int delay)
 void ez_main_loop (void)
 {
     int i;
-#ifdef EZ_BASE_XLIB
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
     Ez_event ev;
 #elif defined EZ_BASE_WIN32
     MSG msg;
@@ -647,7 +872,7 @@ void ez_main_loop (void)
 
     /* Wait for next event then call the callback */
     while (ezx.main_loop != 0 && ezx.win_nb > 0) {
-#ifdef EZ_BASE_XLIB
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
         ez_event_next (&ev);
         ez_event_dispatch (&ev);
 #elif defined EZ_BASE_WIN32
@@ -666,7 +891,7 @@ void ez_main_loop (void)
 
 int ez_random (int n)
 {
-#ifdef EZ_BASE_XLIB
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
     return (random() / (RAND_MAX + 1.0)) * n;
 #elif defined EZ_BASE_WIN32
     return (rand() / (RAND_MAX + 1.0)) * n;
@@ -675,14 +900,38 @@ int ez_random (int n)
 
 
 /*
- * Return the elapsed time since the Epoch in seconds,microseconds
+ * Return the time in seconds on a monotonic clock, which does not jump
+ * when the system date is changed; only differences are meaningful.
 */
 
 double ez_get_time (void)
 {
-    struct timeval tp;
-    ez_gettimeofday (&tp);
-    return (double) tp.tv_sec + (double) tp.tv_usec / (double) 1E6;
+    return ez_get_time_ns () / 1E9;
+}
+
+
+/*
+ * Return the time in nanoseconds on the same monotonic clock.
+*/
+
+Ez_int64 ez_get_time_ns (void)
+{
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (Ez_int64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined EZ_BASE_WIN32
+    LARGE_INTEGER now;
+    Ez_int64 c;
+    /* Without performance counter, GetTickCount has a 10-16 ms accuracy */
+    if (ezx.count_freq == 0)
+        return (Ez_int64) GetTickCount () * 1000000;
+    QueryPerformanceCounter (&now);
+    c = now.QuadPart - ezx.start_count.QuadPart;
+    /* Split to avoid an overflow of c * 1E9 */
+    return c / ezx.count_freq * 1000000000 +
+           c % ezx.count_freq * 1000000000 / ezx.count_freq;
+#endif /* EZ_BASE_ */
 }
 
 
@@ -695,6 +944,8 @@ Ez_uint32 (*ez_get_RGB)(Ez_uint8 r, Ez_uint8 g, Ez_uint8 b) =
     ez_get_RGB_true_color;
 #elif defined EZ_BASE_WIN32
     ez_get_RGB_win32;
+#elif defined EZ_BASE_MEMORY
+    ez_get_RGB_memory;
 #endif /* EZ_BASE_ */
 
 
@@ -758,7 +1009,7 @@ void ez_set_color (Ez_uint32 color)
 
 #ifdef EZ_BASE_XLIB
 
-    XSetForeground (ezx.display, ezx.gc, ezx.color);
+    /* The foreground of gc is set by the drawings */
 
 #elif defined EZ_BASE_WIN32
 
@@ -773,6 +1024,10 @@ void ez_set_color (Ez_uint32 color)
     /* To display text */
     if (ezx.dc_win != None) SetTextColor (ezx.hdc, ezx.color);
 
+#elif defined EZ_BASE_MEMORY
+
+    ezx.rgba = ez_mem_rgba (ezx.color);
+
 #endif /* EZ_BASE_ */
 }
 
@@ -791,14 +1046,29 @@ void ez_set_thick (int thick)
 	ezx.ithick = 1;
 
 #ifdef EZ_BASE_XLIB
-    XSetLineAttributes (ezx.display, ezx.gc, (ezx.thick == 1) ? 0 : ezx.thick,
-        LineSolid, CapRound, JoinRound);
+    ez_gc_set_line_width ((ezx.thick == 1) ? 0 : ezx.thick);
 #elif defined EZ_BASE_WIN32
     ez_update_pen ();
 #endif /* EZ_BASE_ */
 }
 
 
+/*
+ * Return the number of changes of the graphical context sent to the server
+ * since ez_init; the drawings only send the state which actually changes.
+ * Always 0 on Win32 and in memory.
+*/
+
+int ez_get_gc_changes (void)
+{
+#ifdef EZ_BASE_XLIB
+    return ezx.gcs.changes;
+#elif defined EZ_BASE_WIN32 || defined EZ_BASE_MEMORY
+    return 0;
+#endif /* EZ_BASE_ */
+}
+
+
 /*
  * Basic drawings. x1,y1 and y2,y2 are the top left and bottom right
  * coordinates of the bounding box.
@@ -810,24 +1080,22 @@ void ez_set_thick (int thick)
 void ez_set_pixel (Ez_window win, int x1, int y1, Ez_uint32 color)
 {
 #ifdef EZ_BASE_XLIB
-	if(ezx.pixcolor != color)
-	{
-		XSetForeground (ezx.display, ezx.gc, color);
-		ezx.pixcolor = color;
-	}		
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (color);
+    win = ez_gc_drawable (win);
     XDrawPoint (ezx.display, win, ezx.gc, x1, y1);
 #elif defined EZ_BASE_WIN32
     ez_cur_win (win);
     SetPixel(ezx.hdc, x1, y1, color);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_span (win, x1, x1, y1, ez_mem_rgba (color));
 #endif /* EZ_BASE_ */
 }
 
 void ez_draw_point (Ez_window win, int x1, int y1)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     if (ezx.thick == 1)
          XDrawPoint (ezx.display, win, ezx.gc, x1, y1);
     else XFillArc (ezx.display, win, ezx.gc, x1-ezx.thick/2, y1-ezx.thick/2,
@@ -836,28 +1104,32 @@ void ez_draw_point (Ez_window win, int x1, int y1)
     ez_cur_win (win);
     MoveToEx (ezx.hdc, x1, y1, NULL);
     LineTo (ezx.hdc, x1+1, y1);  /* final point excluded */
+#elif defined EZ_BASE_MEMORY
+    ez_mem_dot (win, x1, y1);
 #endif /* EZ_BASE_ */
 }
 
 void ez_draw_line (Ez_window win, int x1, int y1, int x2, int y2)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     XDrawLine (ezx.display, win, ezx.gc, x1, y1, x2, y2);
 #elif defined EZ_BASE_WIN32
     ez_cur_win (win);
     MoveToEx (ezx.hdc, x1, y1, NULL);
     LineTo (ezx.hdc, x2, y2);
     if (ezx.thick == 1) LineTo (ezx.hdc, x2+1, y2);   /* final point excluded */
+#elif defined EZ_BASE_MEMORY
+    ez_mem_line (win, x1, y1, x2, y2);
 #endif /* EZ_BASE_ */
 }
 
 void ez_draw_rectangle (Ez_window win, int x1, int y1, int x2, int y2)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     XDrawRectangle (ezx.display, win, ezx.gc,
         EZ_MIN(x1,x2), EZ_MIN(y1,y2), abs(x2-x1), abs(y2-y1));
 #elif defined EZ_BASE_WIN32
@@ -867,14 +1139,19 @@ void ez_draw_rectangle (Ez_window win, int x1, int y1, int x2, int y2)
     LineTo (ezx.hdc, x2, y2);
     LineTo (ezx.hdc, x1, y2);
     LineTo (ezx.hdc, x1, y1);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_line (win, x1, y1, x2, y1);
+    ez_mem_line (win, x2, y1, x2, y2);
+    ez_mem_line (win, x2, y2, x1, y2);
+    ez_mem_line (win, x1, y2, x1, y1);
 #endif /* EZ_BASE_ */
 }
 
 void ez_fill_rectangle (Ez_window win, int x1, int y1, int x2, int y2)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     XFillRectangle (ezx.display, win, ezx.gc,
         EZ_MIN(x1,x2), EZ_MIN(y1,y2), abs(x2-x1)+1, abs(y2-y1)+1);
 #elif defined EZ_BASE_WIN32
@@ -884,13 +1161,16 @@ void ez_fill_rectangle (Ez_window win, int x1, int y1, int x2, int y2)
     Rectangle (ezx.hdc, EZ_MIN(x1,x2)  , EZ_MIN(y1,y2)   ,
                         EZ_MAX(x1,x2)+1, EZ_MAX(y1,y2)+1 );
     if (ezx.thick != old_thick) ez_set_thick (old_thick);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_box (win, EZ_MIN(x1,x2), EZ_MIN(y1,y2), EZ_MAX(x1,x2), EZ_MAX(y1,y2));
 #endif /* EZ_BASE_ */
 }
 
 void ez_draw_triangle (Ez_window win, int x1, int y1, int x2, int y2, int x3, int y3)
 {
 #ifdef EZ_BASE_XLIB
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     XDrawLine (ezx.display, win, ezx.gc, x1, y1, x2, y2);
     XDrawLine (ezx.display, win, ezx.gc, x2, y2, x3, y3);
     XDrawLine (ezx.display, win, ezx.gc, x3, y3, x1, y1);
@@ -900,17 +1180,21 @@ void ez_draw_triangle (Ez_window win, int x1, int y1, int x2, int y2, int x3, in
     LineTo (ezx.hdc, x2, y2);
     LineTo (ezx.hdc, x3, y3);
     LineTo (ezx.hdc, x1, y1);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_line (win, x1, y1, x2, y2);
+    ez_mem_line (win, x2, y2, x3, y3);
+    ez_mem_line (win, x3, y3, x1, y1);
 #endif /* EZ_BASE_ */
 }
 
 void ez_fill_triangle (Ez_window win, int x1, int y1, int x2, int y2, int x3, int y3)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
+    ez_gc_set_foreground (ezx.color);
     XPoint points[3];
     points[0].x = x1; points[1].x = x2; points[2].x = x3;
     points[0].y = y1; points[1].y = y2; points[2].y = y3;
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    win = ez_gc_drawable (win);
     XFillPolygon (ezx.display, win, ezx.gc, points, 3, Convex, CoordModeOrigin);
 #elif defined EZ_BASE_WIN32
     POINT points[3];
@@ -921,14 +1205,16 @@ void ez_fill_triangle (Ez_window win, int x1, int y1, int x2, int y2, int x3, in
     if (ezx.thick != 1) ez_set_thick (1);
     Polygon (ezx.hdc, points, 3 );
     if (ezx.thick != old_thick) ez_set_thick (old_thick);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_triangle (win, x1, y1, x2, y2, x3, y3);
 #endif /* EZ_BASE_ */
 }
 
 void ez_draw_circle (Ez_window win, int x1, int y1, int x2, int y2)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     XDrawArc (ezx.display, win, ezx.gc,
         EZ_MIN(x1,x2), EZ_MIN(y1,y2), abs(x2-x1), abs(y2-y1), 0, 360*64);
 #elif defined EZ_BASE_WIN32
@@ -937,14 +1223,16 @@ void ez_draw_circle (Ez_window win, int x1, int y1, int x2, int y2)
         xc = (xa+xb)/2;
     ez_cur_win (win);
     Arc (ezx.hdc, xa, ya, xb, yb, xc, ya, xc, ya);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_ellipse (win, EZ_MIN(x1,x2), EZ_MIN(y1,y2), abs(x2-x1), abs(y2-y1), 0);
 #endif /* EZ_BASE_ */
 }
 
 void ez_fill_circle (Ez_window win, int x1, int y1, int x2, int y2)
 {
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
     XFillArc (ezx.display, win, ezx.gc,
         EZ_MIN(x1,x2), EZ_MIN(y1,y2), abs(x2-x1)+1, abs(y2-y1)+1, 0, 360*64);
 #elif defined EZ_BASE_WIN32
@@ -954,6 +1242,150 @@ void ez_fill_circle (Ez_window win, int x1, int y1, int x2, int y2)
     Ellipse (ezx.hdc, EZ_MIN(x1,x2)  , EZ_MIN(y1,y2)   ,
                       EZ_MAX(x1,x2)+1, EZ_MAX(y1,y2)+1 );
     if (ezx.thick != old_thick) ez_set_thick (old_thick);
+#elif defined EZ_BASE_MEMORY
+    ez_mem_ellipse (win, EZ_MIN(x1,x2), EZ_MIN(y1,y2),
+        abs(x2-x1)+1, abs(y2-y1)+1, 1);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Batched drawings: xy holds the coordinates of n points (x,y), n segments
+ * or n rectangles (x1,y1,x2,y2), drawn with the current color and thickness
+ * as by ez_draw_point, ez_draw_line and ez_fill_rectangle. Each batch is sent
+ * in a few requests, converted by blocks of EZ_BATCH_MAX items.
+ * On X11, Xlib already merges consecutive calls of ez_draw_point, etc, into
+ * one request as long as the window and the color do not change.
+*/
+
+void ez_draw_points (Ez_window win, const int *xy, int n)
+{
+#ifdef EZ_BASE_XLIB
+    XPoint pts[EZ_BATCH_MAX];
+    XArc arcs[EZ_BATCH_MAX];
+    int i, k, t = ezx.thick;
+
+    if (xy == NULL) return;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
+    for (i = 0; i < n; i += k, xy += 2*k) {
+        for (k = 0; k < EZ_BATCH_MAX && i+k < n; k++) {
+            if (t == 1) {
+                pts[k].x = xy[2*k]; pts[k].y = xy[2*k+1];
+            } else {
+                arcs[k].x = xy[2*k]-t/2; arcs[k].y = xy[2*k+1]-t/2;
+                arcs[k].width = arcs[k].height = t+1;
+                arcs[k].angle1 = 0; arcs[k].angle2 = 360*64;
+            }
+        }
+        if (t == 1)
+             XDrawPoints (ezx.display, win, ezx.gc, pts, k, CoordModeOrigin);
+        else XFillArcs (ezx.display, win, ezx.gc, arcs, k);
+    }
+#elif defined EZ_BASE_WIN32
+    POINT pts[2*EZ_BATCH_MAX];
+    DWORD cnt[EZ_BATCH_MAX];
+    int i, k;
+
+    if (xy == NULL) return;
+    ez_cur_win (win);
+    for (i = 0; i < n; i += k, xy += 2*k) {
+        for (k = 0; k < EZ_BATCH_MAX && i+k < n; k++) {
+            pts[2*k].x   = xy[2*k];   pts[2*k].y   = xy[2*k+1];
+            /* final point excluded */
+            pts[2*k+1].x = xy[2*k]+1; pts[2*k+1].y = xy[2*k+1];
+            cnt[k] = 2;
+        }
+        PolyPolyline (ezx.hdc, pts, cnt, k);
+    }
+#elif defined EZ_BASE_MEMORY
+    int i;
+
+    if (xy == NULL) return;
+    for (i = 0; i < n; i++)
+        ez_mem_dot (win, xy[2*i], xy[2*i+1]);
+#endif /* EZ_BASE_ */
+}
+
+void ez_draw_lines (Ez_window win, const int *xy, int n)
+{
+#ifdef EZ_BASE_XLIB
+    XSegment segs[EZ_BATCH_MAX];
+    int i, k;
+
+    if (xy == NULL) return;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
+    for (i = 0; i < n; i += k, xy += 4*k) {
+        for (k = 0; k < EZ_BATCH_MAX && i+k < n; k++) {
+            segs[k].x1 = xy[4*k];   segs[k].y1 = xy[4*k+1];
+            segs[k].x2 = xy[4*k+2]; segs[k].y2 = xy[4*k+3];
+        }
+        XDrawSegments (ezx.display, win, ezx.gc, segs, k);
+    }
+#elif defined EZ_BASE_WIN32
+    POINT pts[3*EZ_BATCH_MAX];
+    DWORD cnt[EZ_BATCH_MAX];
+    int i, k, m;
+
+    if (xy == NULL) return;
+    ez_cur_win (win);
+    for (i = 0; i < n; i += k, xy += 4*k) {
+        for (k = 0, m = 0; k < EZ_BATCH_MAX && i+k < n; k++) {
+            pts[m].x = xy[4*k];   pts[m].y = xy[4*k+1]; m++;
+            pts[m].x = xy[4*k+2]; pts[m].y = xy[4*k+3]; m++;
+            cnt[k] = 2;
+            if (ezx.thick == 1) {   /* final point excluded */
+                pts[m].x = xy[4*k+2]+1; pts[m].y = xy[4*k+3]; m++;
+                cnt[k] = 3;
+            }
+        }
+        PolyPolyline (ezx.hdc, pts, cnt, k);
+    }
+#elif defined EZ_BASE_MEMORY
+    int i;
+
+    if (xy == NULL) return;
+    for (i = 0; i < n; i++, xy += 4)
+        ez_mem_line (win, xy[0], xy[1], xy[2], xy[3]);
+#endif /* EZ_BASE_ */
+}
+
+void ez_fill_rectangles (Ez_window win, const int *xy, int n)
+{
+#ifdef EZ_BASE_XLIB
+    XRectangle rects[EZ_BATCH_MAX];
+    int i, k;
+    const int *r;
+
+    if (xy == NULL) return;
+    ez_gc_set_foreground (ezx.color);
+    win = ez_gc_drawable (win);
+    for (i = 0; i < n; i += k, xy += 4*k) {
+        for (k = 0; k < EZ_BATCH_MAX && i+k < n; k++) {
+            r = xy + 4*k;
+            rects[k].x = EZ_MIN(r[0],r[2]); rects[k].width  = abs(r[2]-r[0])+1;
+            rects[k].y = EZ_MIN(r[1],r[3]); rects[k].height = abs(r[3]-r[1])+1;
+        }
+        XFillRectangles (ezx.display, win, ezx.gc, rects, k);
+    }
+#elif defined EZ_BASE_WIN32
+    int i, old_thick = ezx.thick;
+
+    if (xy == NULL) return;
+    ez_cur_win (win);
+    if (ezx.thick != 1) ez_set_thick (1);
+    for (i = 0; i < n; i++, xy += 4)
+        Rectangle (ezx.hdc, EZ_MIN(xy[0],xy[2])  , EZ_MIN(xy[1],xy[3])   ,
+                            EZ_MAX(xy[0],xy[2])+1, EZ_MAX(xy[1],xy[3])+1 );
+    if (ezx.thick != old_thick) ez_set_thick (old_thick);
+#elif defined EZ_BASE_MEMORY
+    int i;
+
+    if (xy == NULL) return;
+    for (i = 0; i < n; i++, xy += 4)
+        ez_mem_box (win, EZ_MIN(xy[0],xy[2]), EZ_MIN(xy[1],xy[3]),
+            EZ_MAX(xy[0],xy[2]), EZ_MAX(xy[1],xy[3]));
 #endif /* EZ_BASE_ */
 }
 
@@ -964,12 +1396,13 @@ void ez_fill_circle (Ez_window win, int x1, int y1, int x2, int y2)
  *
  * On X11, the name can be in any fashion but must correspond to an existing
  * font. On Windows, the name must be in the form widthxheight; a matching font
- * of fixed size is obtained.
+ * of fixed size is obtained. In memory, the same form gives the built-in font
+ * scaled to this size.
 */
 
 int ez_font_load (int num, const char *name)
 {
-#ifdef EZ_BASE_WIN32
+#if defined EZ_BASE_WIN32 || defined EZ_BASE_MEMORY
     int w, h;
 #endif /* EZ_BASE_ */
 
@@ -1001,6 +1434,21 @@ int ez_font_load (int num, const char *name)
         "Courier"                          /* lpszFace */
     );
 
+#elif defined EZ_BASE_MEMORY
+
+    if (sscanf (name, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+        ez_error ("ez_font_load: could not get wxh in \"%s\"\n", name);
+        return -1;
+    }
+
+    free (ezx.font[num]);
+    ezx.font[num] = malloc (sizeof(Ez_memfont));
+    if (ezx.font[num] != NULL) {
+        ezx.font[num]->width  = w;
+        ezx.font[num]->height = h;
+        ezx.font[num]->ascent = h - h/6;
+    }
+
 #endif /* EZ_BASE_ */
 
     if (ezx.font[num] == NULL)  {
@@ -1027,7 +1475,7 @@ void ez_set_nfont (int num)
     ezx.ifont = 1;
 
 #ifdef EZ_BASE_XLIB
-    XSetFont (ezx.display, ezx.gc, ezx.font[ezx.nfont]->fid);
+    /* The font of gc is set by ez_draw_text */
 #elif defined EZ_BASE_WIN32
     if (ezx.dc_win != None) SelectObject (ezx.hdc, ezx.font[ezx.nfont]);
 #endif /* EZ_BASE_ */
@@ -1058,10 +1506,11 @@ void ez_draw_text (Ez_window win, Ez_Align align, int x1, int y1,
     int i, j, k, n, x, y, a, b, c;
 
 #ifdef EZ_BASE_XLIB
-	XSetForeground (ezx.display, ezx.gc, ezx.color);
     XFontStruct *font = ezx.font[ezx.nfont];
 #elif defined EZ_BASE_WIN32
     TEXTMETRIC text_metric;
+#elif defined EZ_BASE_MEMORY
+    Ez_memfont *font = ezx.font[ezx.nfont];
 #endif /* EZ_BASE_ */
 
     if (align <= EZ_AA || align == EZ_BB || align >= EZ_CC)
@@ -1091,7 +1540,9 @@ void ez_draw_text (Ez_window win, Ez_Align align, int x1, int y1,
 
 #ifdef EZ_BASE_XLIB
 
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    win = ez_gc_drawable (win);
+    ez_gc_set_foreground (ezx.color);
+    ez_gc_set_font (font->fid);
     a = font->ascent; b = font->descent; c = a+b+b;
 
     /* Display line by line */
@@ -1127,6 +1578,20 @@ void ez_draw_text (Ez_window win, Ez_Align align, int x1, int y1,
     /* Restore background drawing mode */
     if (fillbg == 0) SetBkMode (ezx.hdc, OPAQUE);
 
+#elif defined EZ_BASE_MEMORY
+
+    a = font->ascent; b = font->height - font->ascent; c = a+b+b;
+
+    /* Display line by line */
+    for (i = j = k = 0; ; i++)
+    if (buf[i] == '\n' || buf[i] == 0) {
+        x = x1 - (i-j)*font->width * halign/2;
+        y = y1 + a + c*k - (c*n-b) * valign/2;
+        ez_mem_text (win, x, y, buf+j, i-j, fillbg);
+        k++; j = i+1;
+        if (buf[i] == 0) break;
+    }
+
 #endif /* EZ_BASE_ */
 }
 
@@ -1229,6 +1694,11 @@ void ez_win_delete (Ez_window win)
     if (win == ezx.mv_win) ezx.mv_win = None;
     DestroyWindow (win);
 
+#elif defined EZ_BASE_MEMORY
+
+    if (win == ezx.mv_win) ezx.mv_win = None;
+    ez_mem_destroy (win);
+
 #endif /* EZ_BASE_ */
 }
 
@@ -1259,6 +1729,11 @@ void ez_close_disp (void)
 
     ez_font_delete ();
 
+    free (ezx.timer_l); ezx.timer_l = NULL;
+    free (ezx.timer_pos); ezx.timer_pos = NULL;
+    ezx.timer_nb = ezx.timer_max = ezx.timer_slots = 0;
+    ezx.timer_free = -1;
+
 #ifdef EZ_BASE_XLIB
     if (ezx.visual->class == PseudoColor)
         XFreeColormap (ezx.display, ezx.pseudoColor.colormap);
@@ -1272,178 +1747,243 @@ void ez_close_disp (void)
 #ifdef EZ_BASE_WIN32
 
 /*
- * Initialize time computation.
+ * Initialize time computation with the performance counter.
 */
 
 void ez_init_timeofday (void)
 {
     LARGE_INTEGER freq;
 
-    ezx.perf_freq = 0;
-    ez_get_systemtime (&ezx.start_time);
+    ezx.count_freq = 0;
     QueryPerformanceCounter (&ezx.start_count);
 
     if (QueryPerformanceFrequency (&freq) && freq.QuadPart > 0)
-         ezx.perf_freq = 1.0 / freq.QuadPart;
+         ezx.count_freq = freq.QuadPart;
     if (ez_draw_debug())
-        printf ("ez_init_timeofday: perf_freq = %.10f\n", ezx.perf_freq);
+        printf ("ez_init_timeofday: count_freq = %.0f\n", (double) ezx.count_freq);
 }
 
+#endif /* EZ_BASE_ */
+
 
 /*
- * Emulate gettimeofday() with GetSystemTimeAsFileTime().
- * GetSystemTimeAsFileTime() has an accuracy of 15ms (10ms on XP).
- * GetSystemTimePreciseAsFileTime() has an accuracy of 1ms but needs
- * windows >= 8, and seems rather expensive.
+ * Double the size of the timers heap. Return 0 on success, -1 on error.
 */
 
-void ez_get_systemtime (struct timeval *t)
+int ez_timer_grow (void)
 {
-    ULARGE_INTEGER ul;
-    FILETIME ft;
-    double dt;
-    if (t == NULL) return;
-    GetSystemTimeAsFileTime (&ft);
-    ul.LowPart = ft.dwLowDateTime;
-    ul.HighPart = ft.dwHighDateTime;
-    dt = ul.QuadPart / 10000000.0 - 11644473600.0;
-    t->tv_sec = dt;
-    t->tv_usec = (dt - t->tv_sec) * 1000000.0;
+    int n = ezx.timer_max > 0 ? ezx.timer_max*2 : 16;
+    Ez_timer *l;
+    int *pos;
+
+    if (n > EZ_TIMER_SLOT_MASK) n = EZ_TIMER_SLOT_MASK;
+    if (n <= ezx.timer_max) return -1;
+
+    l = realloc (ezx.timer_l, n * sizeof(Ez_timer));
+    if (l == NULL) return -1;
+    ezx.timer_l = l;
+    pos = realloc (ezx.timer_pos, n * sizeof(int));
+    if (pos == NULL) return -1;
+    ezx.timer_pos = pos;
+    ezx.timer_max = n;
+    return 0;
 }
 
 
 /*
- * Emulate gettimeofday() with QueryPerformanceCounter().
- * This method seems to be more accurate than ez_get_systemtime()
- * but leads to a drift.
+ * The timers heap: each timer expires before its children 2i+1 and 2i+2.
+ * The position of each timer is kept in timer_pos for its slot, so as to
+ * add and cancel in O(log n).
 */
 
-void ez_get_countertime (struct timeval *t)
+void ez_timer_place (int i, Ez_timer *t)
 {
-    LARGE_INTEGER now;
-    double dt;
-    QueryPerformanceCounter (&now);
-    dt = (now.QuadPart - ezx.start_count.QuadPart) * ezx.perf_freq;
-    *t = ezx.start_time;
-    t->tv_sec += dt;
-    t->tv_usec += (dt - (int)dt) * 1000000;
-    t->tv_sec += t->tv_usec / 1000000;
-    t->tv_usec %= 1000000;
+    ezx.timer_l[i] = *t;
+    ezx.timer_pos[(t->id & EZ_TIMER_SLOT_MASK) - 1] = i;
 }
 
-#endif /* EZ_BASE_ */
-
+void ez_timer_up (int i)
+{
+    Ez_timer t = ezx.timer_l[i];
+    int p;
+
+    while (i > 0) {
+        p = (i-1) / 2;
+        if (t.expiration >= ezx.timer_l[p].expiration) break;
+        ez_timer_place (i, &ezx.timer_l[p]);
+        i = p;
+    }
+    ez_timer_place (i, &t);
+}
 
-/*
- * Compute elapsed time since the Epoch.
-*/
+void ez_timer_down (int i)
+{
+    Ez_timer t = ezx.timer_l[i];
+    int c;
+
+    while ((c = 2*i+1) < ezx.timer_nb) {
+        if (c+1 < ezx.timer_nb &&
+            ezx.timer_l[c+1].expiration < ezx.timer_l[c].expiration) c++;
+        if (ezx.timer_l[c].expiration >= t.expiration) break;
+        ez_timer_place (i, &ezx.timer_l[c]);
+        i = c;
+    }
+    ez_timer_place (i, &t);
+}
 
-void ez_gettimeofday (struct timeval *t)
+/* Remove the timer in position i and free its slot */
+void ez_timer_delete_at (int i)
 {
-    if (t == NULL) return;
-#ifdef EZ_BASE_XLIB
-    gettimeofday (t, NULL);
-#elif defined EZ_BASE_WIN32
-    if (ezx.perf_freq == 0)
-         ez_get_systemtime (t);
-    else ez_get_countertime (t);
-#endif /* EZ_BASE_ */
+    int s = (ezx.timer_l[i].id & EZ_TIMER_SLOT_MASK) - 1;
+
+    ezx.timer_pos[s] = -2 - ezx.timer_free;
+    ezx.timer_free = s;
+
+    ezx.timer_nb--;
+    if (i == ezx.timer_nb) return;
+    ez_timer_place (i, &ezx.timer_l[ezx.timer_nb]);
+    if (i > 0 && ezx.timer_l[i].expiration < ezx.timer_l[(i-1)/2].expiration)
+         ez_timer_up (i);
+    else ez_timer_down (i);
 }
 
 
 /*
- * Insert a timer in the list. Return 0 on success, -1 on error.
+ * Insert a timer expiring in delay ns, then every period ns if period > 0.
+ * Return the identifier of the timer on success, -1 on error.
 */
 
-int ez_timer_add (Ez_window win, int delay)
+int ez_timer_add (Ez_window win, Ez_int64 delay, Ez_int64 period)
 {
-    int m1, m2, mid;
-    struct timeval t, *mt;
+    Ez_timer t;
+    int s;
 
-    ez_timer_remove (win);
-
-    if (ezx.timer_nb >= EZ_TIMER_MAX) {
+    if (ezx.timer_nb >= ezx.timer_max && ez_timer_grow () < 0) {
         ez_error ("ez_timer_add: too many timers\n");
         return -1;
     }
 
-    /* Retrieve current date */
-    ez_gettimeofday (&t);
+    /* Take a free slot, else a new one */
+    if (ezx.timer_free >= 0) {
+        s = ezx.timer_free;
+        ezx.timer_free = -2 - ezx.timer_pos[s];
+    } else s = ezx.timer_slots++;
 
-    /* Compute expiration date */
-    t.tv_usec += delay * 1000;   /* delay in milliseconds */
-    if (t.tv_usec > 1000000) {
-        t.tv_sec += t.tv_usec / 1000000;
-        t.tv_usec %= 1000000;
-    }
+    /* The serial number makes the identifier differ from the previous
+       timers of the same slot */
+    ezx.timer_serial = ezx.timer_serial % EZ_TIMER_SERIAL_MAX + 1;
 
-    /* Dichotomic search */
-    m1 = 0; m2 = ezx.timer_nb;
-    while (m2-m1 > 0) {
-        mid = (m1+m2) / 2;    /* Middle s.t. m1 <= mid < m2 */
-        mt = &ezx.timer_l[mid].expiration;
-        if ( mt->tv_sec < t.tv_sec ||
-            (mt->tv_sec == t.tv_sec && mt->tv_usec < t.tv_usec) )
-             m1 = mid+1;   /* t goes in [mid+1 .. m2] */
-        else m2 = mid;     /* t goes in [m1 .. mid]   */
-    }
+    t.win = win;
+    t.period = period > 0 ? period : 0;
+    t.id = ezx.timer_serial << EZ_TIMER_SLOT_BITS | (s+1);
+    t.expiration = ez_get_time_ns () + (delay > 0 ? delay : 0);
 
-    /* Insert in position m1 */
-    if (m1 < ezx.timer_nb)
-        memmove ( ezx.timer_l+m1+1, ezx.timer_l+m1,
-                 (ezx.timer_nb-m1)*sizeof(Ez_timer) );
-    ezx.timer_nb++;
-    ezx.timer_l[m1].win = win;
-    ezx.timer_l[m1].expiration = t;
+    ezx.timer_l[ezx.timer_nb++] = t;
+    ez_timer_up (ezx.timer_nb-1);
 
-    return 0;
+    return t.id;
 }
 
 
 /*
- * Suppress a timer from the list. Return 0 on success, -1 on error.
+ * Suppress the timer id. Return 0 on success, -1 if it does not exist.
 */
 
-int ez_timer_remove (Ez_window win)
+int ez_timer_cancel (int id)
 {
-    int i;
-    if (win == None) return 0;
-    for (i = 0; i < ezx.timer_nb; i++)
-        if (ezx.timer_l[i].win == win) {
-            memmove ( ezx.timer_l+i, ezx.timer_l+i+1,
-                     (ezx.timer_nb-i-1)*sizeof(Ez_timer) );
-            ezx.timer_nb--;
-            return 0;
-        }
-    return -1;
+    int s = (id & EZ_TIMER_SLOT_MASK) - 1, i;
+
+    if (id <= 0 || s < 0 || s >= ezx.timer_slots) return -1;
+    i = ezx.timer_pos[s];
+    if (i < 0 || ezx.timer_l[i].id != id) return -1;
+    ez_timer_delete_at (i);
+    return 0;
 }
 
 
 /*
- * Return delay between current date and next timer.
- * To pass directly to select().
+ * Suppress all the timers of a window. Return 0 on success, -1 if none.
 */
 
-struct timeval *ez_timer_delay (void)
+int ez_timer_remove (Ez_window win)
 {
-    static struct timeval t;
+    int i, j, s, n = ezx.timer_nb;
 
-    /* No timer */
-    if (ezx.timer_nb == 0) return NULL;
+    if (win == None) return 0;
 
-    /* Retrieve current date */
-    ez_gettimeofday (&t);
+    for (i = j = 0; i < n; i++) {
+        if (ezx.timer_l[i].win == win) {
+            s = (ezx.timer_l[i].id & EZ_TIMER_SLOT_MASK) - 1;
+            ezx.timer_pos[s] = -2 - ezx.timer_free;
+            ezx.timer_free = s;
+        } else ez_timer_place (j++, &ezx.timer_l[i]);
+    }
+    if (j == n) return -1;
 
-    /* The next timer is ezx.timer_list[0].expiration ;
-       we compute the difference with the current date */
-    t.tv_sec  = ezx.timer_l[0].expiration.tv_sec  - t.tv_sec;
-    t.tv_usec = ezx.timer_l[0].expiration.tv_usec - t.tv_usec;
-    if (t.tv_usec < 0) { t.tv_usec += 1000000; t.tv_sec -= 1;}
-    if (t.tv_sec  < 0) t.tv_sec = t.tv_usec = 0;
+    /* Restore the heap */
+    ezx.timer_nb = j;
+    for (i = j/2 - 1; i >= 0; i--)
+        ez_timer_down (i);
+    return 0;
+}
 
-    /* printf ("Timeout in %d s  %6d us\n", (int)t.tv_sec, (int)t.tv_usec); */
 
-    /* Return static address of the struct */
+/*
+ * Handle the expiration of the first timer: give its window and identifier,
+ * then repeat it after its period or suppress it.
+*/
+
+void ez_timer_expire (Ez_window *win, int *id)
+{
+    Ez_timer *t = &ezx.timer_l[0];
+    Ez_int64 now;
+    Ez_win_info *info;
+
+    *win = t->win;
+    *id  = t->id;
+
+    if (t->period > 0) {
+        /* The period is added to the expiration date and not to the
+           current date, so that the timer does not drift */
+        t->expiration += t->period;
+        /* If late, the missed periods are skipped */
+        now = ez_get_time_ns ();
+        if (t->expiration < now)
+            t->expiration = now + t->period;
+        ez_timer_down (0);
+    } else {
+        ez_timer_delete_at (0);
+        if (ez_info_get (*win, &info) == 0 && info->timer_id == *id)
+            info->timer_id = 0;
+    }
+}
+
+
+/*
+ * Return delay between current date and next timer.
+ * To pass directly to select().
+*/
+
+struct timeval *ez_timer_delay (void)
+{
+    static struct timeval t;
+    Ez_int64 dt;
+
+    /* No timer */
+    if (ezx.timer_nb == 0) return NULL;
+
+    /* The next timer is ezx.timer_l[0].expiration ;
+       we compute the difference with the current date, rounded up
+       to the microsecond so as not to wake up too early */
+    dt = ezx.timer_l[0].expiration - ez_get_time_ns ();
+    if (dt < 0) dt = 0;
+    dt = (dt + 999) / 1000;
+    t.tv_sec  = dt / 1000000;
+    t.tv_usec = dt % 1000000;
+
+    /* printf ("Timeout in %d s  %6d us\n", (int)t.tv_sec, (int)t.tv_usec); */
+
+    /* Return static address of the struct */
     return &t;
 }
 
@@ -1479,6 +2019,9 @@ void ez_event_next (Ez_event *ev)
     */
     if (n > 0) {
         XNextEvent (ezx.display, &ev->xev);
+        if (ev->xev.type == Expose)
+            ez_damage_add (ev->xev.xexpose.window, ev->xev.xexpose.x,
+                ev->xev.xexpose.y, ev->xev.xexpose.width, ev->xev.xexpose.height);
         if ( (ev->xev.type == Expose) &&
              ezx.last_expose && ! ez_is_last_expose (&ev->xev))
             goto start_waiting;
@@ -1494,6 +2037,10 @@ void ez_event_next (Ez_event *ev)
     if (res > 0) {
         if (FD_ISSET (fdx, &set1)) {
             XNextEvent (ezx.display, &ev->xev);
+            if (ev->xev.type == Expose)
+                ez_damage_add (ev->xev.xexpose.window, ev->xev.xexpose.x,
+                    ev->xev.xexpose.y, ev->xev.xexpose.width,
+                    ev->xev.xexpose.height);
             if ( (ev->xev.type == Expose) &&
                  ezx.last_expose && ! ez_is_last_expose (&ev->xev) )
                 goto start_waiting;
@@ -1507,8 +2054,7 @@ void ez_event_next (Ez_event *ev)
             goto start_waiting;
         }
         ev->type = TimerNotify;
-        ev->win = ezx.timer_l[0].win;
-        ez_timer_remove (ev->win);
+        ez_timer_expire (&ev->win, &ev->timer_id);
 
     } else {
         perror ("ez_event_next: select()");
@@ -1572,6 +2118,8 @@ void ez_event_dispatch (Ez_event *ev)
                 return;
             ev->type = ev->xev.type;
             ev->win  = ev->xev.xexpose.window;
+            /* The damaged area was already redrawn by a previous Expose */
+            if (ez_clip_begin (ev) < 0) return;
             ez_dbuf_get (ev->win, &ezx.dbuf_pix);
             if (ezx.dbuf_pix != None) ez_dbuf_preswap (ev->win);
             ez_window_clear (ev->win);
@@ -1633,6 +2181,7 @@ void ez_event_dispatch (Ez_event *ev)
             ev->win    = ev->xev.xconfigure.window;
             ev->width  = ev->xev.xconfigure.width;
             ev->height = ev->xev.xconfigure.height;
+            ez_size_cache (ev->win, ev->width, ev->height);
             break;
 
         /* Intercept window close: see ez_auto_quit() */
@@ -1659,6 +2208,8 @@ void ez_event_dispatch (Ez_event *ev)
 
     /* Swap double buffer */
     if (ezx.dbuf_pix != None) ez_dbuf_swap (ev->win);
+
+    ez_clip_end ();
 }
 
 #elif defined EZ_BASE_WIN32
@@ -1673,13 +2224,13 @@ void ez_msg_next (MSG *msg)
 {
     struct timeval *tv;
     double dt_ms;
-    int k;
+    int k, id;
 
     start_waiting:
     tv = ez_timer_delay ();
     if (tv == NULL) dt_ms = INFINITE;
     else {
-        dt_ms = tv->tv_sec*1000 + tv->tv_usec/1000;
+        dt_ms = tv->tv_sec*1000 + (tv->tv_usec+999)/1000;
         if (dt_ms < 0) dt_ms = 0;
     }
 
@@ -1689,8 +2240,8 @@ void ez_msg_next (MSG *msg)
     if (k == WAIT_TIMEOUT) {
         memset (msg, 0, sizeof(MSG));
         msg->message = WM_TIMER;
-        msg->hwnd = ezx.timer_l[0].win;
-        ez_timer_remove (msg->hwnd);
+        ez_timer_expire (&msg->hwnd, &id);
+        msg->wParam = id;
     } else {
         if (! PeekMessage (msg, NULL, 0, 0, PM_REMOVE)) goto start_waiting;
         /* Add message WM_CHAR after a WM_KEYDOWN */
@@ -1725,10 +2276,18 @@ LRESULT CALLBACK ez_win_proc (HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
     switch (msg) {
 
         case WM_PAINT :
+        {
+            RECT r;
+            if (GetUpdateRect (hwnd, &r, FALSE))
+                ez_damage_add (hwnd, r.left, r.top,
+                    r.right - r.left, r.bottom - r.top);
             ValidateRect (hwnd, NULL);
+        }
         case EZ_MSG_PAINT :
             ev.type = Expose;
             ev.win = hwnd;
+            /* The damaged area was already redrawn by a previous Expose */
+            if (ez_clip_begin (&ev) < 0) return 0L;
             ez_dbuf_get (ev.win, &ezx.dbuf_dc);
             if (ezx.dbuf_dc != None) ez_dbuf_preswap (ev.win);
             if (ez_draw_debug())
@@ -1867,6 +2426,7 @@ LRESULT CALLBACK ez_win_proc (HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
      case WM_TIMER :
             ev.type   = TimerNotify;
             ev.win    = hwnd;
+            ev.timer_id = (int) wParam;
             break;
 
         case WM_CLOSE :
@@ -1890,6 +2450,8 @@ LRESULT CALLBACK ez_win_proc (HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
     /* Swap Double buffer */
     if (ezx.dbuf_dc != None) ez_dbuf_swap (ev.win);
 
+    ez_clip_end ();
+
     return 0L;
 }
 
@@ -1942,6 +2504,12 @@ void ez_cur_win (Ez_window win)
          ezx.hdc = GetDC (ezx.dc_win);
     else ezx.hdc = ezx.dbuf_dc;
 
+    /* The DC is shared: confine it to the damaged area of an Expose */
+    SelectClipRgn (ezx.hdc, NULL);
+    if (ezx.dc_win == ezx.clip_win)
+        IntersectClipRect (ezx.hdc, ezx.clip_x, ezx.clip_y,
+            ezx.clip_x + ezx.clip_w, ezx.clip_y + ezx.clip_h);
+
     if (ezx.hpen   != NULL) SelectObject (ezx.hdc, ezx.hpen);
     if (ezx.hbrush != NULL) SelectObject (ezx.hdc, ezx.hbrush);
     if (ezx.font[ezx.nfont] != NULL)
@@ -1961,6 +2529,477 @@ void ez_update_pen (void)
     if (ezx.dc_win != None) SelectObject (ezx.hdc, ezx.hpen);
 }
 
+#elif defined EZ_BASE_MEMORY
+
+/*
+ * Wait for the next event. There is no input in memory: the events are the
+ * pending ConfigureNotify and Expose of the surfaces, then the timers.
+ * When nothing remains to be done, the main loop is broken.
+*/
+
+void ez_event_next (Ez_event *ev)
+{
+    int i;
+    struct timeval *delay;
+
+    /* Initialize ev */
+    memset (ev, 0, sizeof(Ez_event));
+    ev->type = EzLastEvent;
+    ev->win = None;
+
+    for (i = 0; i < ezx.win_nb; i++)
+        if (ezx.win_l[i]->configure) {
+            ezx.win_l[i]->configure = 0;
+            ev->type   = ConfigureNotify;
+            ev->win    = ezx.win_l[i];
+            ev->width  = ev->win->width;
+            ev->height = ev->win->height;
+            return;
+        }
+
+    for (i = 0; i < ezx.win_nb; i++)
+        if (ezx.win_l[i]->mapped && ezx.win_l[i]->expose) {
+            ezx.win_l[i]->expose = 0;
+            ev->type = Expose;
+            ev->win  = ezx.win_l[i];
+            return;
+        }
+
+    delay = ez_timer_delay ();
+    if (delay == NULL) {
+        if (ez_draw_debug())
+            printf ("ez_event_next: no more events\n");
+        ezx.main_loop = 0;
+        return;
+    }
+
+    if ((delay->tv_sec > 0 || delay->tv_usec > 0) &&
+        select (0, NULL, NULL, NULL, delay) < 0)
+        perror ("ez_event_next: select()");
+
+    ev->type = TimerNotify;
+    ez_timer_expire (&ev->win, &ev->timer_id);
+}
+
+
+/*
+ * Prepare the double buffer, then call the callback.
+*/
+
+void ez_event_dispatch (Ez_event *ev)
+{
+    /* Double buffer */
+    ezx.dbuf_pix = None; ezx.dbuf_win = None;
+
+    if (ev->type == EzLastEvent) return;
+
+    /* The window must be redrawn. */
+    if (ev->type == Expose) {
+        /* The damaged area was already redrawn by a previous Expose */
+        if (ez_clip_begin (ev) < 0) return;
+        ez_dbuf_get (ev->win, &ezx.dbuf_pix);
+        if (ezx.dbuf_pix != None) ez_dbuf_preswap (ev->win);
+        ez_window_clear (ev->win);
+    }
+
+    /* Call the window callback. */
+    ez_func_call (ev);
+
+    /* Swap double buffer */
+    if (ezx.dbuf_pix != None) ez_dbuf_swap (ev->win);
+
+    ez_clip_end ();
+}
+
+
+/*
+ * Create a white surface of size w x h.
+ * Return the surface, else None.
+*/
+
+Ez_window ez_mem_create (int w, int h)
+{
+    Ez_window win = malloc (sizeof(Ez_surface));
+    if (win == None) return None;
+
+    win->width  = w > 1 ? w : 1;
+    win->height = h > 1 ? h : 1;
+    win->pixels_rgba = malloc (win->width * win->height * 4);
+    if (win->pixels_rgba == NULL) { free (win); return None; }
+    memset (win->pixels_rgba, 0xff, win->width * win->height * 4);
+
+    win->id = ++ezx.win_id;
+    win->prop = NULL;
+    win->mapped = 0;
+    win->expose = win->configure = 0;
+    return win;
+}
+
+
+void ez_mem_destroy (Ez_window win)
+{
+    if (win == None) return;
+    free (win->pixels_rgba);
+    free (win);
+}
+
+
+/*
+ * Change the size of a surface and of its double buffer, keeping the
+ * common pixels. Return 0 on success, -1 on error.
+*/
+
+int ez_mem_resize (Ez_window win, int w, int h)
+{
+    Ez_uint8 *pixels, *dbuf = None;
+    Ez_win_info *info;
+    int y, n = EZ_MIN(w, win->width) * 4;
+
+    if (ez_info_get (win, &info) < 0) return -1;
+
+    pixels = malloc (w * h * 4);
+    if (pixels == NULL) return -1;
+    if (info->dbuf != None) {
+        dbuf = malloc (w * h * 4);
+        if (dbuf == None) { free (pixels); return -1; }
+        memset (dbuf, 0xff, w * h * 4);
+    }
+
+    memset (pixels, 0xff, w * h * 4);
+    for (y = 0; y < h && y < win->height; y++)
+        memcpy (pixels + y*w*4, win->pixels_rgba + y*win->width*4, n);
+    free (win->pixels_rgba);
+    win->pixels_rgba = pixels;
+    win->width = w; win->height = h;
+
+    if (dbuf != None) {
+        free (info->dbuf);
+        info->dbuf = dbuf;
+        if (win == ezx.dbuf_win) ezx.dbuf_pix = dbuf;
+    }
+    return 0;
+}
+
+
+/*
+ * Return the pixels to draw in: the double buffer of win during its Expose,
+ * else the surface itself.
+*/
+
+Ez_uint8 *ez_mem_pixels (Ez_window win)
+{
+    return win == ezx.dbuf_win ? ezx.dbuf_pix : win->pixels_rgba;
+}
+
+
+/*
+ * Convert a color from ez_get_RGB to a pixel in RGBA order.
+*/
+
+Ez_uint32 ez_mem_rgba (Ez_uint32 color)
+{
+    Ez_uint8 b[4];
+    Ez_uint32 rgba;
+
+    b[0] = color >> 16; b[1] = color >> 8; b[2] = color; b[3] = 0xff;
+    memcpy (&rgba, b, 4);
+    return rgba;
+}
+
+
+/*
+ * Draw the pixels xa..xb of line y, clipped to the surface.
+*/
+
+void ez_mem_span (Ez_window win, int xa, int xb, int y, Ez_uint32 rgba)
+{
+    Ez_uint32 *p;
+
+    if (win == None || y < 0 || y >= win->height) return;
+    if (xa < 0) xa = 0;
+    if (xb >= win->width) xb = win->width-1;
+    if (win == ezx.clip_win) {
+        if (y < ezx.clip_y || y >= ezx.clip_y + ezx.clip_h) return;
+        if (xa < ezx.clip_x) xa = ezx.clip_x;
+        if (xb >= ezx.clip_x + ezx.clip_w) xb = ezx.clip_x + ezx.clip_w - 1;
+    }
+    if (xa > xb) return;
+
+    p = (Ez_uint32 *) ez_mem_pixels (win) + y * win->width;
+    for ( ; xa <= xb; xa++) p[xa] = rgba;
+}
+
+
+/*
+ * Fill the box xa..xb x ya..yb with the current color.
+*/
+
+void ez_mem_box (Ez_window win, int xa, int ya, int xb, int yb)
+{
+    if (win == None) return;
+    if (ya < 0) ya = 0;
+    if (yb >= win->height) yb = win->height-1;
+    for ( ; ya <= yb; ya++)
+        ez_mem_span (win, xa, xb, ya, ezx.rgba);
+}
+
+
+/*
+ * Draw a point with the current thickness.
+*/
+
+void ez_mem_dot (Ez_window win, int x, int y)
+{
+    if (ezx.thick == 1)
+         ez_mem_span (win, x, x, y, ezx.rgba);
+    else ez_mem_ellipse (win, x-ezx.thick/2, y-ezx.thick/2,
+             ezx.thick+1, ezx.thick+1, 1);
+}
+
+
+/*
+ * Bresenham line; with a thickness, the points are disks, as CapRound.
+*/
+
+void ez_mem_line (Ez_window win, int x1, int y1, int x2, int y2)
+{
+    int dx = abs(x2-x1), dy = -abs(y2-y1),
+        sx = x1 < x2 ? 1 : -1, sy = y1 < y2 ? 1 : -1, e = dx+dy, e2;
+
+    if (y1 == y2 && ezx.thick == 1) {
+        ez_mem_span (win, EZ_MIN(x1,x2), EZ_MAX(x1,x2), y1, ezx.rgba);
+        return;
+    }
+
+    for (;;) {
+        ez_mem_dot (win, x1, y1);
+        if (x1 == x2 && y1 == y2) break;
+        e2 = 2*e;
+        if (e2 >= dy) { e += dy; x1 += sx; }
+        if (e2 <= dx) { e += dx; y1 += sy; }
+    }
+}
+
+
+/*
+ * Draw (fill = 0) or fill (fill = 1) the ellipse inscribed in the box of
+ * top left corner x,y and size w x h, as XDrawArc and XFillArc.
+*/
+
+void ez_mem_ellipse (Ez_window win, int x, int y, int w, int h, int fill)
+{
+    double cx = x + w/2.0, cy = y + h/2.0, rx = w/2.0, ry = h/2.0, d, t;
+    int i, n, xa, ya, xb, yb;
+
+    if (win == None) return;
+    if (w <= 0 || h <= 0) {
+        if (!fill) ez_mem_line (win, x, y, x+w, y+h);
+        return;
+    }
+
+    if (fill) {
+        /* Pixels whose center is inside the ellipse */
+        for (ya = EZ_MAX(y, 0); ya < y+h && ya < win->height; ya++) {
+            d = (ya + 0.5 - cy) / ry;
+            t = rx * sqrt (1 - d*d);
+            ez_mem_span (win, (int) ceil (cx - t - 0.5),
+                (int) floor (cx + t - 0.5), ya, ezx.rgba);
+        }
+        return;
+    }
+
+    /* Polygon having about one vertex every two pixels */
+    n = 8 + w + h;
+    xa = x + w; ya = EZ_ROUND(cy);
+    for (i = 1; i <= n; i++) {
+        t = 6.28318530717958648 * i / n;
+        xb = EZ_ROUND(cx + rx * cos (t));
+        yb = EZ_ROUND(cy + ry * sin (t));
+        if (xb != xa || yb != ya) ez_mem_line (win, xa, ya, xb, yb);
+        xa = xb; ya = yb;
+    }
+}
+
+
+/*
+ * Fill a triangle, line by line between its edges.
+*/
+
+void ez_mem_triangle (Ez_window win, int x1, int y1, int x2, int y2,
+    int x3, int y3)
+{
+    int px[3], py[3], i, j, y, ya, yb;
+    double xa, xb, xt;
+
+    if (win == None) return;
+    px[0] = x1; px[1] = x2; px[2] = x3;
+    py[0] = y1; py[1] = y2; py[2] = y3;
+
+    ya = EZ_MAX(EZ_MIN(y1, EZ_MIN(y2, y3)), 0);
+    yb = EZ_MIN(EZ_MAX(y1, EZ_MAX(y2, y3)), win->height-1);
+
+    for (y = ya; y <= yb; y++) {
+        xa = win->width; xb = -1;
+        for (i = 0; i < 3; i++) {
+            j = (i+1) % 3;
+            if (y < EZ_MIN(py[i], py[j]) || y > EZ_MAX(py[i], py[j])) continue;
+            if (py[i] == py[j]) {
+                xa = EZ_MIN(xa, EZ_MIN(px[i], px[j]));
+                xb = EZ_MAX(xb, EZ_MAX(px[i], px[j]));
+                continue;
+            }
+            xt = px[i] + (double) (y - py[i]) * (px[j] - px[i]) / (py[j] - py[i]);
+            xa = EZ_MIN(xa, xt);
+            xb = EZ_MAX(xb, xt);
+        }
+        if (xa <= xb)
+            ez_mem_span (win, (int) ceil (xa), (int) floor (xb), y, ezx.rgba);
+    }
+}
+
+
+/*
+ * Glyphs of the built-in font for the characters 32 to 126, 8x8 pixels,
+ * bit 0 on the left. From font8x8_basic.h by Daniel Hepper, public domain.
+*/
+
+static const Ez_uint8 ez_mem_glyphs[95][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   /*   */
+    { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },   /* ! */
+    { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* " */
+    { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 },   /* # */
+    { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 },   /* $ */
+    { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 },   /* % */
+    { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 },   /* & */
+    { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* ' */
+    { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 },   /* ( */
+    { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 },   /* ) */
+    { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },   /* * */
+    { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 },   /* + */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 },   /* , */
+    { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 },   /* - */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 },   /* . */
+    { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 },   /* / */
+    { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 },   /* 0 */
+    { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 },   /* 1 */
+    { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 },   /* 2 */
+    { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 },   /* 3 */
+    { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 },   /* 4 */
+    { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 },   /* 5 */
+    { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 },   /* 6 */
+    { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 },   /* 7 */
+    { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 },   /* 8 */
+    { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 },   /* 9 */
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 },   /* : */
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 },   /* ; */
+    { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 },   /* < */
+    { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 },   /* = */
+    { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 },   /* > */
+    { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 },   /* ? */
+    { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 },   /* @ */
+    { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 },   /* A */
+    { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 },   /* B */
+    { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 },   /* C */
+    { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 },   /* D */
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 },   /* E */
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 },   /* F */
+    { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 },   /* G */
+    { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 },   /* H */
+    { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* I */
+    { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 },   /* J */
+    { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 },   /* K */
+    { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 },   /* L */
+    { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 },   /* M */
+    { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 },   /* N */
+    { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 },   /* O */
+    { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 },   /* P */
+    { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 },   /* Q */
+    { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 },   /* R */
+    { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 },   /* S */
+    { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* T */
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 },   /* U */
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },   /* V */
+    { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 },   /* W */
+    { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 },   /* X */
+    { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 },   /* Y */
+    { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 },   /* Z */
+    { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 },   /* [ */
+    { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 },   /* \ */
+    { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 },   /* ] */
+    { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 },   /* ^ */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },   /* _ */
+    { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },   /* ` */
+    { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 },   /* a */
+    { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 },   /* b */
+    { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 },   /* c */
+    { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 },   /* d */
+    { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 },   /* e */
+    { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 },   /* f */
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F },   /* g */
+    { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 },   /* h */
+    { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* i */
+    { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E },   /* j */
+    { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 },   /* k */
+    { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },   /* l */
+    { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 },   /* m */
+    { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 },   /* n */
+    { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 },   /* o */
+    { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F },   /* p */
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 },   /* q */
+    { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 },   /* r */
+    { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 },   /* s */
+    { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 },   /* t */
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 },   /* u */
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },   /* v */
+    { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 },   /* w */
+    { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 },   /* x */
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F },   /* y */
+    { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 },   /* z */
+    { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 },   /* { */
+    { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },   /* | */
+    { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 },   /* } */
+    { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }    /* ~ */
+};
+
+
+/*
+ * Draw n characters of s with the current font, the baseline being at y.
+ * If fillbg, the background of the characters is filled in white first.
+*/
+
+void ez_mem_text (Ez_window win, int x, int y, const char *s, int n,
+    int fillbg)
+{
+    Ez_memfont *font = ezx.font[ezx.nfont];
+    int i, c, gx, gy, run, top = y - font->ascent;
+    Ez_uint8 bits;
+
+    if (fillbg) {
+        Ez_uint32 old = ezx.rgba;
+        ezx.rgba = ez_mem_rgba (ez_white);
+        ez_mem_box (win, x, top, x + n*font->width - 1, top + font->height - 1);
+        ezx.rgba = old;
+    }
+
+    for (i = 0; i < n; i++, x += font->width) {
+        c = (unsigned char) s[i];
+        if (c < 32 || c > 126) continue;
+        for (gy = 0; gy < font->height; gy++) {
+            bits = ez_mem_glyphs[c-32][gy*8 / font->height];
+            if (bits == 0) continue;
+            /* Runs of lit pixels */
+            for (gx = 0, run = -1; gx <= font->width; gx++) {
+                if (gx < font->width && (bits >> (gx*8 / font->width) & 1)) {
+                    if (run < 0) run = gx;
+                } else if (run >= 0) {
+                    ez_mem_span (win, x+run, x+gx-1, top+gy, ezx.rgba);
+                    run = -1;
+                }
+            }
+        }
+    }
+}
+
 #endif /* EZ_BASE_ */
 
 
@@ -1970,7 +3009,7 @@ void ez_update_pen (void)
 
 void ez_random_init (void)
 {
-#ifdef EZ_BASE_XLIB
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
     srandom ((int) time (NULL));
 #elif defined EZ_BASE_WIN32
     srand ((int) time (NULL));
@@ -2064,6 +3103,9 @@ int ez_prop_set (Ez_window win, XContext prop, void *value)
         ez_error ("ez_prop_set: SetProp failed\n");
         return -1;
     }
+#elif defined EZ_BASE_MEMORY
+    (void) prop;  /* Only one property per surface */
+    win->prop = value;
 #endif /* EZ_BASE_ */
     return 0;
 }
@@ -2084,6 +3126,10 @@ int ez_prop_get (Ez_window win, XContext prop, void **value)
         return -1;
 #elif defined EZ_BASE_WIN32
     *value = GetProp (win, prop);
+#elif defined EZ_BASE_MEMORY
+    (void) prop;
+    if (win == None) return -1;
+    *value = win->prop;
 #endif /* EZ_BASE_ */
     return 0;
 }
@@ -2100,6 +3146,11 @@ int ez_prop_destroy (Ez_window win, XContext prop)
     return XDeleteContext (ezx.display, win, prop) == 0 ? 0 : -1;
 #elif defined EZ_BASE_WIN32
     return RemoveProp (win, prop) == NULL ? -1 : 0;
+#elif defined EZ_BASE_MEMORY
+    (void) prop;
+    if (win->prop == NULL) return -1;
+    win->prop = NULL;
+    return 0;
 #endif /* EZ_BASE_ */
 }
 
@@ -2171,6 +3222,10 @@ int ez_func_call (Ez_event *ev)
     if (ez_func_get (ev->win, &func) < 0) return -1;
     if (func == NULL) return -1;
 
+    /* A frame of ez_set_frame_rate is redrawn after the callback */
+    if (ev->type == TimerNotify && ez_frame_tick (ev) == 0)
+        ez_send_expose (ev->win);
+
     /* Call the callback */
     func (ev);
 
@@ -2178,6 +3233,79 @@ int ez_func_call (Ez_event *ev)
 }
 
 
+/*
+ * If ev is a frame of ez_set_frame_rate, update the statistics and return 0,
+ * else return -1.
+*/
+
+int ez_frame_tick (Ez_event *ev)
+{
+    Ez_win_info *info;
+    Ez_frame_stats *st;
+    Ez_int64 now, dt, n;
+    double ms;
+
+    if (ev->timer_id <= 0 || ez_info_get (ev->win, &info) < 0 ||
+        ev->timer_id != info->frame_id) return -1;
+
+    st = &info->frame_st;
+    now = ez_get_time_ns ();
+    if (info->frame_last > 0) {
+        dt = now - info->frame_last;
+        /* Number of periods elapsed, rounded, minus this frame; an early
+           frame (delivered after less than half a period) skips none */
+        n = (dt + info->frame_period/2) / info->frame_period - 1;
+        if (n > 0) st->skipped += n;
+        ms = dt / 1E6;
+        st->last_ms = ms;
+        if (st->frames == 1 || ms < st->min_ms) st->min_ms = ms;
+        if (st->frames == 1 || ms > st->max_ms) st->max_ms = ms;
+        st->mean_ms += (ms - st->mean_ms) / st->frames;
+    }
+    info->frame_last = now;
+    st->frames++;
+
+    if (ez_draw_debug())
+        printf ("ez_frame_tick: frame %d  %.3f ms  skipped %d\n",
+            st->frames, st->last_ms, st->skipped);
+    return 0;
+}
+
+
+/*
+ * Store the size of the window for ez_window_get_size.
+*/
+
+void ez_size_cache (Ez_window win, int w, int h)
+{
+    Ez_win_info *info;
+
+    if (ez_info_get (win, &info) < 0) return;
+    info->width = w; info->height = h;
+}
+
+
+#ifdef EZ_BASE_XLIB
+
+/*
+ * Ask the size of the window to the server, with a round-trip.
+*/
+
+void ez_geometry_get (Ez_window win, int *w, int *h)
+{
+    Ez_window root_ret;
+    unsigned int w_ret, h_ret, b_ret, d_ret;
+    int x_ret, y_ret;
+
+    if (XGetGeometry (ezx.display, win, &root_ret, &x_ret, &y_ret,
+        &w_ret, &h_ret, &b_ret, &d_ret) == 0)
+        w_ret = h_ret = 0;
+    *w = w_ret; *h = h_ret;
+}
+
+#endif /* EZ_BASE_ */
+
+
 /*
  * Initialize the double buffer mode, which allows to redraw the pixels without
  * blinking.
@@ -2193,6 +3321,8 @@ void ez_dbuf_init (void)
     ezx.dbuf_pix = None;
 #elif defined EZ_BASE_WIN32
     ezx.dbuf_dc  = None;
+#elif defined EZ_BASE_MEMORY
+    ezx.dbuf_pix = None;
 #endif /* EZ_BASE_ */
     ezx.dbuf_win = None;
 }
@@ -2241,6 +3371,8 @@ void ez_dbuf_preswap (Ez_window win)
     ezx.hOldBmp = (HBITMAP) SelectObject (ezx.dbuf_dc, ezx.hMemBmp);
     ez_cur_win (None);
     ezx.dbuf_win = win;
+#elif defined EZ_BASE_MEMORY
+    ezx.dbuf_win = win;
 #endif /* EZ_BASE_ */
 }
 
@@ -2254,19 +3386,305 @@ void ez_dbuf_swap (Ez_window win)
 #ifdef EZ_BASE_XLIB
     XdbeSwapInfo swap_info[1];
     swap_info[0].swap_window = win;
-    swap_info[0].swap_action = XdbeUndefined;
+    /* Keep the back buffer, in which only the damaged area is redrawn */
+    swap_info[0].swap_action = XdbeCopied;
     XdbeSwapBuffers (ezx.display, swap_info, 1);
 #elif defined EZ_BASE_WIN32
     ez_cur_win (None);
     ezx.dbuf_win = None;
     ez_cur_win (win);
-    BitBlt (ezx.hdc, 0, 0, ezx.dbuf_w, ezx.dbuf_h, ezx.dbuf_dc, 0, 0, SRCCOPY);
+    if (win == ezx.clip_win)
+         BitBlt (ezx.hdc, ezx.clip_x, ezx.clip_y, ezx.clip_w, ezx.clip_h,
+             ezx.dbuf_dc, ezx.clip_x, ezx.clip_y, SRCCOPY);
+    else BitBlt (ezx.hdc, 0, 0, ezx.dbuf_w, ezx.dbuf_h, ezx.dbuf_dc, 0, 0, SRCCOPY);
     SelectObject (ezx.dbuf_dc, ezx.hOldBmp);
     DeleteObject (ezx.hMemBmp);
+#elif defined EZ_BASE_MEMORY
+    int y, k;
+    ezx.dbuf_win = None;
+    if (win == ezx.clip_win) {
+        for (y = ezx.clip_y; y < ezx.clip_y + ezx.clip_h; y++) {
+            k = (y * win->width + ezx.clip_x) * 4;
+            memcpy (win->pixels_rgba + k, ezx.dbuf_pix + k, ezx.clip_w * 4);
+        }
+    } else memcpy (win->pixels_rgba, ezx.dbuf_pix, win->width * win->height * 4);
 #endif /* EZ_BASE_ */
 }
 
 
+/*
+ * Merge the area x,y,w,h into the damaged area of win.
+ * Return 1 if the damaged area was empty, 0 if not, -1 on error.
+*/
+
+int ez_damage_add (Ez_window win, int x, int y, int w, int h)
+{
+    Ez_win_info *info;
+
+    if (ez_info_get (win, &info) < 0) return -1;
+
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (w <= 0 || h <= 0) return 0;
+
+    if (info->dmg_x2 <= info->dmg_x1) {
+        info->dmg_x1 = x;   info->dmg_y1 = y;
+        info->dmg_x2 = x+w; info->dmg_y2 = y+h;
+        return 1;
+    }
+    info->dmg_x1 = EZ_MIN(info->dmg_x1, x);
+    info->dmg_y1 = EZ_MIN(info->dmg_y1, y);
+    info->dmg_x2 = EZ_MAX(info->dmg_x2, x+w);
+    info->dmg_y2 = EZ_MAX(info->dmg_y2, y+h);
+    return 0;
+}
+
+
+/*
+ * Move the damaged area of ev->win to ev->clip_x, clip_y, clip_w, clip_h,
+ * then clip the drawings to it, unless it is the whole window.
+ * Return 0 on success, -1 if there is nothing to redraw.
+*/
+
+int ez_clip_begin (Ez_event *ev)
+{
+    Ez_win_info *info;
+    int w, h;
+
+    ezx.clip_win = None;
+    if (ez_info_get (ev->win, &info) < 0) return -1;
+    if (info->dmg_x2 <= info->dmg_x1) return -1;
+
+    ez_window_get_size (ev->win, &w, &h);
+    ev->clip_x = info->dmg_x1;
+    ev->clip_y = info->dmg_y1;
+    ev->clip_w = EZ_MIN(info->dmg_x2, w) - ev->clip_x;
+    ev->clip_h = EZ_MIN(info->dmg_y2, h) - ev->clip_y;
+    info->dmg_x1 = info->dmg_y1 = info->dmg_x2 = info->dmg_y2 = 0;
+    if (ev->clip_w <= 0 || ev->clip_h <= 0) return -1;
+
+    if (ez_draw_debug())
+        printf ("ez_clip_begin  win 0x%x  %d,%d %dx%d of %dx%d\n",
+            ez_window_get_id(ev->win), ev->clip_x, ev->clip_y,
+            ev->clip_w, ev->clip_h, w, h);
+
+    if (ev->clip_w == w && ev->clip_h == h) return 0;
+
+    ezx.clip_win = ev->win;
+    ezx.clip_x = ev->clip_x; ezx.clip_y = ev->clip_y;
+    ezx.clip_w = ev->clip_w; ezx.clip_h = ev->clip_h;
+#ifdef EZ_BASE_XLIB
+    ez_clip_gc (ev->win);
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (None);  /* The next DC will be clipped */
+#endif /* EZ_BASE_ */
+    return 0;
+}
+
+
+/*
+ * Stop clipping the drawings after an Expose.
+*/
+
+void ez_clip_end (void)
+{
+    if (ezx.clip_win == None) return;
+    ezx.clip_win = None;
+#ifdef EZ_BASE_XLIB
+    ez_clip_gc (None);
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (None);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Confine the area x,y,w,h drawn in win, read from src_x,src_y, to the
+ * damaged area being redrawn. Return 0 if something remains, else -1.
+*/
+
+int ez_clip_area (Ez_window win, int *x, int *y, int *src_x, int *src_y,
+    int *w, int *h)
+{
+    int d;
+
+#ifdef EZ_BASE_XLIB
+    /* win may be the back buffer of the window */
+    if (!ez_clip_target (win)) return *w > 0 && *h > 0 ? 0 : -1;
+#else
+    if (win != ezx.clip_win) return *w > 0 && *h > 0 ? 0 : -1;
+#endif /* EZ_BASE_ */
+
+    d = ezx.clip_x - *x;
+    if (d > 0) { *x += d; *src_x += d; *w -= d; }
+    d = ezx.clip_y - *y;
+    if (d > 0) { *y += d; *src_y += d; *h -= d; }
+    d = *x + *w - (ezx.clip_x + ezx.clip_w);
+    if (d > 0) *w -= d;
+    d = *y + *h - (ezx.clip_y + ezx.clip_h);
+    if (d > 0) *h -= d;
+
+    return *w > 0 && *h > 0 ? 0 : -1;
+}
+
+
+#ifdef EZ_BASE_XLIB
+
+/*
+ * Return 1 if d is the window being redrawn or its back buffer, else 0.
+*/
+
+int ez_clip_target (Drawable d)
+{
+    if (ezx.clip_win == None || d == None) return 0;
+    return d == ezx.clip_win ||
+           (d == ezx.dbuf_pix && ezx.dbuf_win == ezx.clip_win);
+}
+
+
+/*
+ * Set the clip of the GC to the damaged area being redrawn if d is its
+ * window or back buffer, else remove it (to draw in another window or in
+ * a pixmap for instance). The shadow of the GC spares the requests.
+*/
+
+void ez_clip_gc (Drawable d)
+{
+    if (ez_clip_target (d))
+         ez_gc_set_clip_rect (ezx.clip_x, ezx.clip_y, ezx.clip_w, ezx.clip_h);
+    else ez_gc_set_clip_mask (None, 0, 0);
+}
+
+
+/*
+ * Return the drawable where to draw for win, that is its back buffer
+ * if it is double buffered, after setting the clip of the GC for it.
+*/
+
+Drawable ez_gc_drawable (Ez_window win)
+{
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_clip_gc (win);
+    return win;
+}
+
+
+/*
+ * Initialize the shadow of the state of gc.
+*/
+
+void ez_gc_init (void)
+{
+    XGCValues v;
+
+    XGetGCValues (ezx.display, ezx.gc, GCForeground | GCFont, &v);
+    ezx.gcs.foreground = v.foreground;
+    ezx.gcs.font = v.font;
+    XSetLineAttributes (ezx.display, ezx.gc, 0, LineSolid, CapRound, JoinRound);
+    ezx.gcs.line_width = 0;
+    XSetClipMask (ezx.display, ezx.gc, None);
+    ezx.gcs.clip = EZ_CLIP_NONE;
+    ezx.gcs.clip_mask = None;
+    ezx.gcs.clip_x = ezx.gcs.clip_y = 0;
+    ezx.gcs.fill_style = FillSolid;
+    ezx.gcs.tile = None;
+    ezx.gcs.ts_x = ezx.gcs.ts_y = 0;
+    ezx.gcs.changes = 0;
+}
+
+
+/*
+ * Change the state of gc, only if different from its shadow.
+*/
+
+void ez_gc_set_foreground (Ez_uint32 pixel)
+{
+    if (ezx.gcs.foreground == pixel) return;
+    XSetForeground (ezx.display, ezx.gc, pixel);
+    ezx.gcs.foreground = pixel;
+    ezx.gcs.changes++;
+}
+
+void ez_gc_set_line_width (int width)
+{
+    if (ezx.gcs.line_width == width) return;
+    XSetLineAttributes (ezx.display, ezx.gc, width,
+        LineSolid, CapRound, JoinRound);
+    ezx.gcs.line_width = width;
+    ezx.gcs.changes++;
+}
+
+void ez_gc_set_font (Font font)
+{
+    if (ezx.gcs.font == font) return;
+    XSetFont (ezx.display, ezx.gc, font);
+    ezx.gcs.font = font;
+    ezx.gcs.changes++;
+}
+
+/* Clip with a mask at x,y, or remove the clip if mask is None */
+void ez_gc_set_clip_mask (Pixmap mask, int x, int y)
+{
+    if (mask == None) {
+        if (ezx.gcs.clip == EZ_CLIP_NONE) return;
+        XSetClipMask (ezx.display, ezx.gc, None);
+        ezx.gcs.clip = EZ_CLIP_NONE;
+        ezx.gcs.changes++;
+        return;
+    }
+    if (ezx.gcs.clip != EZ_CLIP_MASK || ezx.gcs.clip_mask != mask) {
+        XSetClipMask (ezx.display, ezx.gc, mask);
+        ezx.gcs.clip = EZ_CLIP_MASK;
+        ezx.gcs.clip_mask = mask;
+        ezx.gcs.changes++;
+    }
+    /* XSetClipRectangles moved the origin to 0,0 */
+    if (ezx.gcs.clip_x != x || ezx.gcs.clip_y != y) {
+        XSetClipOrigin (ezx.display, ezx.gc, x, y);
+        ezx.gcs.clip_x = x; ezx.gcs.clip_y = y;
+        ezx.gcs.changes++;
+    }
+}
+
+void ez_gc_set_clip_rect (int x, int y, int w, int h)
+{
+    XRectangle *r = &ezx.gcs.clip_rect;
+
+    if (ezx.gcs.clip == EZ_CLIP_RECT &&
+        r->x == x && r->y == y && r->width == w && r->height == h) return;
+    r->x = x; r->y = y; r->width = w; r->height = h;
+    XSetClipRectangles (ezx.display, ezx.gc, 0, 0, r, 1, YXBanded);
+    ezx.gcs.clip = EZ_CLIP_RECT;
+    ezx.gcs.clip_x = ezx.gcs.clip_y = 0;
+    ezx.gcs.changes++;
+}
+
+void ez_gc_set_fill_style (int style)
+{
+    if (ezx.gcs.fill_style == style) return;
+    XSetFillStyle (ezx.display, ezx.gc, style);
+    ezx.gcs.fill_style = style;
+    ezx.gcs.changes++;
+}
+
+/* Tile for FillTiled, with its origin at x,y */
+void ez_gc_set_tile (Pixmap tile, int x, int y)
+{
+    if (ezx.gcs.tile != tile) {
+        XSetTile (ezx.display, ezx.gc, tile);
+        ezx.gcs.tile = tile;
+        ezx.gcs.changes++;
+    }
+    if (ezx.gcs.ts_x != x || ezx.gcs.ts_y != y) {
+        XSetTSOrigin (ezx.display, ezx.gc, x, y);
+        ezx.gcs.ts_x = x; ezx.gcs.ts_y = y;
+        ezx.gcs.changes++;
+    }
+}
+
+#endif /* EZ_BASE_ */
+
+
 /*
  * Initialize the fonts.
 */
@@ -2299,6 +3717,10 @@ void ez_font_delete (void)
     for (i = 0; i < EZ_FONT_MAX; i++)
     if (ezx.font[i] != 0)
        { DeleteObject (ezx.font[i]); ezx.font[i] = NULL; }
+#elif defined EZ_BASE_MEMORY
+    int i;
+    for (i = 0; i < EZ_FONT_MAX; i++)
+       { free (ezx.font[i]); ezx.font[i] = NULL; }
 #endif /* EZ_BASE_ */
 }
 
@@ -2975,5 +4397,17 @@ char *ez_win_msg_name (unsigned int m)
     return "*** UNKNOWN ***";
 }
 
+#elif defined EZ_BASE_MEMORY
+
+/*
+ * Compute a color for R,G,B levels between 0 and 255, as on a 24 bits
+ * TrueColor visual.
+*/
+
+Ez_uint32 ez_get_RGB_memory (Ez_uint8 r, Ez_uint8 g, Ez_uint8 b)
+{
+     return (Ez_uint32) r << 16 | (Ez_uint32) g << 8 | b;
+}
+
 #endif /* EZ_BASE_ */
 
@@ -12,7 +12,10 @@
 #ifndef EZ_DRAW__H
 #define EZ_DRAW__H
 
-#ifndef _WIN32
+/* Compile with -DEZ_BASE_MEMORY to draw in memory, without any display */
+#if defined EZ_BASE_MEMORY
+/* Headless: windows are RGBA surfaces */
+#elif !defined _WIN32
 #define EZ_BASE_XLIB 1
 #else
 #define EZ_BASE_WIN32 1
@@ -52,11 +55,18 @@
 #include <windowsx.h>
 #include <wingdi.h>
 
+#elif defined EZ_BASE_MEMORY
+
+#include <sys/time.h>
+#include <sys/select.h>
+#include <math.h>
+
 #endif /* EZ_BASE_ */
 
 /* Miscellaneous constants */
 #define EZ_FONT_MAX    16
 #define EZ_WIN_MAX   1024
+#define EZ_BATCH_MAX  256
 
 typedef   signed char  Ez_int8;
 typedef unsigned char  Ez_uint8;
@@ -64,6 +74,7 @@ typedef unsigned short Ez_uint16;
 typedef   signed short Ez_int16;
 typedef unsigned int   Ez_uint32;
 typedef   signed int   Ez_int32;
+typedef   signed long long Ez_int64;
 typedef unsigned int   Ez_uint;
 
 /* Produce a compiler error if size is wrong */
@@ -76,6 +87,17 @@ typedef Ez_uint8 Ez_validate_uint32[sizeof (Ez_uint32)==4 ? 1 : -1];
 typedef Window Ez_window;
 #elif defined EZ_BASE_WIN32
 typedef HWND Ez_window;
+#elif defined EZ_BASE_MEMORY
+/* A window is a surface whose pixels have the layout of Ez_image */
+typedef struct {
+    int id;                         /* Window number */
+    int width, height;              /* Size in pixels */
+    Ez_uint8 *pixels_rgba;          /* width*height*4 bytes, alpha unused */
+    void *prop;                     /* Data associated to the window */
+    int mapped;                     /* Shown or hidden */
+    int expose, configure;          /* Pending events */
+} Ez_surface;
+typedef Ez_surface *Ez_window;
 #endif /* EZ_BASE_ */
 
 /* Colors */
@@ -97,14 +119,40 @@ typedef struct {
     Ez_uint32 palette[6][6][6];
     XColor samples[256];
 } Ez_PseudoColor;
+
+/* Shadow of the GC state, to send only the changes to the server */
+enum { EZ_CLIP_NONE, EZ_CLIP_MASK, EZ_CLIP_RECT };
+
+typedef struct {
+    Ez_uint32 foreground;           /* XSetForeground */
+    int line_width;                 /* XSetLineAttributes */
+    Font font;                      /* XSetFont */
+    int clip;                       /* EZ_CLIP_NONE, _MASK or _RECT */
+    Pixmap clip_mask;               /* XSetClipMask */
+    int clip_x, clip_y;             /* XSetClipOrigin of the mask */
+    XRectangle clip_rect;           /* XSetClipRectangles */
+    int fill_style;                 /* XSetFillStyle */
+    Pixmap tile;                    /* XSetTile */
+    int ts_x, ts_y;                 /* XSetTSOrigin */
+    int changes;                    /* Number of changes sent */
+} Ez_gc_state;
+#elif defined EZ_BASE_MEMORY
+/* Built-in fixed font: 8x8 glyphs scaled to width x height */
+typedef struct {
+    int width, height, ascent;
+} Ez_memfont;
 #endif /* EZ_BASE_ */
 
-/* Timers handling */
-#define EZ_TIMER_MAX 100
+/* Timers handling: identifier = serial number << EZ_TIMER_SLOT_BITS | slot+1 */
+#define EZ_TIMER_SLOT_BITS  20
+#define EZ_TIMER_SLOT_MASK  ((1 << EZ_TIMER_SLOT_BITS) - 1)
+#define EZ_TIMER_SERIAL_MAX ((1 << (31 - EZ_TIMER_SLOT_BITS)) - 1)
 
 typedef struct {
     Ez_window win;
-    struct timeval expiration;
+    Ez_int64 expiration;            /* In ns on the monotonic clock */
+    Ez_int64 period;                /* Delay to repeat in ns, 0 = once */
+    int id;                         /* Identifier, > 0 */
 } Ez_timer;
 
 /* To display text */
@@ -130,6 +178,15 @@ typedef POINT XPoint;
 #define True  TRUE
 #define False FALSE
 #define None  NULL
+#elif defined EZ_BASE_MEMORY
+typedef Ez_uint8 *XdbeBackBuffer;
+typedef int XEvent;
+typedef unsigned long KeySym;
+typedef int XContext;
+typedef struct { short x, y; } XPoint;
+#define True  1
+#define False 0
+#define None  NULL
 #endif /* EZ_BASE_ */
 
 /* Catchall type used by all functions */
@@ -146,7 +203,7 @@ typedef struct {
     Visual *visual;                 /* For colors */
     Ez_PseudoColor pseudoColor;     /* Palette indexed on 256 colors */
     Ez_TrueColor   trueColor;       /* RGB channels stored in the pixels */
-    Ez_uint32 pixcolor;
+    Ez_gc_state gcs;                /* State of gc */
 #elif defined EZ_BASE_WIN32
     HINSTANCE hand_prog;            /* Handle on the program */
     WNDCLASSEX wnd_class;           /* Extended window class */
@@ -162,9 +219,14 @@ typedef struct {
     KeySym key_sym;                 /* Key symbol: XK_Space, XK_q, etc */
     char  *key_name;                /* For printing: "XK_Space", "XK_q", .. */
     char  *key_string;              /* Corresponding string: " ", "q", etc */
-    struct timeval start_time;      /* Initial date */
     LARGE_INTEGER start_count;      /* Counter to compute time */
-    double perf_freq;               /* Frequency to compute time */
+    Ez_int64 count_freq;            /* Counts per second, 0 if none */
+#elif defined EZ_BASE_MEMORY
+    XdbeBackBuffer dbuf_pix;        /* Current double buffer */
+    Ez_window dbuf_win;             /* Current double-buffered window */
+    Ez_memfont *font[EZ_FONT_MAX];  /* To store the fonts */
+    Ez_uint32 rgba;                 /* Current color as RGBA bytes */
+    int win_id;                     /* Last window number */
 #endif /* EZ_BASE_ */
     int display_width;              /* Display width */
     int display_height;             /* Display height */
@@ -175,10 +237,18 @@ typedef struct {
     Ez_uint32 color;                /* Current color */
     int thick;                      /* Current thickness */
     int nfont;                      /* Current font number */
-    Ez_timer timer_l[EZ_TIMER_MAX]; /* Timers list */
+    Ez_timer *timer_l;              /* Timers heap, first to expire in 0 */
     int timer_nb;                   /* Timers number */
+    int timer_max;                  /* Size of timer_l and timer_pos */
+    int *timer_pos;                 /* Position in timer_l of each slot */
+    int timer_slots;                /* Number of slots used or free */
+    int timer_free;                 /* First free slot, -1 if none */
+    int timer_serial;               /* Last serial number of identifier */
     int main_loop;                  /* Main loop flag */
     int last_expose;                /* Last Expose flag */
+    Ez_window clip_win;             /* Window redrawn in a damaged area */
+    int clip_x, clip_y;             /* Damaged area of clip_win */
+    int clip_w, clip_h;
     int auto_quit;                  /* Close button flag */
     int mouse_b;                    /* Mouse button pressed */
     Ez_window win_l[EZ_WIN_MAX];    /* Windows list */
@@ -189,8 +259,8 @@ typedef struct {
     char ifont;
 } Ez_X;
 
-#ifdef EZ_BASE_WIN32
-/* Events of X11/X.h for Win32 */
+#if defined EZ_BASE_WIN32 || defined EZ_BASE_MEMORY
+/* Events of X11/X.h for Win32 and memory */
 #define  KeyPress           2
 #define  KeyRelease         3
 #define  ButtonPress        4
@@ -200,6 +270,9 @@ typedef struct {
 #define  ConfigureNotify   22
 #define  ClientMessage     33
 #define  LASTEvent         35
+#endif /* EZ_BASE_ */
+
+#ifdef EZ_BASE_WIN32
 /* Timer */
 #define  EZ_TIMER1        208
 /* Private messages */
@@ -220,18 +293,39 @@ typedef struct {
     char   key_name[80];            /* For printing: "XK_Space", "XK_q", .. */
     char   key_string[80];          /* Corresponding string: " ", "q", etc */
     int    key_count;               /* String length */
+    int clip_x, clip_y;             /* Area to redraw for Expose */
+    int clip_w, clip_h;
+    int timer_id;                   /* Identifier of timer for TimerNotify */
     XEvent xev;                     /* Original event */
 } Ez_event;
 
 /* Type of a callback */
 typedef void (*Ez_func)(Ez_event *ev);
 
+/* Statistics of the frames of ez_set_frame_rate, durations in ms */
+typedef struct {
+    double fps;                     /* Requested frame rate */
+    int frames;                     /* Frames since ez_set_frame_rate */
+    int skipped;                    /* Frames skipped because late */
+    double last_ms;                 /* Duration of the last frame */
+    double mean_ms;                 /* Mean duration of the frames */
+    double min_ms, max_ms;          /* Shortest and longest frame */
+} Ez_frame_stats;
+
 /* Data associated to a window using a xid or a property */
 typedef struct {
     Ez_func func;                   /* Callback of window */
     void *data;                     /* User-data associated to window */
     XdbeBackBuffer dbuf;            /* Back-buffer of window */
     int show;                       /* For delayed display */
+    int dmg_x1, dmg_y1;             /* Damaged area to redraw, */
+    int dmg_x2, dmg_y2;             /* empty if dmg_x2 <= dmg_x1 */
+    int timer_id;                   /* Timer of ez_start_timer, 0 if none */
+    int frame_id;                   /* Timer of ez_set_frame_rate, 0 if none */
+    Ez_int64 frame_period;          /* Delay between frames in ns */
+    Ez_int64 frame_last;            /* Date of the last frame in ns */
+    Ez_frame_stats frame_st;        /* Statistics of the frames */
+    int width, height;              /* Size cached from ConfigureNotify */
 } Ez_win_info;
 
 
@@ -245,6 +339,7 @@ void ez_window_destroy (Ez_window win);
 void ez_window_show (Ez_window win, int val);
 void ez_window_set_size (Ez_window win, int w, int h);
 void ez_window_get_size (Ez_window win, int *w, int *h);
+void ez_window_sync_size (Ez_window win);
 void ez_window_clear (Ez_window win);
 void ez_window_dbuf (Ez_window win, int val);
 void ez_set_data (Ez_window win, void *data);
@@ -252,10 +347,16 @@ void *ez_get_data (Ez_window win);
 void ez_quit (void) ;
 void ez_auto_quit (int val);
 void ez_send_expose (Ez_window win);
+void ez_window_invalidate (Ez_window win, int x, int y, int w, int h);
 void ez_start_timer (Ez_window win, int delay);
+int ez_start_timer_ex (Ez_window win, int delay, int period);
+void ez_stop_timer (int id);
+int ez_set_frame_rate (Ez_window win, double fps);
+int ez_get_frame_stats (Ez_window win, Ez_frame_stats *st);
 void ez_main_loop (void) ;
 int ez_random (int n);
 double ez_get_time (void) ;
+Ez_int64 ez_get_time_ns (void) ;
 
 Ez_uint32 (*ez_get_RGB)(Ez_uint8 r, Ez_uint8 g, Ez_uint8 b);
 Ez_uint32 ez_get_grey (Ez_uint8 g);
@@ -272,6 +373,10 @@ void ez_draw_triangle (Ez_window win, int x1, int y1, int x2, int y2, int x3, in
 void ez_fill_triangle (Ez_window win, int x1, int y1, int x2, int y2, int x3, int y3);
 void ez_draw_circle (Ez_window win, int x1, int y1, int x2, int y2);
 void ez_fill_circle (Ez_window win, int x1, int y1, int x2, int y2);
+void ez_draw_points (Ez_window win, const int *xy, int n);
+void ez_draw_lines (Ez_window win, const int *xy, int n);
+void ez_fill_rectangles (Ez_window win, const int *xy, int n);
+int ez_get_gc_changes (void) ;
 
 int ez_font_load (int num, const char *name);
 void ez_set_nfont (int num);
@@ -297,12 +402,17 @@ void ez_close_disp (void) ;
 
 #ifdef EZ_BASE_WIN32
 void ez_init_timeofday (void);
-void ez_get_systemtime (struct timeval *t);
 #endif /* EZ_BASE_ */
 
-void ez_gettimeofday (struct timeval *t);
-int ez_timer_add (Ez_window win, int delay);
+int ez_timer_grow (void) ;
+void ez_timer_place (int i, Ez_timer *t);
+void ez_timer_up (int i);
+void ez_timer_down (int i);
+void ez_timer_delete_at (int i);
+int ez_timer_add (Ez_window win, Ez_int64 delay, Ez_int64 period);
+int ez_timer_cancel (int id);
 int ez_timer_remove (Ez_window win);
+void ez_timer_expire (Ez_window *win, int *id);
 struct timeval *ez_timer_delay (void) ;
 
 #ifdef EZ_BASE_XLIB
@@ -317,6 +427,23 @@ int ez_is_modifier (KeySym key_sym);
 int ez_is_repetition (LPARAM lParam);
 void ez_cur_win (Ez_window win);
 void ez_update_pen (void) ;
+#elif defined EZ_BASE_MEMORY
+void ez_event_next (Ez_event *ev);
+void ez_event_dispatch (Ez_event *ev);
+Ez_window ez_mem_create (int w, int h);
+void ez_mem_destroy (Ez_window win);
+int ez_mem_resize (Ez_window win, int w, int h);
+Ez_uint8 *ez_mem_pixels (Ez_window win);
+Ez_uint32 ez_mem_rgba (Ez_uint32 color);
+void ez_mem_span (Ez_window win, int xa, int xb, int y, Ez_uint32 rgba);
+void ez_mem_box (Ez_window win, int xa, int ya, int xb, int yb);
+void ez_mem_dot (Ez_window win, int x, int y);
+void ez_mem_line (Ez_window win, int x1, int y1, int x2, int y2);
+void ez_mem_ellipse (Ez_window win, int x, int y, int w, int h, int fill);
+void ez_mem_triangle (Ez_window win, int x1, int y1, int x2, int y2,
+    int x3, int y3);
+void ez_mem_text (Ez_window win, int x, int y, const char *s, int n,
+    int fillbg);
 #endif /* EZ_BASE_ */
 
 void ez_random_init (void) ;
@@ -334,6 +461,11 @@ int ez_info_get (Ez_window win, Ez_win_info **info);
 int ez_func_set (Ez_window win, Ez_func func);
 int ez_func_get (Ez_window win, Ez_func *func);
 int ez_func_call (Ez_event *ev);
+int ez_frame_tick (Ez_event *ev);
+void ez_size_cache (Ez_window win, int w, int h);
+#ifdef EZ_BASE_XLIB
+void ez_geometry_get (Ez_window win, int *w, int *h);
+#endif /* EZ_BASE_ */
 
 void ez_dbuf_init (void) ;
 int ez_dbuf_set (Ez_window win, XdbeBackBuffer dbuf);
@@ -341,6 +473,25 @@ int ez_dbuf_get (Ez_window win, XdbeBackBuffer *dbuf);
 void ez_dbuf_preswap (Ez_window win);
 void ez_dbuf_swap (Ez_window win);
 
+int ez_damage_add (Ez_window win, int x, int y, int w, int h);
+int ez_clip_begin (Ez_event *ev);
+void ez_clip_end (void) ;
+int ez_clip_area (Ez_window win, int *x, int *y, int *src_x, int *src_y,
+    int *w, int *h);
+#ifdef EZ_BASE_XLIB
+int ez_clip_target (Drawable d);
+void ez_clip_gc (Drawable d);
+Drawable ez_gc_drawable (Ez_window win);
+void ez_gc_init (void) ;
+void ez_gc_set_foreground (Ez_uint32 pixel);
+void ez_gc_set_line_width (int width);
+void ez_gc_set_font (Font font);
+void ez_gc_set_clip_mask (Pixmap mask, int x, int y);
+void ez_gc_set_clip_rect (int x, int y, int w, int h);
+void ez_gc_set_fill_style (int style);
+void ez_gc_set_tile (Pixmap tile, int x, int y);
+#endif /* EZ_BASE_ */
+
 void ez_font_init (void) ;
 void ez_font_delete (void) ;
 int ez_color_init (void) ;
@@ -357,13 +508,15 @@ Ez_uint32 ez_get_RGB_win32 (Ez_uint8 r, Ez_uint8 g, Ez_uint8 b);
 int ez_keydown_convert (WPARAM wParam, LPARAM lParam, KeySym *k, char **n, char **s);
 int ez_keychar_convert (WPARAM wParam, KeySym *k, char **n, char **s);
 char *ez_win_msg_name (unsigned int m);
+#elif defined EZ_BASE_MEMORY
+Ez_uint32 ez_get_RGB_memory (Ez_uint8 r, Ez_uint8 g, Ez_uint8 b);
 #endif /* EZ_BASE_ */
 
 #endif /* EZ_PRIVATE_DEFS */
 
 
-/* LATIN keyboard symbols from X11/keysymdef.h for Win32 */
-#ifdef EZ_BASE_WIN32
+/* LATIN keyboard symbols from X11/keysymdef.h for Win32 and memory */
+#if defined EZ_BASE_WIN32 || defined EZ_BASE_MEMORY
 #define XK_BackSpace                     0xff08  /* Back space, back char */
 #define XK_Tab                           0xff09
 #define XK_Return                        0xff0d  /* Return, enter */
@@ -12,6 +12,14 @@
 
 #define EZ_PRIVATE_DEFS 1
 #include "ez-image2.h"
+#include <limits.h>
+
+/* To map the image files */
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* EZ_BASE_ */
 
 /* Contains internal parameters of ez-draw.c */
 extern Ez_X ezx;
@@ -19,6 +27,20 @@ extern Ez_X ezx;
 /* Counters for debugging */
 int ez_image_count = 0, ez_pixmap_count = 0;
 
+#ifdef EZ_BASE_XLIB
+/* Scratch buffers kept between two displays of images */
+Ez_xcache ezcache = { {{ 0, 0, 0, 0, 0, NULL }}, 0, 0, EZ_XCACHE_LIMIT, 0 };
+Ez_xshm ezshm = { 0, { 0, -1, NULL, False }, NULL, 0, 0, 0 };
+Ez_xrender ezrender = { 0, NULL, NULL, NULL };
+int ez_xshm_error_flag = 0;
+#endif /* EZ_BASE_ */
+
+/* Pool of threads for the large images */
+Ez_pool ezpool;
+
+/* Current batch of ez_atlas_paint */
+Ez_atlas_batch ezbatch;
+
 
 /*---------------------- P U B L I C   I N T E R F A C E --------------------*/
 
@@ -40,6 +62,12 @@ Ez_image *ez_image_new (void)
     img->pixels_rgba = NULL;
     img->has_alpha = 0;
     img->opacity = 128;
+    img->premul = 0;
+    img->mip = NULL;
+#ifdef EZ_BASE_XLIB
+    img->xmask = None;
+    img->xmask_opacity = 0;
+#endif /* EZ_BASE_ */
 
     return img;
 }
@@ -52,6 +80,8 @@ Ez_image *ez_image_new (void)
 void ez_image_destroy (Ez_image *img)
 {
     if (img == NULL) return;
+    ez_image_invalidate (img);
+    ez_mip_free (img);
     if (img->pixels_rgba != NULL) free (img->pixels_rgba);
     free (img);
 
@@ -104,6 +134,7 @@ Ez_image *ez_image_dup (Ez_image *img)
     memcpy (res->pixels_rgba, img->pixels_rgba, img->width * img->height * 4);
     res->has_alpha = img->has_alpha;
     res->opacity   = img->opacity;
+    res->premul    = img->premul;
     return res;
 }
 
@@ -147,6 +178,65 @@ Ez_image *ez_image_load (const char *filename)
 }
 
 
+/*
+ * Load an image from a file filename, reduced to fit in max_w x max_h if it
+ * is larger, keeping its aspect ratio; for thumbnails. A JPEG file is decoded
+ * directly at 1/2, 1/4 or 1/8 of its size when that still covers the result,
+ * then as for the other formats, the image is resized with EZ_FILTER_BOX.
+ * Return the image, else NULL.
+ */
+
+Ez_image *ez_image_load_scaled (const char *filename, int max_w, int max_h)
+{
+    Ez_image *img, *res;
+    int nbytes, w, h;
+    double time1 = 0, time2 = 0;
+
+    if (max_w <= 0 || max_h <= 0) {
+        ez_error ("ez_image_load_scaled: bad size %d %d\n", max_w, max_h);
+        return NULL;
+    }
+
+    img = ez_image_new ();
+    if (img == NULL) return NULL;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    img->pixels_rgba = ez_stbi_load_scaled (filename, &img->width, &img->height,
+        &nbytes, EZ_STBI_RGB_ALPHA, max_w, max_h);
+    if (img->pixels_rgba == NULL) {
+        ez_error ("ez_image_load_scaled: can't load file \"%s\"\n", filename);
+        ez_image_destroy (img);
+        return NULL;
+    }
+    img->has_alpha = nbytes == 4;
+
+    if (ez_image_debug()) {
+        time2 = ez_get_time ();
+        printf ("ez_image_load_scaled  file \"%s\"  decoded in %.3f ms  "
+                "w = %d  h = %d\n", filename, (time2-time1)*1000,
+                img->width, img->height);
+    }
+
+    if (img->width <= max_w && img->height <= max_h) return img;
+
+    /* Fit in max_w x max_h */
+    if ((double) img->width * max_h > (double) img->height * max_w) {
+        w = max_w;
+        h = (double) img->height * max_w / img->width + 0.5;
+    } else {
+        h = max_h;
+        w = (double) img->width * max_h / img->height + 0.5;
+    }
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+
+    res = ez_image_resize (img, w, h, EZ_FILTER_BOX);
+    ez_image_destroy (img);
+    return res;
+}
+
+
 /*
  * Properties has_alpha and opacity
 */
@@ -154,7 +244,9 @@ Ez_image *ez_image_load (const char *filename)
 void ez_image_set_alpha (Ez_image *img, int has_alpha)
 {
     if (img == NULL) return;
-    img->has_alpha = has_alpha ? 1 : 0;
+    has_alpha = has_alpha ? 1 : 0;
+    if (has_alpha != img->has_alpha) ez_image_invalidate (img);
+    img->has_alpha = has_alpha;
 }
 
 
@@ -179,6 +271,36 @@ int ez_image_get_opacity (Ez_image *img)
 }
 
 
+/*
+ * Property premul: if true, the colors are stored multiplied by alpha,
+ * which speeds up ez_image_blend. Setting it converts the pixels.
+ * The images are displayed with their straight colors anyway.
+*/
+
+void ez_image_set_premul (Ez_image *img, int premul)
+{
+    Ez_band b;
+
+    if (img == NULL) return;
+    premul = premul ? 1 : 0;
+    if (premul == img->premul) return;
+    ez_image_invalidate (img);
+
+    ez_band_init (&b, ez_band_premul, img, NULL, 0, 0, 0, 0, img->width,
+        img->height);
+    b.op = premul;
+    ez_parallel_rows (&b, img->height, img->width);
+    img->premul = premul;
+}
+
+
+int ez_image_get_premul (Ez_image *img)
+{
+    if (img == NULL) return 0;
+    return img->premul;
+}
+
+
 /*
  * Display an image or a rectangular region of the image img in the
  * window win, with the upper left corner of the image at the x,y
@@ -205,12 +327,27 @@ void ez_image_paint_sub (Ez_window win, Ez_image *img, int x, int y,
     x += src_x - src_x_old;
     y += src_y - src_y_old;
 
+    /* During an Expose, only the damaged area is converted */
+    if (ez_clip_area (win, &x, &y, &src_x, &src_y, &w, &h) < 0) return;
+
+    /* The area is displayed with straight colors */
+    if (img->premul) {
+        Ez_image *tmp = ez_image_extract (img, src_x, src_y, w, h);
+        if (tmp == NULL) return;
+        ez_image_set_premul (tmp, 0);
+        ez_image_paint_sub (win, tmp, x, y, 0, 0, w, h);
+        ez_image_destroy (tmp);
+        return;
+    }
+
 #ifdef EZ_BASE_XLIB
     if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
     ez_image_draw_xi (win, img, x, y, src_x, src_y, w, h);
 #elif defined EZ_BASE_WIN32
     ez_cur_win (win);
     ez_image_draw_dib (ezx.hdc, img, x, y, src_x, src_y, w, h);
+#elif defined EZ_BASE_MEMORY
+    ez_image_draw_mem (win, img, x, y, src_x, src_y, w, h);
 #endif /* EZ_BASE_ */
 }
 
@@ -238,9 +375,17 @@ void ez_image_print (Ez_image *img, int src_x, int src_y, int w, int h)
 
 void ez_image_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b, Ez_uint8 a)
 {
+    Ez_uint8 c[4];
+
     if (img == NULL) return;
 
+    if (img->premul) {
+        c[0] = r; c[1] = g; c[2] = b; c[3] = a;
+        ez_premul_row (c, c, 1);
+        r = c[0]; g = c[1]; b = c[2];
+    }
     ez_image_comp_fill_rgba (img, r, g, b, a);
+    ez_image_invalidate (img);
 }
 
 
@@ -273,6 +418,51 @@ void ez_image_blend_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
     if (src->has_alpha)
          ez_image_comp_blend (dst, src, dst_x, dst_y, src_x, src_y, w, h);
     else ez_image_comp_over  (dst, src, dst_x, dst_y, src_x, src_y, w, h);
+    ez_image_invalidate (dst);
+}
+
+
+/*
+ * Composite a region of image src into the image dst with the operator op:
+ * the Porter-Duff operators EZ_OP_CLEAR .. EZ_OP_XOR, or EZ_OP_ADD,
+ * EZ_OP_MULTIPLY, EZ_OP_SCREEN. The colors of src are first multiplied by
+ * the constant alpha between 0 and 255.
+ * An image without alpha channel is considered as opaque. The result is
+ * computed with premultiplied colors, then stored as dst is.
+ * If the coordinates go beyond the images src or dst, just the common region
+ * is composited.
+*/
+
+void ez_image_composite (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int op, int alpha)
+{
+    if (src == NULL) return;
+    ez_image_composite_sub (dst, src, dst_x, dst_y, 0, 0,
+        src->width, src->height, op, alpha);
+}
+
+
+void ez_image_composite_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h, int op, int alpha)
+{
+    int src_x_old = src_x, src_y_old = src_y, dst_x_old, dst_y_old;
+
+    if (op < 0 || op >= EZ_OP_LAST) {
+        ez_error ("ez_image_composite_sub: bad operator %d\n", op);
+        return;
+    }
+    if (alpha < 0) alpha = 0;
+    if (alpha > 255) alpha = 255;
+
+    if (ez_image_confine_sub_coords (src, &src_x, &src_y, &w, &h) < 0) return;
+    dst_x += src_x - src_x_old; dst_x_old = dst_x;
+    dst_y += src_y - src_y_old; dst_y_old = dst_y;
+    if (ez_image_confine_sub_coords (dst, &dst_x, &dst_y, &w, &h) < 0) return;
+    src_x += dst_x - dst_x_old;
+    src_y += dst_y - dst_y_old;
+
+    ez_image_comp_op (dst, src, dst_x, dst_y, src_x, src_y, w, h, op, alpha);
+    ez_image_invalidate (dst);
 }
 
 
@@ -292,6 +482,7 @@ Ez_image *ez_image_extract (Ez_image *img, int src_x, int src_y, int w, int h)
     if (res == NULL) return NULL;
     res->has_alpha = img->has_alpha;
     res->opacity   = img->opacity;
+    res->premul    = img->premul;
 
     ez_image_copy_sub (img, res, src_x, src_y);
 
@@ -314,6 +505,7 @@ Ez_image *ez_image_sym_ver (Ez_image *img)
     if (res == NULL) return NULL;
     res->has_alpha = img->has_alpha;
     res->opacity   = img->opacity;
+    res->premul    = img->premul;
 
     ez_image_comp_symv (img, res);
     return res;
@@ -330,6 +522,7 @@ Ez_image *ez_image_sym_hor (Ez_image *img)
     if (res == NULL) return NULL;
     res->has_alpha = img->has_alpha;
     res->opacity   = img->opacity;
+    res->premul    = img->premul;
 
     ez_image_comp_symh (img, res);
     return res;
@@ -343,7 +536,7 @@ Ez_image *ez_image_sym_hor (Ez_image *img)
 
 Ez_image *ez_image_scale (Ez_image *img, double factor)
 {
-    Ez_image *res;
+    int w, h;
 
     if (img == NULL) return NULL;
 
@@ -354,15 +547,39 @@ Ez_image *ez_image_scale (Ez_image *img, double factor)
     if (factor == 1)
         return ez_image_dup (img);
 
-    res = ez_image_create (img->width*factor, img->height*factor);
-    if (res == NULL) return NULL;
-    res->has_alpha = 1;
-    res->opacity   = img->opacity;
+    /* A small factor still gives an image of at least 1x1 */
+    w = img->width*factor;  if (w < 1) w = 1;
+    h = img->height*factor; if (h < 1) h = 1;
 
-    if (factor > 1)
-         ez_image_expand (img, res, factor);
-    else ez_image_shrink (img, res, factor);
-    return res;
+    return ez_image_resize (img, w, h,
+        factor > 1 ? EZ_FILTER_BILINEAR : EZ_FILTER_BOX);
+}
+
+
+/*
+ * Resize an image to w,h with a filter among EZ_FILTER_NEAREST, _BILINEAR,
+ * _BOX (averages the pixels, for thumbnails), _BICUBIC and _LANCZOS3 (the
+ * sharpest, but the slowest). Reductions start from the mipmap of img, if
+ * any; see ez_image_set_mipmap.
+ * Return new image, else NULL.
+*/
+
+Ez_image *ez_image_resize (Ez_image *img, int w, int h, int filter)
+{
+    if (img == NULL) return NULL;
+
+    if (w <= 0 || h <= 0) {
+        ez_error ("ez_image_resize: bad size %d %d\n", w, h);
+        return NULL;
+    }
+    if (filter < EZ_FILTER_NEAREST || filter > EZ_FILTER_LANCZOS3) {
+        ez_error ("ez_image_resize: bad filter %d\n", filter);
+        return NULL;
+    }
+
+    if (img->mip != NULL && w < img->width && h < img->height)
+        return ez_mip_resize (img, w, h, filter);
+    return ez_image_resize_to (img, w, h, filter);
 }
 
 
@@ -385,10 +602,13 @@ Ez_image *ez_image_rotate (Ez_image *img, double theta, int quality)
     if (res == NULL) return NULL;
     res->has_alpha = 1;
     res->opacity   = img->opacity;
+    res->premul    = img->premul;
 
-    if (quality)
-         ez_image_rotate_bilinear (img, res, theta);
-    else ez_image_rotate_nearest  (img, res, theta);
+    if ((quality ? ez_image_rotate_bilinear (img, res, theta)
+                 : ez_image_rotate_nearest  (img, res, theta)) < 0) {
+        ez_image_destroy (res);
+        return NULL;
+    }
     return res;
 }
 
@@ -408,6 +628,122 @@ void ez_image_rotate_point (Ez_image *img, double theta, int src_x, int src_y,
 }
 
 
+/*
+ * Transform image src into image dst by the affine matrix {a, b, c, d, e, f},
+ * which maps a point x,y of src to the point a*x + b*y + c, d*x + e*y + f of
+ * dst; for instance {1, 0, 10, 0, 1, 20} is a translation of 10,20.
+ * filter is EZ_FILTER_NEAREST or EZ_FILTER_BILINEAR; the other filters are
+ * taken as bilinear. The pixels of dst outside the image of src are left
+ * unchanged.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_transform (Ez_image *src, Ez_image *dst, const double matrix[6],
+    int filter)
+{
+    const double *m = matrix;
+    double det, inv[6];
+
+    if (src == NULL || dst == NULL || m == NULL) return -1;
+
+    if (src == dst) {
+        ez_error ("ez_image_transform: src and dst must be different\n");
+        return -1;
+    }
+    if (src->premul != dst->premul) {
+        ez_error ("ez_image_transform: src and dst must be both premultiplied "
+                  "or not\n");
+        return -1;
+    }
+
+    det = m[0]*m[4] - m[1]*m[3];
+    if (fabs (det) < 1E-9) {
+        ez_error ("ez_image_transform: singular matrix\n");
+        return -1;
+    }
+
+    /* Inverse matrix, mapping the points of dst to those of src */
+    inv[0] =  m[4]/det; inv[1] = -m[1]/det; inv[2] = (m[1]*m[5] - m[4]*m[2])/det;
+    inv[3] = -m[3]/det; inv[4] =  m[0]/det; inv[5] = (m[3]*m[2] - m[0]*m[5])/det;
+
+    if (ez_transform_inv (src, dst, inv, filter) < 0) return -1;
+    if (src->has_alpha) dst->has_alpha = 1;
+    ez_image_invalidate (dst);
+    return 0;
+}
+
+
+/*
+ * Keep a mipmap pyramid of img, for an image repeatedly reduced at various
+ * sizes: with EZ_MIPMAP_NEAREST, ez_image_resize and ez_image_scale start from
+ * the smallest level, halved as many times as possible, still larger than the
+ * target; with EZ_MIPMAP_TRILINEAR, they blend it moreover with the next level,
+ * so that a continuous zoom has no jumps. The levels are built on demand;
+ * EZ_MIPMAP_NONE (the default) frees them.
+*/
+
+void ez_image_set_mipmap (Ez_image *img, int mode)
+{
+    Ez_mipmap *mip;
+
+    if (img == NULL) return;
+
+    if (mode < EZ_MIPMAP_NONE || mode > EZ_MIPMAP_TRILINEAR) {
+        ez_error ("ez_image_set_mipmap: bad mode %d\n", mode);
+        return;
+    }
+    if (mode == EZ_MIPMAP_NONE) {
+        ez_mip_free (img);
+        return;
+    }
+    if (img->mip == NULL) {
+        mip = malloc (sizeof(Ez_mipmap));
+        if (mip == NULL) {
+            ez_error ("ez_image_set_mipmap: out of memory\n");
+            return;
+        }
+        mip->nb = 0;
+        img->mip = mip;
+    }
+    ((Ez_mipmap *) img->mip)->mode = mode;
+}
+
+
+int ez_image_get_mipmap (Ez_image *img)
+{
+    if (img == NULL || img->mip == NULL) return EZ_MIPMAP_NONE;
+    return ((Ez_mipmap *) img->mip)->mode;
+}
+
+
+/*
+ * Tell that the pixels of img have changed, so that its mipmap levels and its
+ * mask are rebuilt when needed. The functions of this module call it; call it
+ * after writing directly in img->pixels_rgba.
+*/
+
+void ez_image_invalidate (Ez_image *img)
+{
+    Ez_mipmap *mip;
+    int k;
+
+    if (img == NULL) return;
+
+#ifdef EZ_BASE_XLIB
+    if (img->xmask != None) {
+        XFreePixmap (ezx.display, img->xmask);
+        img->xmask = None;
+    }
+#endif /* EZ_BASE_ */
+
+    if (img->mip == NULL) return;
+    mip = img->mip;
+    for (k = 1; k <= mip->nb; k++)
+        ez_image_destroy (mip->level[k]);
+    mip->nb = 0;
+}
+
+
 /*
  * Allocate a pixmap, initialized to default value.
  * Return the pixmap, else NULL.
@@ -426,9 +762,14 @@ Ez_pixmap *ez_pixmap_new (void)
 #ifdef EZ_BASE_XLIB
     pix->map = None;
     pix->mask = None;
+    pix->pict = None;
+    pix->tile_mask = None;
+    pix->tile_w = pix->tile_h = 0;
 #elif defined EZ_BASE_WIN32
     pix->hmap = NULL;
     pix->has_alpha = 0;
+#elif defined EZ_BASE_MEMORY
+    pix->img = NULL;
 #endif /* EZ_BASE_ */
 
     return pix;
@@ -444,10 +785,16 @@ void ez_pixmap_destroy (Ez_pixmap *pix)
     if (pix == NULL) return;
 
 #ifdef EZ_BASE_XLIB
+    if (pix->pict != None) XRenderFreePicture (ezx.display, pix->pict);
     if (pix->map  != None) XFreePixmap (ezx.display, pix->map );
     if (pix->mask != None) XFreePixmap (ezx.display, pix->mask);
+    if (pix->tile_mask != None) XFreePixmap (ezx.display, pix->tile_mask);
+    /* The XID of map may be reused by a new pixmap */
+    if (ezx.gcs.tile == pix->map) ezx.gcs.tile = None;
 #elif defined EZ_BASE_WIN32
     if (pix->hmap != NULL) DeleteObject (pix->hmap);
+#elif defined EZ_BASE_MEMORY
+    ez_image_destroy (pix->img);
 #endif /* EZ_BASE_ */
     free (pix);
 
@@ -458,15 +805,38 @@ void ez_pixmap_destroy (Ez_pixmap *pix)
 
 
 /*
- * Create a pixmap from an image img.
+ * Create a pixmap from an image img. On X11 with the XRender extension, as on
+ * Win32, the alpha channel is kept with its 256 levels; else it is turned
+ * into a mask by the opacity.
  * Return the pixmap, else NULL.
 */
 
 Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img)
 {
     Ez_pixmap *pix;
+    int pict = 0;
+#ifdef EZ_BASE_XLIB
+    int status;
+#endif /* EZ_BASE_ */
 
     if (img == NULL) return NULL;
+
+#ifdef EZ_BASE_XLIB
+    /* With XRender, the alpha channel is kept instead of a mask */
+    pict = img->has_alpha && ez_xrender_available ();
+#endif /* EZ_BASE_ */
+
+    /* The pixmap is built from straight colors, but the picture of XRender
+       takes the premultiplied ones directly */
+    if (img->premul && !pict) {
+        Ez_image *tmp = ez_image_dup (img);
+        if (tmp == NULL) return NULL;
+        ez_image_set_premul (tmp, 0);
+        pix = ez_pixmap_create_from_image (tmp);
+        ez_image_destroy (tmp);
+        return pix;
+    }
+
     pix = ez_pixmap_new ();
     if (pix == NULL) return NULL;
 
@@ -474,7 +844,18 @@ Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img)
     pix->height = img->height;
 
 #ifdef EZ_BASE_XLIB
-    if (ez_pixmap_build_map (pix, img) < 0) {
+    if (pict) {
+        if (ez_xrender_build_map (pix, img) < 0) {
+            ez_error ("ez_pixmap_create_from_image: can't create picture\n");
+            goto free_pix;
+        }
+        return pix;
+    }
+
+    /* The GC may be clipped to the damaged area of an Expose */
+    ez_clip_gc (None);
+    status = ez_pixmap_build_map (pix, img);
+    if (status < 0) {
         ez_error ("ez_pixmap_create_from_image: can't create map\n");
         goto free_pix;
     }
@@ -493,6 +874,12 @@ Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img)
     }
     pix->has_alpha = img->has_alpha;
 
+#elif defined EZ_BASE_MEMORY
+    pix->img = ez_image_dup (img);
+    if (pix->img == NULL) {
+        ez_error ("ez_pixmap_create_from_image: can't copy image\n");
+        goto free_pix;
+    }
 #endif /* EZ_BASE_ */
 
     return pix;
@@ -519,6 +906,8 @@ void ez_pixmap_paint (Ez_window win, Ez_pixmap *pix, int x, int y)
 #elif defined EZ_BASE_WIN32
     ez_cur_win (win);
     ez_pixmap_draw_hmap (ezx.hdc, pix, x, y);
+#elif defined EZ_BASE_MEMORY
+    ez_image_draw_mem (win, pix->img, x, y, 0, 0, pix->width, pix->height);
 #endif /* EZ_BASE_ */
 }
 
@@ -539,756 +928,3719 @@ void ez_pixmap_tile (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
 #elif defined EZ_BASE_WIN32
     ez_cur_win (win);
     ez_pixmap_tile_hmap (ezx.hdc, pix, x, y, w, h);
+#elif defined EZ_BASE_MEMORY
+    ez_pixmap_tile_mem (win, pix, x, y, w, h);
 #endif /* EZ_BASE_ */
 }
 
 
-/*-------------------- P R I V A T E   F U N C T I O N S --------------------*/
-
 /*
- * Unique test of the definition of the environment variable EZ_IMAGE_DEBUG
+ * Create a sprite, which keeps the versions of img rotated at the multiples of
+ * 360/steps degrees, scaled by scale, as images and pixmaps; quality is that of
+ * ez_image_rotate. hot_x,hot_y is a point of img, the hotspot, which stays at
+ * the same place in the window whatever the angle. The versions are built on
+ * demand; the least recently used are freed to stay within a memory bound.
+ * The image img is not copied: call ez_sprite_flush after modifying it, and
+ * destroy it after the sprite.
+ * Return the sprite, else NULL.
 */
 
-int ez_image_debug (void)
+Ez_sprite *ez_sprite_create (Ez_image *img, int hot_x, int hot_y, int steps,
+    double scale, int quality)
 {
-    static int debug = -1;
-    if (debug < 0) debug = getenv ("EZ_IMAGE_DEBUG") != NULL;
-    return debug;
+    Ez_sprite *spr;
+    int k;
+
+    if (img == NULL) return NULL;
+
+    if (steps < 1) {
+        ez_error ("ez_sprite_create: bad steps number %d\n", steps);
+        return NULL;
+    }
+    if (scale <= 0) {
+        ez_error ("ez_sprite_create: bad scale factor %f\n", scale);
+        return NULL;
+    }
+
+    spr = malloc (sizeof(Ez_sprite));
+    if (spr == NULL) {
+        ez_error ("ez_sprite_create: out of memory\n");
+        return NULL;
+    }
+    spr->entry = malloc (steps * sizeof(Ez_sprite_entry));
+    if (spr->entry == NULL) {
+        ez_error ("ez_sprite_create: out of memory\n");
+        free (spr);
+        return NULL;
+    }
+    for (k = 0; k < steps; k++) {
+        spr->entry[k].img = NULL;
+        spr->entry[k].pix = NULL;
+    }
+
+    spr->img = img;
+    spr->base = NULL;
+    spr->steps = steps;
+    spr->scale = scale;
+    spr->quality = quality;
+    spr->hot_x = EZ_ROUND (hot_x * scale);
+    spr->hot_y = EZ_ROUND (hot_y * scale);
+    spr->size = 0;
+    spr->limit = EZ_SPRITE_LIMIT;
+    spr->clock = 0;
+
+    return spr;
 }
 
 
 /*
- * Confine coordinates of sub-image inside img
+ * Free the sprite spr and its rotated versions, but not its image.
 */
 
-int ez_image_confine_sub_coords (Ez_image *img, int *src_x, int *src_y,
-    int *w, int *h)
+void ez_sprite_destroy (Ez_sprite *spr)
 {
-    if (img == NULL) return -1;
-
-    if (ez_confine_coord (src_x, w, img->width) < 0 ||
-        ez_confine_coord (src_y, h, img->height) < 0) {
-        if (ez_image_debug ())
-            printf ("ez_image_confine_sub_coords empty region "
-                    "src_x = %d  src_y = %d  w = %d  h = %d\n",
-                *src_x, *src_y, *w, *h);
-        return -1;
-    }
-    return 0;
+    if (spr == NULL) return;
+    ez_sprite_flush (spr);
+    free (spr->entry);
+    free (spr);
 }
 
-int ez_confine_coord (int *t, int *r, int tmax)
+
+/*
+ * Bound the memory used by the rotated versions of spr, images and pixmaps
+ * (default EZ_SPRITE_LIMIT bytes). The version in use is always kept.
+*/
+
+void ez_sprite_set_limit (Ez_sprite *spr, int nbytes)
 {
-    if (*t < 0) { *r += *t; *t = 0; }
-    if (*t+*r > tmax) *r = tmax -*t;
-    return *r > 0 ? 0 : -1;
+    if (spr == NULL) return;
+    spr->limit = nbytes < 0 ? 0 : nbytes;
+    ez_sprite_evict (spr, NULL);
 }
 
 
-#ifdef EZ_BASE_XLIB
-
 /*
- * Display sub-image with transparency.
+ * Free the rotated versions of spr, to be rebuilt from its image.
 */
 
-void ez_image_draw_xi (Ez_window win, Ez_image *img, int x, int y,
-    int src_x, int src_y, int w, int h)
+void ez_sprite_flush (Ez_sprite *spr)
 {
-    XImage *xi = NULL;
-    Pixmap mask = None;
-    ez_xi_func xi_func;
+    int k;
 
-    xi_func = ez_xi_get_func ();
-    xi = ez_xi_create (img, src_x, src_y, w, h, xi_func);
-    if (xi == NULL) return;
+    if (spr == NULL) return;
+    for (k = 0; k < spr->steps; k++)
+        ez_sprite_free_entry (spr, &spr->entry[k]);
+    if (spr->base != spr->img) ez_image_destroy (spr->base);
+    spr->base = NULL;
+}
 
-    if (img->has_alpha) {
-        mask = ez_xmask_create (win, img, src_x, src_y, w, h);
-        if (mask == None) goto free_xi;
-        XSetClipOrigin (ezx.display, ezx.gc, x, y);
-        XSetClipMask (ezx.display, ezx.gc, mask);
-    }
 
-    XPutImage (ezx.display, win, ezx.gc, xi, 0, 0, x, y, w, h);
+/*
+ * Get the image of spr rotated by the angle theta in degrees, rounded to a
+ * multiple of 360/steps, and store in hot_x,hot_y (if not NULL) the hotspot
+ * in this image. The image belongs to the sprite, and stays valid until the
+ * next call on the sprite.
+ * Return the image, else NULL.
+*/
 
-    if (img->has_alpha) {
-        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
-        XSetClipMask (ezx.display, ezx.gc, None);
-        XFreePixmap (ezx.display, mask);
-    }
+Ez_image *ez_sprite_get_image (Ez_sprite *spr, double theta, int *hot_x, int *hot_y)
+{
+    Ez_sprite_entry *e;
 
-  free_xi:
-    XDestroyImage (xi);
+    if (spr == NULL) return NULL;
+    e = ez_sprite_get_entry (spr, theta);
+    if (e == NULL) return NULL;
+
+    if (hot_x != NULL) *hot_x = e->hot_x;
+    if (hot_y != NULL) *hot_y = e->hot_y;
+    return e->img;
 }
 
 
 /*
- * Creation of ximage
+ * Same as ez_sprite_get_image, for the pixmap of the rotated image.
+ * Return the pixmap, else NULL.
 */
 
-XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
-    ez_xi_func xi_func)
+Ez_pixmap *ez_sprite_get_pixmap (Ez_sprite *spr, double theta, int *hot_x, int *hot_y)
 {
-    XImage *xi = NULL;
+    Ez_sprite_entry *e;
+    int n;
 
-    if (xi_func == NULL) {
-        ez_error ("ez_xi_create: NULL xi_func\n");
+    if (spr == NULL) return NULL;
+    e = ez_sprite_get_entry (spr, theta);
+    if (e == NULL) return NULL;
+
+    if (e->pix == NULL) {
+        e->pix = ez_pixmap_create_from_image (e->img);
+        if (e->pix == NULL) return NULL;
+        /* Pixels of the pixmap and its 1 bit mask */
+        n = e->img->width * e->img->height;
+        e->size += n*4 + n/8;
+        spr->size += n*4 + n/8;
+        ez_sprite_evict (spr, e);
+    }
+
+    if (hot_x != NULL) *hot_x = e->hot_x;
+    if (hot_y != NULL) *hot_y = e->hot_y;
+    return e->pix;
+}
+
+
+/*
+ * Display the sprite spr rotated by theta degrees in the window win, with its
+ * hotspot at coordinates x,y.
+*/
+
+void ez_sprite_paint (Ez_window win, Ez_sprite *spr, double theta, int x, int y)
+{
+    Ez_pixmap *pix;
+    int hot_x, hot_y;
+
+    pix = ez_sprite_get_pixmap (spr, theta, &hot_x, &hot_y);
+    if (pix == NULL) return;
+    ez_pixmap_paint (win, pix, x - hot_x, y - hot_y);
+}
+
+
+/*
+ * Create an atlas, to pack many small images in a few pages of page_w x
+ * page_h pixels, each one displayed from a single pixmap; this saves the
+ * pixmaps, and the changes of clip between the displays.
+ * Return the atlas, else NULL.
+*/
+
+Ez_atlas *ez_atlas_create (int page_w, int page_h)
+{
+    Ez_atlas *atlas;
+
+    if (page_w <= 0 || page_h <= 0) {
+        ez_error ("ez_atlas_create: bad page size %d %d\n", page_w, page_h);
         return NULL;
     }
 
-    /* We must first create xi to obtain informations to create data */
-    xi = XCreateImage (ezx.display, ezx.visual, ezx.depth, ZPixmap, 0,
-        NULL, w, h, 32, 0);
-    if (xi == NULL) {
-        ez_error ("ez_xi_create: can't create XImage\n");
+    atlas = malloc (sizeof(Ez_atlas));
+    if (atlas == NULL) {
+        ez_error ("ez_atlas_create: out of memory\n");
         return NULL;
     }
+    atlas->page_w = page_w;
+    atlas->page_h = page_h;
+    atlas->nb_pages = 0;
+    atlas->pages = NULL;
+    atlas->nb_rects = atlas->max_rects = 0;
+    atlas->rect = NULL;
+
+    return atlas;
+}
+
+
+/*
+ * Free the atlas, its pages and their pixmaps.
+*/
+
+void ez_atlas_destroy (Ez_atlas *atlas)
+{
+    Ez_atlas_page *pages;
+    int k;
+
+    if (atlas == NULL) return;
+    pages = atlas->pages;
+    for (k = 0; k < atlas->nb_pages; k++) {
+        ez_pixmap_destroy (pages[k].pix);
+        ez_image_destroy (pages[k].img);
+        free (pages[k].seg);
+    }
+    free (pages);
+    free (atlas->rect);
+    free (atlas);
+}
+
+
+/*
+ * Copy the image img in a page of atlas, with a skyline bottom-left packing.
+ * An image larger than the pages gets its own page. The pages use the
+ * opacity of the first image having an alpha channel.
+ * Return the id of the image in atlas, else -1.
+*/
+
+int ez_atlas_add (Ez_atlas *atlas, Ez_image *img)
+{
+    Ez_atlas_page *page = NULL;
+    Ez_atlas_rect *rect;
+    int k, x, y, best_k = -1, best_x = 0, best_y = 0;
+
+    if (atlas == NULL || img == NULL) return -1;
+
+    if (img->width <= 0 || img->height <= 0) {
+        ez_error ("ez_atlas_add: empty image\n");
+        return -1;
+    }
+
+    if (atlas->nb_rects == atlas->max_rects) {
+        k = atlas->max_rects == 0 ? 64 : atlas->max_rects*2;
+        rect = realloc (atlas->rect, k * sizeof(Ez_atlas_rect));
+        if (rect == NULL) {
+            ez_error ("ez_atlas_add: out of memory\n");
+            return -1;
+        }
+        atlas->rect = rect;
+        atlas->max_rects = k;
+    }
+
+    /* Lowest place among the pages */
+    for (k = 0; k < atlas->nb_pages; k++)
+        if (ez_skyline_find ((Ez_atlas_page *) atlas->pages + k,
+                img->width, img->height, &x, &y) == 0 &&
+            (best_k < 0 || y < best_y)) {
+            best_k = k; best_x = x; best_y = y;
+        }
+
+    if (best_k >= 0)
+        page = (Ez_atlas_page *) atlas->pages + best_k;
+    else {
+        page = ez_atlas_new_page (atlas,
+            img->width  > atlas->page_w ? img->width  : atlas->page_w,
+            img->height > atlas->page_h ? img->height : atlas->page_h);
+        if (page == NULL) return -1;
+        best_k = atlas->nb_pages-1;
+    }
+
+    ez_skyline_insert (page, best_x, best_y, img->width, img->height);
+    ez_atlas_copy (page, img, best_x, best_y);
+
+    rect = &atlas->rect[atlas->nb_rects];
+    rect->page = best_k;
+    rect->x = best_x; rect->y = best_y;
+    rect->w = img->width; rect->h = img->height;
+
+    if (ez_image_debug ())
+        printf ("ez_atlas_add  id = %d  page = %d  x = %d  y = %d  w = %d  "
+                "h = %d\n", atlas->nb_rects, best_k, best_x, best_y,
+                img->width, img->height);
+
+    return atlas->nb_rects++;
+}
+
+
+/*
+ * Display the image of identifier id of atlas in the window win, with its top
+ * left corner at x,y. The pixmap of the page is built if needed.
+*/
+
+void ez_atlas_paint (Ez_window win, Ez_atlas *atlas, int id, int x, int y)
+{
+    Ez_atlas_page *page;
+    Ez_atlas_rect *r;
+#ifdef EZ_BASE_WIN32
+    HDC hdc;
+#endif /* EZ_BASE_ */
+
+    if (win == None || atlas == NULL) return;
+
+    if (id < 0 || id >= atlas->nb_rects) {
+        ez_error ("ez_atlas_paint: bad id %d\n", id);
+        return;
+    }
+    r = &atlas->rect[id];
+    page = (Ez_atlas_page *) atlas->pages + r->page;
+
+    if (page->pix == NULL) {
+        page->pix = ez_pixmap_create_from_image (page->img);
+        if (page->pix == NULL) return;
+    }
+
+#ifdef EZ_BASE_XLIB
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_atlas_draw_area (win, page->pix, r, x, y);
+    if (!ezbatch.on) ez_clip_gc (win);
+#elif defined EZ_BASE_WIN32
+    if (ezbatch.on && ezbatch.win == win) {
+        if (ezbatch.hmap != page->pix->hmap) {
+            SelectObject (ezbatch.hdc, page->pix->hmap);
+            ezbatch.hmap = page->pix->hmap;
+        }
+        ez_atlas_draw_hmap (ezx.hdc, ezbatch.hdc, page->pix, r, x, y);
+        return;
+    }
+    ez_cur_win (win);
+    hdc = CreateCompatibleDC (ezx.hdc);
+    if (hdc == NULL) {
+        ez_error ("ez_atlas_paint: can't create compatible DC\n");
+        return;
+    }
+    SelectObject (hdc, page->pix->hmap);
+    ez_atlas_draw_hmap (ezx.hdc, hdc, page->pix, r, x, y);
+    DeleteDC (hdc);
+#elif defined EZ_BASE_MEMORY
+    ez_image_draw_mem (win, page->pix->img, x, y, r->x, r->y, r->w, r->h);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Begin a batch of ez_atlas_paint in the window win, ended by ez_atlas_end;
+ * nothing else should be drawn meanwhile. The clip mask of a page is then
+ * set once for all its images displayed in a row (on X11), and the pages are
+ * selected in a single DC (on Win32).
+*/
+
+void ez_atlas_begin (Ez_window win)
+{
+    if (win == None) return;
+    if (ezbatch.on) ez_atlas_end ();
+
+    ezbatch.win = win;
+#ifdef EZ_BASE_WIN32
+    ez_cur_win (win);
+    ezbatch.hdc = CreateCompatibleDC (ezx.hdc);
+    if (ezbatch.hdc == NULL) {
+        ez_error ("ez_atlas_begin: can't create compatible DC\n");
+        return;
+    }
+    ezbatch.hmap = NULL;
+#endif /* EZ_BASE_ */
+    ezbatch.on = 1;
+}
+
+
+/*
+ * End the batch begun by ez_atlas_begin.
+*/
+
+void ez_atlas_end (void)
+{
+    if (!ezbatch.on) return;
+    ezbatch.on = 0;
+
+#ifdef EZ_BASE_XLIB
+    ez_clip_gc (ezbatch.win);
+#elif defined EZ_BASE_WIN32
+    DeleteDC (ezbatch.hdc);
+    ezbatch.hdc = NULL;
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Bound the memory used by the scratch buffers which are kept between two
+ * displays of images (default EZ_XCACHE_LIMIT bytes); 0 disables the cache.
+*/
+
+void ez_image_cache_limit (int nbytes)
+{
+#ifdef EZ_BASE_XLIB
+    ezcache.limit = nbytes < 0 ? 0 : nbytes;
+    while (ezcache.nb > 0 && ezcache.size > ezcache.limit)
+        ez_xcache_evict ();
+#elif defined EZ_BASE_WIN32 || defined EZ_BASE_MEMORY
+    (void) nbytes;  /* No cache on Win32 nor in memory */
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Free all the scratch buffers kept between two displays of images.
+*/
+
+void ez_image_cache_flush (void)
+{
+#ifdef EZ_BASE_XLIB
+    while (ezcache.nb > 0)
+        ez_xcache_evict ();
+    if (ezshm.state > 0) ez_xshm_free ();
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Set the number of threads which process the large images: 0 for the
+ * default, which is the environment variable EZ_IMAGE_THREADS if defined,
+ * else the number of processors; 1 to disable the threads.
+*/
+
+void ez_image_set_threads (int nb)
+{
+    ez_pool_stop ();
+    ezpool.requested = nb > 0 ? nb : 0;
+}
+
+
+/*
+ * Return the number of threads which process the large images.
+*/
+
+int ez_image_get_threads (void)
+{
+    return ez_pool_start ();
+}
+
+
+/*-------------------- P R I V A T E   F U N C T I O N S --------------------*/
+
+/*
+ * Unique test of the definition of the environment variable EZ_IMAGE_DEBUG
+*/
+
+int ez_image_debug (void)
+{
+    static int debug = -1;
+    if (debug < 0) debug = getenv ("EZ_IMAGE_DEBUG") != NULL;
+    return debug;
+}
+
+
+/*
+ * Confine coordinates of sub-image inside img
+*/
+
+int ez_image_confine_sub_coords (Ez_image *img, int *src_x, int *src_y,
+    int *w, int *h)
+{
+    if (img == NULL) return -1;
+
+    if (ez_confine_coord (src_x, w, img->width) < 0 ||
+        ez_confine_coord (src_y, h, img->height) < 0) {
+        if (ez_image_debug ())
+            printf ("ez_image_confine_sub_coords empty region "
+                    "src_x = %d  src_y = %d  w = %d  h = %d\n",
+                *src_x, *src_y, *w, *h);
+        return -1;
+    }
+    return 0;
+}
+
+int ez_confine_coord (int *t, int *r, int tmax)
+{
+    if (*t < 0) { *r += *t; *t = 0; }
+    if (*t+*r > tmax) *r = tmax -*t;
+    return *r > 0 ? 0 : -1;
+}
+
+
+/*
+ * Return the SIMD instruction sets available for the vectorized functions,
+ * as a combination of EZ_CPU_xxx flags, tested once.
+ * To disable, define environment variable EZ_IMAGE_NOSIMD.
+*/
+
+int ez_cpu_features (void)
+{
+    static int cpu = -1;
+
+    if (cpu >= 0) return cpu;
+    cpu = 0;
+
+#ifdef EZ_SIMD_X86
+    if (getenv ("EZ_IMAGE_NOSIMD") == NULL) {
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("sse2" )) cpu |= EZ_CPU_SSE2;
+        if (__builtin_cpu_supports ("ssse3")) cpu |= EZ_CPU_SSSE3;
+        if (__builtin_cpu_supports ("avx2" )) cpu |= EZ_CPU_AVX2;
+    }
+#endif /* EZ_SIMD_X86 */
 
     if (ez_image_debug())
-        printf ("ez_xi_create  w = %d  h = %d  depth = %d  bpp = %d\n",
-            w, h, ezx.depth, xi->bits_per_pixel);
+        printf ("ez_cpu_features  sse2 %d  ssse3 %d  avx2 %d\n",
+            (cpu & EZ_CPU_SSE2) != 0, (cpu & EZ_CPU_SSSE3) != 0,
+            (cpu & EZ_CPU_AVX2) != 0);
+    return cpu;
+}
 
-    xi->data = calloc (xi->bytes_per_line * h, 1);
-    if (xi->data == NULL)  {
-        ez_error ("ez_xi_create: out of memory\n");
-        XDestroyImage (xi);
-        return NULL;
+
+/*
+ * Pool of threads. ez_parallel_rows cuts the rows 0 to h-1 in bands, which
+ * are processed by b->func in the threads of the pool and in the caller; the
+ * result is the same as serially, since the rows are independent. The jobs
+ * whose cost (h times the cost of a row in pixels) is small, and the nested
+ * jobs, are run serially.
+ * ez_parallel_rows returns 0 on success, -1 if a band has failed.
+*/
+
+void ez_band_init (Ez_band *b, ez_band_func func, Ez_image *dst, Ez_image *src,
+    int dst_x, int dst_y, int src_x, int src_y, int w, int h)
+{
+    memset (b, 0, sizeof(Ez_band));
+    b->func = func;
+    b->dst = dst; b->src = src;
+    b->dst_x = dst_x; b->dst_y = dst_y;
+    b->src_x = src_x; b->src_y = src_y;
+    b->w = w; b->h = h;
+}
+
+
+int ez_parallel_rows (Ez_band *b, int h, int cost)
+{
+    if (h <= 0) return 0;
+
+    if (ezpool.busy || h < 2 || (double) h * cost < EZ_PARALLEL_MIN ||
+        ez_pool_start () < 2) {
+        b->func (b, 0, h);
+        return b->failed ? -1 : 0;
     }
-    /* xi->data will be freed by XDestroyImage */
 
-    /* Draw pixels in xi->data */
-    xi_func (xi, img, src_x, src_y, w, h);
+    ezpool.busy = 1;
+    ezpool.job = b;
+    ezpool.job_h = h;
+    ezpool.job_bands = ezpool.nb*4 < h ? ezpool.nb*4 : h;
+    ezpool.next_band = 0;
+    ezpool.active = ezpool.started;
 
-    return xi;
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    pthread_mutex_lock (&ezpool.mutex);
+    ezpool.gen++;
+    pthread_cond_broadcast (&ezpool.cond_start);
+    pthread_mutex_unlock (&ezpool.mutex);
+
+    ez_pool_run ();
+
+    pthread_mutex_lock (&ezpool.mutex);
+    while (ezpool.active > 0)
+        pthread_cond_wait (&ezpool.cond_done, &ezpool.mutex);
+    pthread_mutex_unlock (&ezpool.mutex);
+#elif defined EZ_BASE_WIN32
+    ReleaseSemaphore (ezpool.sem_start, ezpool.started, NULL);
+    ez_pool_run ();
+    WaitForSingleObject (ezpool.ev_done, INFINITE);
+#endif /* EZ_BASE_ */
+
+    ezpool.job = NULL;
+    ezpool.busy = 0;
+    return b->failed ? -1 : 0;
 }
 
 
-ez_xi_func ez_xi_get_func (void)
+int ez_cpu_count (void)
 {
-    static ez_xi_func xi_func = NULL;
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#elif defined EZ_BASE_WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo (&si);
+    return si.dwNumberOfProcessors > 0 ? (int) si.dwNumberOfProcessors : 1;
+#endif /* EZ_BASE_ */
+}
 
-    if (xi_func != NULL) return xi_func;
-    xi_func = ez_xi_fill_default;
 
-    if (ezx.depth == 24)
-    {
-        Ez_image *img = ez_xi_test_create ();
-        XImage *xi1 = ez_xi_create (img, 0, 0, img->width, img->height,
-            ez_xi_fill_default);
-        XImage *xi2 = ez_xi_create (img, 0, 0, img->width, img->height,
-            ez_xi_fill_24);
+/*
+ * Start the threads of the pool, if not done.
+ * Return the number of threads, the caller included.
+*/
+
+int ez_pool_start (void)
+{
+    int nb, i;
+    char *s;
 
-        if (ez_xi_diff (xi1, xi2) == 0)
-            xi_func = ez_xi_fill_24;
+    if (ezpool.nb > 0) return ezpool.nb;
 
-        XDestroyImage (xi1);
-        XDestroyImage (xi2);
-        ez_image_destroy (img);
+    nb = ezpool.requested;
+    if (nb <= 0 && (s = getenv ("EZ_IMAGE_THREADS")) != NULL) nb = atoi (s);
+    if (nb <= 0) nb = ez_cpu_count ();
+    if (nb > EZ_THREADS_MAX) nb = EZ_THREADS_MAX;
+
+    ezpool.nb = 1;
+    ezpool.started = 0;
+    ezpool.quit = 0;
+    if (nb < 2) return 1;
+
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    if (pthread_mutex_init (&ezpool.mutex, NULL) != 0) return 1;
+    ezpool.gen = 0;
+    pthread_cond_init (&ezpool.cond_start, NULL);
+    pthread_cond_init (&ezpool.cond_done, NULL);
+    for (i = 1; i < nb; i++) {
+        if (pthread_create (&ezpool.thread[ezpool.started], NULL,
+            ez_pool_worker, NULL) != 0) break;
+        ezpool.started++;
+    }
+    if (ezpool.started == 0) {
+        pthread_cond_destroy (&ezpool.cond_start);
+        pthread_cond_destroy (&ezpool.cond_done);
+        pthread_mutex_destroy (&ezpool.mutex);
+    }
+#elif defined EZ_BASE_WIN32
+    ezpool.sem_start = CreateSemaphore (NULL, 0, EZ_THREADS_MAX, NULL);
+    ezpool.ev_done = CreateEvent (NULL, FALSE, FALSE, NULL);
+    if (ezpool.sem_start != NULL && ezpool.ev_done != NULL)
+        for (i = 1; i < nb; i++) {
+            HANDLE t = CreateThread (NULL, 0, ez_pool_worker, NULL, 0, NULL);
+            if (t == NULL) break;
+            ezpool.thread[ezpool.started++] = t;
+        }
+    if (ezpool.started == 0) {
+        if (ezpool.sem_start != NULL) CloseHandle (ezpool.sem_start);
+        if (ezpool.ev_done   != NULL) CloseHandle (ezpool.ev_done);
+    }
+#endif /* EZ_BASE_ */
+
+    if (ezpool.started < nb-1)
+        ez_error ("ez_pool_start: could start %d threads out of %d\n",
+            ezpool.started, nb-1);
+    ezpool.nb = ezpool.started + 1;
+
+    if (ez_image_debug())
+        printf ("ez_pool_start  %d threads\n", ezpool.nb);
+    return ezpool.nb;
+}
+
+
+/*
+ * Stop the threads of the pool; it will be restarted on demand.
+*/
+
+void ez_pool_stop (void)
+{
+    int i;
+
+    if (ezpool.started > 0) {
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+        pthread_mutex_lock (&ezpool.mutex);
+        ezpool.quit = 1;
+        pthread_cond_broadcast (&ezpool.cond_start);
+        pthread_mutex_unlock (&ezpool.mutex);
+        for (i = 0; i < ezpool.started; i++)
+            pthread_join (ezpool.thread[i], NULL);
+        pthread_cond_destroy (&ezpool.cond_start);
+        pthread_cond_destroy (&ezpool.cond_done);
+        pthread_mutex_destroy (&ezpool.mutex);
+#elif defined EZ_BASE_WIN32
+        ezpool.quit = 1;
+        ReleaseSemaphore (ezpool.sem_start, ezpool.started, NULL);
+        WaitForMultipleObjects (ezpool.started, ezpool.thread, TRUE, INFINITE);
+        for (i = 0; i < ezpool.started; i++)
+            CloseHandle (ezpool.thread[i]);
+        CloseHandle (ezpool.sem_start);
+        CloseHandle (ezpool.ev_done);
+#endif /* EZ_BASE_ */
+    }
+    ezpool.nb = ezpool.started = 0;
+}
+
+
+/*
+ * Process the bands of the current job until there is no more.
+*/
+
+void ez_pool_run (void)
+{
+    int i, h = ezpool.job_h, n = ezpool.job_bands;
+
+    while ((i = ez_pool_claim ()) >= 0)
+        ezpool.job->func (ezpool.job, (int) ((Ez_int64) h * i / n),
+            (int) ((Ez_int64) h * (i+1) / n));
+}
+
+
+/*
+ * Return the number of the next band to process, or -1 if none.
+*/
+
+int ez_pool_claim (void)
+{
+    int i;
+
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    pthread_mutex_lock (&ezpool.mutex);
+    i = ezpool.next_band < ezpool.job_bands ? ezpool.next_band++ : -1;
+    pthread_mutex_unlock (&ezpool.mutex);
+#elif defined EZ_BASE_WIN32
+    i = InterlockedIncrement (&ezpool.next_band) - 1;
+    if (i >= ezpool.job_bands) i = -1;
+#endif /* EZ_BASE_ */
+
+    return i;
+}
+
+
+/*
+ * Worker thread: wait for a job, help to process its bands, then signal the
+ * caller when the last worker is done.
+*/
+
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+
+void *ez_pool_worker (void *arg)
+{
+    unsigned long gen = 0;          /* Reset by ez_pool_start */
+
+    (void) arg;
+    pthread_mutex_lock (&ezpool.mutex);
+
+    for (;;) {
+        while (ezpool.gen == gen && !ezpool.quit)
+            pthread_cond_wait (&ezpool.cond_start, &ezpool.mutex);
+        if (ezpool.quit) break;
+        gen = ezpool.gen;
+
+        pthread_mutex_unlock (&ezpool.mutex);
+        ez_pool_run ();
+        pthread_mutex_lock (&ezpool.mutex);
+
+        if (--ezpool.active == 0)
+            pthread_cond_signal (&ezpool.cond_done);
+    }
+
+    pthread_mutex_unlock (&ezpool.mutex);
+    return NULL;
+}
+
+#elif defined EZ_BASE_WIN32
+
+DWORD WINAPI ez_pool_worker (LPVOID arg)
+{
+    (void) arg;
+
+    for (;;) {
+        WaitForSingleObject (ezpool.sem_start, INFINITE);
+        if (ezpool.quit) break;
+        ez_pool_run ();
+        if (InterlockedDecrement (&ezpool.active) == 0)
+            SetEvent (ezpool.ev_done);
+    }
+    return 0;
+}
+
+#endif /* EZ_BASE_ */
+
+
+/*
+ * Bands of ez_image_set_premul: convert the rows of dst if op, else revert.
+*/
+
+void ez_band_premul (Ez_band *b, int y0, int y1)
+{
+    Ez_image *img = b->dst;
+    Ez_uint8 *p;
+    int y;
+
+    for (y = y0; y < y1; y++) {
+        p = img->pixels_rgba + (size_t) y * img->width * 4;
+        if (b->op)
+             ez_premul_row (p, p, img->width);
+        else ez_unpremul_row (p, p, img->width);
+    }
+}
+
+
+#ifdef EZ_BASE_XLIB
+
+/*
+ * Display sub-image with transparency.
+*/
+
+void ez_image_draw_xi (Ez_window win, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    XImage *xi = NULL;
+    Pixmap mask = None;
+    ez_xi_func xi_func;
+    int shm = 0;
+
+    xi_func = ez_xi_get_func ();
+    if (ez_xshm_available ()) {
+        xi = ez_xshm_create (img, src_x, src_y, w, h, xi_func);
+        shm = xi != NULL;
+    }
+    if (xi == NULL)
+        xi = ez_xi_create (img, src_x, src_y, w, h, xi_func);
+    if (xi == NULL) return;
+
+    /* The mask of the whole image is kept for the next displays */
+    if (img->has_alpha) {
+        mask = ez_image_get_xmask (img);
+        if (mask == None) goto free_xi;
+        ez_gc_set_clip_mask (mask, x - src_x, y - src_y);
+    } else ez_clip_gc (win);
+
+    if (shm)
+         ez_xshm_put (win, xi, x, y, w, h);
+    else XPutImage (ezx.display, win, ezx.gc, xi, 0, 0, x, y, w, h);
+
+    if (img->has_alpha) ez_clip_gc (win);
+
+  free_xi:
+    /* The shared XImage is kept for the next calls */
+    if (!shm) ez_xi_destroy (xi);
+}
+
+
+/*
+ * Creation of ximage
+*/
+
+XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
+    ez_xi_func xi_func)
+{
+    XImage *xi = NULL;
+
+    if (xi_func == NULL) {
+        ez_error ("ez_xi_create: NULL xi_func\n");
+        return NULL;
+    }
+
+    /* Reuse an XImage of same size released by ez_xi_destroy */
+    xi = ez_xcache_get (w, h, ezx.depth);
+
+    if (xi == NULL) {
+        /* We must first create xi to obtain informations to create data */
+        xi = XCreateImage (ezx.display, ezx.visual, ezx.depth, ZPixmap, 0,
+            NULL, w, h, 32, 0);
+        if (xi == NULL) {
+            ez_error ("ez_xi_create: can't create XImage\n");
+            return NULL;
+        }
+
+        if (ez_image_debug())
+            printf ("ez_xi_create  w = %d  h = %d  depth = %d  bpp = %d\n",
+                w, h, ezx.depth, xi->bits_per_pixel);
+
+        xi->data = calloc (xi->bytes_per_line * h, 1);
+        if (xi->data == NULL)  {
+            ez_error ("ez_xi_create: out of memory\n");
+            XDestroyImage (xi);
+            return NULL;
+        }
+        /* xi->data will be freed by XDestroyImage */
+    }
+
+    /* Draw pixels in xi->data */
+    ez_xi_fill (xi, img, src_x, src_y, w, h, xi_func);
+
+    return xi;
+}
+
+
+/*
+ * Fill xi with a sub-image by xi_func, by bands of rows in the threads.
+*/
+
+void ez_xi_fill (XImage *xi, Ez_image *img, int src_x, int src_y, int w, int h,
+    ez_xi_func xi_func)
+{
+    Ez_band b;
+
+    ez_band_init (&b, ez_band_xi, NULL, img, 0, 0, src_x, src_y, w, h);
+    b.xi = xi;
+    b.xi_func = xi_func;
+    ez_parallel_rows (&b, h, w);
+}
+
+
+/* A band is filled through a copy of xi whose data start at row y0 */
+
+void ez_band_xi (Ez_band *b, int y0, int y1)
+{
+    XImage sub = *b->xi;
+
+    sub.data  += (size_t) y0 * sub.bytes_per_line;
+    sub.height = y1 - y0;
+    b->xi_func (&sub, b->src, b->src_x, b->src_y + y0, b->w, y1 - y0);
+}
+
+
+/*
+ * Release an XImage created by ez_xi_create; it is kept in the cache.
+*/
+
+void ez_xi_destroy (XImage *xi)
+{
+    if (xi == NULL) return;
+    ez_xcache_put (xi, xi->width, xi->height, xi->depth,
+        xi->bytes_per_line * xi->height);
+}
+
+
+/*
+ * Choose the fastest fill function which gives the same XImage as
+ * ez_xi_fill_default on a test image; the candidates are tried in order.
+*/
+
+ez_xi_func ez_xi_get_func (void)
+{
+    static ez_xi_func xi_func = NULL;
+    ez_xi_func cand[4];
+    int n = 0, i;
+
+    if (xi_func != NULL) return xi_func;
+    xi_func = ez_xi_fill_default;
+
+    if (ezx.visual->class == TrueColor)
+    {
+        Ez_image *img = ez_xi_test_create ();
+        XImage *xi1 = ez_xi_create (img, 0, 0, img->width, img->height,
+            ez_xi_fill_default);
+        XImage *xi2 = ez_xi_create (img, 0, 0, img->width, img->height,
+            ez_xi_fill_default);
+
+#ifdef EZ_SIMD_X86
+        if (xi1 != NULL && xi1->bits_per_pixel == 32) {
+            int cpu = ez_cpu_features ();
+            if (cpu & EZ_CPU_AVX2 ) cand[n++] = ez_xi_fill_32_avx2;
+            if (cpu & EZ_CPU_SSSE3) cand[n++] = ez_xi_fill_32_ssse3;
+            if (cpu & EZ_CPU_SSE2 ) cand[n++] = ez_xi_fill_32_sse2;
+        }
+#endif /* EZ_SIMD_X86 */
+        if (ezx.depth == 24) cand[n++] = ez_xi_fill_24;
+
+        for (i = 0; i < n && xi2 != NULL; i++) {
+            memset (xi2->data, 0, xi2->bytes_per_line * xi2->height);
+            cand[i] (xi2, img, 0, 0, img->width, img->height);
+            if (ez_xi_diff (xi1, xi2) == 0) { xi_func = cand[i]; break; }
+            if (ez_image_debug())
+                printf ("ez_xi_get_func  candidate %d rejected\n", i);
+        }
+
+        ez_xi_destroy (xi1);
+        ez_xi_destroy (xi2);
+        ez_image_destroy (img);
+    }
+
+    return xi_func;
+}
+
+
+void ez_xi_fill_default (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, img_w = img->width;
+    Ez_uint8 cr, cg, cb;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * img_w; y < h; y++, ty += img_w)
+    for (x = 0, tx = (ty + src_x)*4; x < w; x++, tx += 4) {
+        cr = img->pixels_rgba[tx];
+        cg = img->pixels_rgba[tx+1];
+        cb = img->pixels_rgba[tx+2];
+        XPutPixel (xi, x, y, ez_get_RGB (cr, cg, cb));
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xi_fill_default %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+/* Speed gain compared to fill_default: 50% */
+
+void ez_xi_fill_24 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, img_w = img->width,
+        dj = xi->bytes_per_line,
+        di = xi->bits_per_pixel / 8,
+        ir = ezx.trueColor.red.shift   / 8,
+        ig = ezx.trueColor.green.shift / 8,
+        ib = ezx.trueColor.blue.shift  / 8;
+    Ez_uint8 *data = (Ez_uint8 *) xi->data;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * img_w, j = 0; y < h; y++, ty += img_w, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += di) {
+        data[i+ir] = img->pixels_rgba[tx];
+        data[i+ig] = img->pixels_rgba[tx+1];
+        data[i+ib] = img->pixels_rgba[tx+2];
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xi_fill_24 %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * Vectorized fill functions for 32 bpp TrueColor visuals, where each
+ * channel has at most 8 bits. The pixels of img are read as little endian
+ * words R | G<<8 | B<<16 | A<<24.
+ *
+ * The sse2 version computes for each channel (p >> in_shift & max) << shift;
+ * the ssse3 and avx2 versions are byte shuffles, which require 8 bit
+ * channels aligned on bytes. Otherwise, ez_xi_get_func rejects them.
+*/
+
+#define EZ_XI_PIXEL_32(p) \
+    ( ((p) >> (8 - ezx.trueColor.red  .length) & ezx.trueColor.red  .max) \
+                                            << ezx.trueColor.red  .shift | \
+      ((p) >> (16 - ezx.trueColor.green.length) & ezx.trueColor.green.max) \
+                                            << ezx.trueColor.green.shift | \
+      ((p) >> (24 - ezx.trueColor.blue .length) & ezx.trueColor.blue .max) \
+                                            << ezx.trueColor.blue .shift )
+
+EZ_TARGET ("sse2")
+void ez_xi_fill_32_sse2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_channel *c[3];
+    __m128i sr[3], sl[3], max[3], p, q;
+    Ez_uint32 *src, *dst;
+    int x, y, k;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    c[0] = &ezx.trueColor.red;
+    c[1] = &ezx.trueColor.green;
+    c[2] = &ezx.trueColor.blue;
+    for (k = 0; k < 3; k++) {
+        sr[k]  = _mm_cvtsi32_si128 (8*k + 8 - c[k]->length);
+        sl[k]  = _mm_cvtsi32_si128 (c[k]->shift);
+        max[k] = _mm_set1_epi32 (c[k]->max);
+    }
+
+    for (y = 0; y < h; y++) {
+        src = (Ez_uint32 *) img->pixels_rgba + (src_y+y) * img->width + src_x;
+        dst = (Ez_uint32 *) (xi->data + y * xi->bytes_per_line);
+        for (x = 0; x+4 <= w; x += 4) {
+            p = _mm_loadu_si128 ((__m128i *) (src+x));
+            q = _mm_sll_epi32 (_mm_and_si128 (_mm_srl_epi32 (p, sr[0]), max[0]), sl[0]);
+            q = _mm_or_si128 (q,
+                _mm_sll_epi32 (_mm_and_si128 (_mm_srl_epi32 (p, sr[1]), max[1]), sl[1]));
+            q = _mm_or_si128 (q,
+                _mm_sll_epi32 (_mm_and_si128 (_mm_srl_epi32 (p, sr[2]), max[2]), sl[2]));
+            _mm_storeu_si128 ((__m128i *) (dst+x), q);
+        }
+        for (; x < w; x++) dst[x] = EZ_XI_PIXEL_32 (src[x]);
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xi_fill_32_sse2 %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+/*
+ * Shuffle mask which moves R,G,B to their bytes in a 32 bpp pixel and
+ * clears the 4th byte; it is repeated for the 4 pixels of 16 bytes.
+*/
+
+void ez_xi_shuffle_mask (Ez_uint8 mask[16])
+{
+    int i, j;
+    for (i = 0; i < 16; i += 4)
+    for (j = 0; j < 4; j++)
+        mask[i+j] = j*8 == (int) ezx.trueColor.red  .shift ? i   :
+                    j*8 == (int) ezx.trueColor.green.shift ? i+1 :
+                    j*8 == (int) ezx.trueColor.blue .shift ? i+2 : 0x80;
+}
+
+
+EZ_TARGET ("ssse3")
+void ez_xi_fill_32_ssse3 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_uint8 m[16];
+    __m128i mask;
+    Ez_uint32 *src, *dst;
+    int x, y;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    ez_xi_shuffle_mask (m);
+    mask = _mm_loadu_si128 ((__m128i *) m);
+
+    for (y = 0; y < h; y++) {
+        src = (Ez_uint32 *) img->pixels_rgba + (src_y+y) * img->width + src_x;
+        dst = (Ez_uint32 *) (xi->data + y * xi->bytes_per_line);
+        for (x = 0; x+4 <= w; x += 4)
+            _mm_storeu_si128 ((__m128i *) (dst+x), _mm_shuffle_epi8 (
+                _mm_loadu_si128 ((__m128i *) (src+x)), mask));
+        for (; x < w; x++) dst[x] = EZ_XI_PIXEL_32 (src[x]);
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xi_fill_32_ssse3 %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+EZ_TARGET ("avx2")
+void ez_xi_fill_32_avx2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_uint8 m[16];
+    __m256i mask;
+    Ez_uint32 *src, *dst;
+    int x, y;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    /* _mm256_shuffle_epi8 shuffles inside each 128 bit lane */
+    ez_xi_shuffle_mask (m);
+    mask = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((__m128i *) m));
+
+    for (y = 0; y < h; y++) {
+        src = (Ez_uint32 *) img->pixels_rgba + (src_y+y) * img->width + src_x;
+        dst = (Ez_uint32 *) (xi->data + y * xi->bytes_per_line);
+        for (x = 0; x+8 <= w; x += 8)
+            _mm256_storeu_si256 ((__m256i *) (dst+x), _mm256_shuffle_epi8 (
+                _mm256_loadu_si256 ((__m256i *) (src+x)), mask));
+        for (; x < w; x++) dst[x] = EZ_XI_PIXEL_32 (src[x]);
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xi_fill_32_avx2 %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
+Ez_image *ez_xi_test_create (void)
+{
+    int w = 9, h = 13, t, tmax = w*h*4;
+    Ez_image *img = ez_image_create (w, h);
+    if (img == NULL) return NULL;
+
+    for (t = 0; t < tmax; t += 4) {
+        img->pixels_rgba[t  ] = t*11/256;
+        img->pixels_rgba[t+1] = t*31/256;
+        img->pixels_rgba[t+2] = t* 7/256;
+    }
+
+    return img;
+}
+
+
+int ez_xi_diff (XImage *xi1, XImage *xi2)
+{
+    int ntot, i;
+    if (xi1 == NULL || xi2 == NULL) return -1;
+
+    ntot = xi1->bytes_per_line * xi1->height;
+    for (i = 0; i < ntot; i++)
+        if (xi1->data[i] != xi2->data[i]) return -1;
+
+    return 0;
+}
+
+
+/*
+ * LRU cache of scratch buffers, keyed by width, height and depth:
+ * XImage for depth > 1, mask data for depth 1. A buffer is removed from
+ * the cache by ez_xcache_get, and inserted again by ez_xcache_put; the
+ * least recently used buffers are freed to stay within ezcache.limit.
+*/
+
+void *ez_xcache_get (int w, int h, int depth)
+{
+    int i, k = -1;
+    void *buf;
+
+    for (i = 0; i < ezcache.nb; i++)
+        if (ezcache.entry[i].width == w && ezcache.entry[i].height == h &&
+            ezcache.entry[i].depth == depth &&
+            (k < 0 || ezcache.entry[i].stamp > ezcache.entry[k].stamp))
+            k = i;
+    if (k < 0) return NULL;
+
+    buf = ezcache.entry[k].buf;
+    ezcache.size -= ezcache.entry[k].size;
+    ezcache.entry[k] = ezcache.entry[--ezcache.nb];
+    return buf;
+}
+
+
+void ez_xcache_put (void *buf, int w, int h, int depth, int size)
+{
+    Ez_xcache_entry *e;
+
+    if (buf == NULL) return;
+
+    /* Too big to be kept */
+    if (size > ezcache.limit) {
+        ez_xcache_free_buf (buf, depth);
+        return;
+    }
+
+    while (ezcache.nb > 0 && (ezcache.nb >= EZ_XCACHE_MAX ||
+                              ezcache.size + size > ezcache.limit))
+        ez_xcache_evict ();
+
+    e = &ezcache.entry[ezcache.nb++];
+    e->width = w; e->height = h; e->depth = depth;
+    e->size = size;
+    e->stamp = ++ezcache.clock;
+    e->buf = buf;
+    ezcache.size += size;
+}
+
+
+/*
+ * Free the least recently used buffer.
+*/
+
+void ez_xcache_evict (void)
+{
+    int i, k = 0;
+
+    if (ezcache.nb == 0) return;
+    for (i = 1; i < ezcache.nb; i++)
+        if (ezcache.entry[i].stamp < ezcache.entry[k].stamp) k = i;
+
+    if (ez_image_debug())
+        printf ("ez_xcache_evict  w = %d  h = %d  depth = %d  size = %d\n",
+            ezcache.entry[k].width, ezcache.entry[k].height,
+            ezcache.entry[k].depth, ezcache.entry[k].size);
+
+    ez_xcache_free_buf (ezcache.entry[k].buf, ezcache.entry[k].depth);
+    ezcache.size -= ezcache.entry[k].size;
+    ezcache.entry[k] = ezcache.entry[--ezcache.nb];
+}
+
+
+void ez_xcache_free_buf (void *buf, int depth)
+{
+    if (depth == 1)
+         free (buf);
+    else XDestroyImage ((XImage *) buf);
+}
+
+
+/*
+ * MIT-SHM: the pixels are written in a memory segment shared with the
+ * X server, so XShmPutImage does not copy them through the connection.
+ * The segment is kept alive across calls and grown on demand; if the
+ * extension is missing or the display is remote, we fall back on XPutImage.
+ * To disable, define environment variable EZ_IMAGE_NOSHM.
+*/
+
+int ez_xshm_available (void)
+{
+    if (ezshm.state == 0) {
+        ezshm.state = (getenv ("EZ_IMAGE_NOSHM") == NULL &&
+                       XShmQueryExtension (ezx.display)) ? 1 : -1;
+        if (ez_image_debug())
+            printf ("ez_xshm_available  MIT-SHM %s\n",
+                ezshm.state > 0 ? "enabled" : "disabled");
+    }
+    return ezshm.state > 0;
+}
+
+
+/* Prototype imposed by XSetErrorHandler */
+int ez_xshm_error (Display *display, XErrorEvent *xev)
+{
+    (void) display; (void) xev;  /* unused variables. */
+    ez_xshm_error_flag = 1;
+    return 0;
+}
+
+
+/*
+ * Ensure that the shared XImage can hold w x h pixels.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_xshm_alloc (int w, int h)
+{
+    XImage *xi;
+    int (*handler) (Display *, XErrorEvent *);
+
+    if (ezshm.xi != NULL && w <= ezshm.width && h <= ezshm.height) return 0;
+
+    /* Grow: keep the largest dimensions requested so far */
+    if (ezshm.xi != NULL) {
+        if (w < ezshm.width ) w = ezshm.width;
+        if (h < ezshm.height) h = ezshm.height;
+        ez_xshm_free ();
+    }
+
+    xi = XShmCreateImage (ezx.display, ezx.visual, ezx.depth, ZPixmap,
+        NULL, &ezshm.info, w, h);
+    if (xi == NULL) return -1;
+
+    ezshm.info.shmid = shmget (IPC_PRIVATE, xi->bytes_per_line * xi->height,
+        IPC_CREAT | 0600);
+    if (ezshm.info.shmid < 0) {
+        ez_error ("ez_xshm_alloc: shmget failed, MIT-SHM disabled\n");
+        ezshm.state = -1;
+        XDestroyImage (xi);
+        return -1;
+    }
+
+    ezshm.info.shmaddr = xi->data = shmat (ezshm.info.shmid, NULL, 0);
+    if (ezshm.info.shmaddr == (char *) -1) {
+        ez_error ("ez_xshm_alloc: shmat failed, MIT-SHM disabled\n");
+        ezshm.state = -1;
+        shmctl (ezshm.info.shmid, IPC_RMID, NULL);
+        xi->data = NULL;
+        XDestroyImage (xi);
+        return -1;
+    }
+    ezshm.info.readOnly = False;
+
+    /* XShmAttach fails asynchronously, e.g. on a remote display */
+    XSync (ezx.display, False);
+    ez_xshm_error_flag = 0;
+    handler = XSetErrorHandler (ez_xshm_error);
+    XShmAttach (ezx.display, &ezshm.info);
+    XSync (ezx.display, False);
+    XSetErrorHandler (handler);
+
+    /* The segment will be destroyed once detached by both sides */
+    shmctl (ezshm.info.shmid, IPC_RMID, NULL);
+
+    if (ez_xshm_error_flag) {
+        ez_error ("ez_xshm_alloc: XShmAttach failed, MIT-SHM disabled\n");
+        ezshm.state = -1;
+        shmdt (ezshm.info.shmaddr);
+        xi->data = NULL;
+        XDestroyImage (xi);
+        return -1;
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xshm_alloc  w = %d  h = %d  bpp = %d\n",
+            w, h, xi->bits_per_pixel);
+
+    ezshm.xi = xi;
+    ezshm.width = w; ezshm.height = h;
+    ezshm.pending = 0;
+    return 0;
+}
+
+
+void ez_xshm_free (void)
+{
+    if (ezshm.xi == NULL) return;
+
+    XShmDetach (ezx.display, &ezshm.info);
+    XSync (ezx.display, False);
+    shmdt (ezshm.info.shmaddr);
+
+    /* xi->data is the segment, which must not be freed by XDestroyImage */
+    ezshm.xi->data = NULL;
+    XDestroyImage (ezshm.xi);
+    ezshm.xi = NULL;
+    ezshm.width = ezshm.height = 0;
+    ezshm.pending = 0;
+}
+
+
+/*
+ * Fill the shared XImage with a sub-image, at coordinates 0,0.
+ * Return the XImage (not to be destroyed), else NULL.
+*/
+
+XImage *ez_xshm_create (Ez_image *img, int src_x, int src_y, int w, int h,
+    ez_xi_func xi_func)
+{
+    if (xi_func == NULL || ez_xshm_alloc (w, h) < 0) return NULL;
+
+    /* The server may still be reading the segment */
+    if (ezshm.pending) {
+        XSync (ezx.display, False);
+        ezshm.pending = 0;
+    }
+
+    ez_xi_fill (ezshm.xi, img, src_x, src_y, w, h, xi_func);
+    return ezshm.xi;
+}
+
+
+void ez_xshm_put (Drawable d, XImage *xi, int x, int y, int w, int h)
+{
+    XShmPutImage (ezx.display, d, ezx.gc, xi, 0, 0, x, y, w, h, False);
+    ezshm.pending = 1;
+}
+
+
+/*
+ * The XRender extension composites the pixmaps having an alpha channel with
+ * the 256 levels of transparency, in the X server, instead of cutting them
+ * with a 1 bit mask thresholded by the opacity. If the extension is missing,
+ * we fall back on the masks. To disable, define environment variable
+ * EZ_IMAGE_NOXRENDER.
+*/
+
+int ez_xrender_available (void)
+{
+    int event_base, error_base;
+
+    if (ezrender.state == 0) {
+        ezrender.state = -1;
+        if (getenv ("EZ_IMAGE_NOXRENDER") == NULL &&
+            XRenderQueryExtension (ezx.display, &event_base, &error_base)) {
+            ezrender.argb = XRenderFindStandardFormat (ezx.display,
+                PictStandardARGB32);
+            ezrender.screen = XRenderFindVisualFormat (ezx.display, ezx.visual);
+            if (ezrender.argb != NULL && ezrender.screen != NULL)
+                ezrender.state = 1;
+        }
+        if (ez_image_debug())
+            printf ("ez_xrender_available  RENDER %s\n",
+                ezrender.state > 0 ? "enabled" : "disabled");
+    }
+    return ezrender.state > 0;
+}
+
+
+/*
+ * Build in pix a pixmap of depth 32 from img, with premultiplied colors,
+ * and its picture; the picture repeats, for ez_pixmap_tile. The colors of
+ * img are multiplied by alpha unless they are already.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_xrender_build_map (Ez_pixmap *pix, Ez_image *img)
+{
+    XImage *xi;
+    XRenderPictureAttributes pa;
+    Ez_uint8 *data, *s, *d;
+    int i, n = img->width * img->height, a;
+
+    pix->map = XCreatePixmap (ezx.display, ezx.root_win,
+        img->width, img->height, 32);
+    if (pix->map == None) return -1;
+    if (ezrender.gc == NULL)
+        ezrender.gc = XCreateGC (ezx.display, pix->map, 0, NULL);
+
+    data = malloc (n*4);
+    if (data == NULL) return -1;
+
+    /* Pixels A,R,G,B as 32 bits little endian */
+    for (i = 0, s = img->pixels_rgba, d = data; i < n; i++, s += 4, d += 4) {
+        a = s[3];
+        if (img->premul) {
+            d[0] = s[2]; d[1] = s[1]; d[2] = s[0];
+        } else {
+            d[0] = EZ_DIV255 (s[2]*a);
+            d[1] = EZ_DIV255 (s[1]*a);
+            d[2] = EZ_DIV255 (s[0]*a);
+        }
+        d[3] = a;
+    }
+
+    xi = XCreateImage (ezx.display, NULL, 32, ZPixmap, 0, (char *) data,
+        img->width, img->height, 32, img->width*4);
+    if (xi == NULL) {
+        free (data);
+        return -1;
+    }
+    xi->byte_order = LSBFirst;
+    XPutImage (ezx.display, pix->map, ezrender.gc, xi, 0, 0, 0, 0,
+        img->width, img->height);
+    XDestroyImage (xi);
+
+    pa.repeat = RepeatNormal;
+    pix->pict = XRenderCreatePicture (ezx.display, pix->map, ezrender.argb,
+        CPRepeat, &pa);
+    return pix->pict == None ? -1 : 0;
+}
+
+
+/*
+ * Composite the area src_x,src_y,w,h of the picture of pix over d at x,y.
+*/
+
+void ez_xrender_composite (Drawable d, Ez_pixmap *pix, int src_x, int src_y,
+    int x, int y, int w, int h)
+{
+    Picture dst;
+
+    dst = XRenderCreatePicture (ezx.display, d, ezrender.screen, 0, NULL);
+    XRenderComposite (ezx.display, PictOpOver, pix->pict, None, dst,
+        src_x, src_y, 0, 0, x, y, w, h);
+    XRenderFreePicture (ezx.display, dst);
+}
+
+
+/*
+ * Create a cutting mask from alpha channel and opacity threshold
+*/
+
+Pixmap ez_xmask_create (Ez_window win, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Pixmap mask = None;
+    Ez_uint8 *data = NULL;
+    int bytes_per_line = (w+7)/8;
+    double time1 = 0, time2 = 0, time3 = 0;
+
+    /* Reuse a buffer of same size, depth 1; each byte is written */
+    data = ez_xcache_get (w, h, 1);
+    if (data == NULL) data = malloc (bytes_per_line*h);
+    if (data == NULL) {
+        ez_error ("ez_xmask_create: out of memory\n");
+        return None;
+    }
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    ez_xmask_fill (data, img, src_x, src_y, w, h);
+
+    if (ez_image_debug()) time2 = ez_get_time ();
+
+    mask = XCreateBitmapFromData (ezx.display, win, (char*) data, w, h);
+    if (mask == None)
+        ez_error ("ez_xmask_create: can't create bitmap");
+
+    if (ez_image_debug()) {
+        time3 = ez_get_time ();
+        printf ("ez_xmask_create   fill %.3f ms   bitmap %.3f ms\n",
+            (time2-time1)*1000, (time3-time2)*1000);
+    }
+
+    ez_xcache_put (data, w, h, 1, bytes_per_line*h);
+    return mask;
+}
+
+
+/*
+ * Fill the bitmap data with the bits of the pixels whose alpha >= opacity,
+ * the first pixel in the low bit of each byte.
+*/
+
+void ez_xmask_fill (Ez_uint8 *data, Ez_image *img,
+    int src_x, int src_y, int w, int h)
+{
+    ez_xmask_func xmask_func;
+    int y, bpl = (w+7)/8, opacity = img->opacity;
+
+    if (opacity > 255) {
+        memset (data, 0, bpl*h);
+        return;
+    }
+    if (opacity < 0) opacity = 0;
+
+    xmask_func = ez_xmask_get_func ();
+    for (y = 0; y < h; y++)
+        xmask_func (data + y*bpl,
+            img->pixels_rgba + ((src_y+y) * img->width + src_x) * 4, w, opacity);
+}
+
+
+/*
+ * Get the mask of the whole image img, built once for its pixels and opacity.
+ * Return the mask, else None.
+*/
+
+Pixmap ez_image_get_xmask (Ez_image *img)
+{
+    if (img->xmask != None) {
+        if (img->xmask_opacity == img->opacity) return img->xmask;
+        XFreePixmap (ezx.display, img->xmask);
+    }
+    img->xmask = ez_xmask_create (ezx.root_win, img, 0, 0,
+        img->width, img->height);
+    img->xmask_opacity = img->opacity;
+    return img->xmask;
+}
+
+
+/*
+ * Choose the function which fills a row of the mask; opacity is in 0..255.
+*/
+
+ez_xmask_func ez_xmask_get_func (void)
+{
+    static ez_xmask_func xmask_func = NULL;
+
+    if (xmask_func != NULL) return xmask_func;
+    xmask_func = ez_xmask_row_default;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2) xmask_func = ez_xmask_row_avx2;
+        else if (cpu & EZ_CPU_SSE2) xmask_func = ez_xmask_row_sse2;
+    }
+#endif /* EZ_SIMD_X86 */
+
+    return xmask_func;
+}
+
+
+void ez_xmask_row_default (Ez_uint8 *dst, const Ez_uint8 *src, int w, int opacity)
+{
+    int x, j, bits;
+
+    for (x = 0; x < w; x += 8) {
+        for (j = 0, bits = 0; j < 8 && x+j < w; j++)
+            if (src[(x+j)*4+3] >= opacity) bits |= 1 << j;
+        *dst++ = bits;
+    }
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * The alpha bytes of 16 or 32 pixels are packed, compared to opacity as
+ * max (alpha, opacity) == alpha, and their sign bits gathered by movemask.
+*/
+
+EZ_TARGET ("sse2")
+void ez_xmask_row_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int opacity)
+{
+    __m128i op = _mm_set1_epi8 ((char) opacity), a, b, c, d;
+    int x, bits;
+
+    for (x = 0; x+16 <= w; x += 16) {
+        a = _mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *) (src + x*4)), 24);
+        b = _mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *) (src + x*4+16)), 24);
+        c = _mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *) (src + x*4+32)), 24);
+        d = _mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *) (src + x*4+48)), 24);
+        a = _mm_packus_epi16 (_mm_packs_epi32 (a, b), _mm_packs_epi32 (c, d));
+        bits = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_max_epu8 (a, op), a));
+        dst[x/8]   = bits;
+        dst[x/8+1] = bits >> 8;
+    }
+    if (x < w) ez_xmask_row_default (dst + x/8, src + x*4, w-x, opacity);
+}
+
+
+EZ_TARGET ("avx2")
+void ez_xmask_row_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int opacity)
+{
+    /* Packing is done in each 128 bits lane; the order is restored after */
+    __m256i op = _mm256_set1_epi8 ((char) opacity),
+            perm = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7), a, b, c, d;
+    Ez_uint32 bits;
+    int x;
+
+    for (x = 0; x+32 <= w; x += 32) {
+        a = _mm256_srli_epi32 (_mm256_loadu_si256 ((const __m256i *) (src + x*4)), 24);
+        b = _mm256_srli_epi32 (_mm256_loadu_si256 ((const __m256i *) (src + x*4+32)), 24);
+        c = _mm256_srli_epi32 (_mm256_loadu_si256 ((const __m256i *) (src + x*4+64)), 24);
+        d = _mm256_srli_epi32 (_mm256_loadu_si256 ((const __m256i *) (src + x*4+96)), 24);
+        a = _mm256_packus_epi16 (_mm256_packs_epi32 (a, b), _mm256_packs_epi32 (c, d));
+        a = _mm256_permutevar8x32_epi32 (a, perm);
+        bits = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_max_epu8 (a, op), a));
+        dst[x/8]   = bits;
+        dst[x/8+1] = bits >> 8;
+        dst[x/8+2] = bits >> 16;
+        dst[x/8+3] = bits >> 24;
+    }
+    if (x < w) ez_xmask_row_sse2 (dst + x/8, src + x*4, w-x, opacity);
+}
+
+#endif /* EZ_SIMD_X86 */
+
+#elif defined EZ_BASE_WIN32
+
+/*
+ * Display a sub-image with transparency.
+ * DIB = Device Independent Bitmap
+*/
+
+void ez_image_draw_dib (HDC hdc_dst, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    HDC hdc = NULL;
+    HBITMAP hbitmap = NULL;
+    BITMAPINFO bmi;
+    Ez_uint8 *data;
+    Ez_band b;
+
+    /* Create a DC for the bitmap */
+    hdc = CreateCompatibleDC(hdc_dst);
+    if (hdc == NULL) {
+        ez_error ("ez_image_draw_dib: can't create compatible DC\n");
+        return;
+    }
+
+    ZeroMemory(&bmi, sizeof(BITMAPINFO));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = w;
+    bmi.bmiHeader.biHeight = -h;  /* negative height for Origin at top left */
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    bmi.bmiHeader.biSizeImage = w * h * 4;
+
+    hbitmap = CreateDIBSection (hdc_dst, &bmi, DIB_RGB_COLORS, (void **) &data, NULL, 0);
+    if (hbitmap == NULL) {
+        ez_error ("ez_image_draw_dib: can't create DIB Section\n");
+        goto final;
+    }
+    SelectObject (hdc, hbitmap);
+
+    ez_band_init (&b, ez_band_dib, NULL, img, 0, 0, src_x, src_y, w, h);
+    b.dib = data;
+    ez_parallel_rows (&b, h, w);
+
+    if (img->has_alpha) {
+        BLENDFUNCTION bf;
+
+        bf.BlendOp = AC_SRC_OVER;
+        bf.BlendFlags = 0;
+        bf.AlphaFormat = AC_SRC_ALPHA;  /* alpha channel premultiplied */
+        bf.SourceConstantAlpha = 0xff;
+
+        if (AlphaBlend (hdc_dst, x, y, w, h, hdc, 0, 0, w, h, bf) == FALSE)
+            ez_error ("ez_image_draw_dib: AlphaBlend failed\n");
+    } else {
+        if (BitBlt (hdc_dst, x, y, w, h, hdc, 0, 0, SRCCOPY ) == 0)
+            ez_error ("ez_image_draw_dib: bitblt failed\n");
+    }
+
+  final:
+    if (hbitmap != NULL) DeleteObject (hbitmap);
+    if (hdc != NULL) DeleteDC (hdc);
+}
+
+
+/* Fill the rows y0 to y1-1 of the DIB, of width w */
+
+void ez_band_dib (Ez_band *b, int y0, int y1)
+{
+    Ez_image *img = b->src;
+    Ez_uint8 *data = b->dib + (size_t) y0 * b->w * 4;
+
+    if (!img->has_alpha)
+         ez_dib_fill_noalpha   (data, img, b->src_x, b->src_y + y0, b->w, y1 - y0);
+    else if (img->opacity >= 0)
+         ez_dib_fill_opacity   (data, img, b->src_x, b->src_y + y0, b->w, y1 - y0);
+    else ez_dib_fill_truealpha (data, img, b->src_x, b->src_y + y0, b->w, y1 - y0);
+}
+
+
+void ez_dib_fill_noalpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
+        data[i+3] = 0xff;
+        data[i+2] = img->pixels_rgba[tx];
+        data[i+1] = img->pixels_rgba[tx+1];
+        data[i  ] = img->pixels_rgba[tx+2];
+    }
+
+    if (ez_image_debug())
+        printf ("ez_dib_fill_noalpha %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+void ez_dib_fill_opacity (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
+        if (img->pixels_rgba[tx+3] >= img->opacity) {
+            data[i+3] = 0xff;
+            data[i+2] = img->pixels_rgba[tx];
+            data[i+1] = img->pixels_rgba[tx+1];
+            data[i  ] = img->pixels_rgba[tx+2];
+        } else {
+            data[i+3] = 0;
+            data[i+2] = 0;
+            data[i+1] = 0;
+            data[i  ] = 0;
+        }
+    }
+
+    if (ez_image_debug())
+        printf ("ez_dib_fill_opacity %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+void ez_dib_fill_truealpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4, a;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
+        data[i+3] = a = img->pixels_rgba[tx+3];
+        data[i+2] = img->pixels_rgba[tx  ]*a/255;
+        data[i+1] = img->pixels_rgba[tx+1]*a/255;
+        data[i  ] = img->pixels_rgba[tx+2]*a/255;
+    }
+
+    if (ez_image_debug())
+        printf ("ez_dib_fill_truealpha %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+#elif defined EZ_BASE_MEMORY
+
+/*
+ * Display a sub-image directly in the pixels of the surface, clipped to it.
+ * With has_alpha, pixels are kept when alpha >= opacity, or blended when
+ * opacity < 0, as on Win32.
+*/
+
+void ez_image_draw_mem (Ez_window win, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    Ez_uint8 *data, *s, *d;
+    int i, j, a;
+
+    /* Clip to the surface and to the damaged area */
+    if (x < 0) { src_x -= x; w += x; x = 0; }
+    if (y < 0) { src_y -= y; h += y; y = 0; }
+    if (x + w > win->width ) w = win->width  - x;
+    if (y + h > win->height) h = win->height - y;
+    if (ez_clip_area (win, &x, &y, &src_x, &src_y, &w, &h) < 0) return;
+
+    data = ez_mem_pixels (win);
+
+    for (j = 0; j < h; j++) {
+        s = img->pixels_rgba + ((src_y+j) * img->width + src_x) * 4;
+        d = data + ((y+j) * win->width + x) * 4;
+        if (!img->has_alpha) {
+            memcpy (d, s, w*4);
+        } else if (img->opacity >= 0) {
+            for (i = 0; i < w; i++, s += 4, d += 4)
+                if (s[3] >= img->opacity) memcpy (d, s, 4);
+        } else {
+            for (i = 0; i < w; i++, s += 4, d += 4) {
+                a = s[3];
+                d[0] = (s[0]*a + d[0]*(255-a)) / 255;
+                d[1] = (s[1]*a + d[1]*(255-a)) / 255;
+                d[2] = (s[2]*a + d[2]*(255-a)) / 255;
+            }
+        }
+    }
+}
+
+#endif /* EZ_BASE_ */
+
+
+/*
+ * Print a rectangular region of the image img in the terminal.
+*/
+
+void ez_image_print_rgba (Ez_image *img, int src_x, int src_y, int w, int h)
+{
+    int x, y;
+    Ez_uint8 *p;
+
+    printf (" y,x ");
+    for (x = src_x; x < src_x+w; x++)
+        printf ("|      %4d      ", x);
+    printf ("\n");
+
+    for (y = src_y; y < src_y+h; y++) {
+        printf ("%4d ", y);
+        for (x = src_x; x < src_x+w; x++) {
+            p = img->pixels_rgba + (y*img->width+x)*4;
+            printf ("| %3d %3d %3d %3d", p[0], p[1], p[2], p[3]);
+        }
+        printf ("\n");
+    }
+}
+
+
+/*
+ * Fill image with a RGBA color
+*/
+
+void ez_image_comp_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b,
+    Ez_uint8 a)
+{
+    Ez_uint8 c[4];
+    Ez_uint32 val;
+
+    c[0] = r; c[1] = g; c[2] = b; c[3] = a;
+    memcpy (&val, c, 4);
+    ez_fill_get_func () ((Ez_uint32 *) img->pixels_rgba, val,
+        img->width * img->height);
+}
+
+
+/*
+ * Superimpose src into dst, without transparency
+*/
+
+int ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h)
+{
+    Ez_band b;
+
+    ez_band_init (&b, ez_band_over, dst, src, dst_x, dst_y, src_x, src_y, w, h);
+    return ez_parallel_rows (&b, h, w);
+}
+
+
+void ez_band_over (Ez_band *b, int y0, int y1)
+{
+    Ez_image *src = b->src, *dst = b->dst;
+    Ez_uint8 *s, *d;
+    int y, w = b->w;
+
+    for (y = y0; y < y1; y++) {
+        s = src->pixels_rgba + ((y+b->src_y)*src->width + b->src_x)*4;
+        d = dst->pixels_rgba + ((y+b->dst_y)*dst->width + b->dst_x)*4;
+        if (src->premul == dst->premul)
+             memcpy (d, s, w*4);
+        else if (dst->premul)
+             ez_premul_row (d, s, w);
+        else ez_unpremul_row (d, s, w);
+    }
+}
+
+
+/*
+ * Superimpose src into dst, with transparency. The rows of src are
+ * converted if it is not stored like dst, premultiplied or not.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h)
+{
+    Ez_band b;
+    double time1 = 0;
+    int res;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    /* Select the function before the threads */
+    ez_blend_get_func (dst->premul);
+
+    ez_band_init (&b, ez_band_blend, dst, src, dst_x, dst_y, src_x, src_y, w, h);
+    res = ez_parallel_rows (&b, h, w);
+
+    if (ez_image_debug())
+        printf ("ez_image_comp_blend %.3f ms\n", (ez_get_time() - time1)*1000);
+    return res;
+}
+
+
+void ez_band_blend (Ez_band *b, int y0, int y1)
+{
+    Ez_image *src = b->src, *dst = b->dst;
+    ez_blend_func blend_func = ez_blend_get_func (dst->premul);
+    Ez_uint8 *s, *d, *tmp = NULL;
+    int y, w = b->w;
+
+    if (src->premul != dst->premul) {
+        tmp = malloc (w*4);
+        if (tmp == NULL) {
+            ez_error ("ez_band_blend: out of memory\n");
+            b->failed = 1;
+            return;
+        }
+    }
+
+    for (y = y0; y < y1; y++) {
+        s = src->pixels_rgba + ((y+b->src_y)*src->width + b->src_x)*4;
+        d = dst->pixels_rgba + ((y+b->dst_y)*dst->width + b->dst_x)*4;
+        if (tmp != NULL) {
+            if (dst->premul)
+                 ez_premul_row (tmp, s, w);
+            else ez_unpremul_row (tmp, s, w);
+            s = tmp;
+        }
+        blend_func (d, s, w);
+    }
+    free (tmp);
+}
+
+
+/*
+ * Conversion of a row of w pixels between straight and premultiplied colors;
+ * dst and src may be the same.
+*/
+
+void ez_premul_row (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    int i, k, a, c;
+
+    for (i = 0; i < w*4; i += 4) {
+        a = src[i+3];
+        for (k = 0; k < 3; k++) {
+            c = src[i+k] * a + 128;             /* c*a/255 rounded */
+            dst[i+k] = (c + (c >> 8)) >> 8;
+        }
+        dst[i+3] = a;
+    }
+}
+
+
+void ez_unpremul_row (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    int i, k, a, c;
+
+    for (i = 0; i < w*4; i += 4) {
+        a = src[i+3];
+        for (k = 0; k < 3; k++) {
+            c = a == 0 ? 0 : (src[i+k] * 255 + a/2) / a;
+            dst[i+k] = c < 255 ? c : 255;
+        }
+        dst[i+3] = a;
+    }
+}
+
+
+/*
+ * Choose the fastest row blending function of the processor. The vectorized
+ * functions give the same results as the default ones, which is checked by
+ * test_blend.c. If premul is true, the functions blend premultiplied colors.
+*/
+
+ez_blend_func ez_blend_get_func (int premul)
+{
+    static ez_blend_func blend_func[2] = { NULL, NULL };
+    ez_blend_func func;
+    int k = premul ? 1 : 0;
+
+    if (blend_func[k] != NULL) return blend_func[k];
+    func = premul ? ez_blend_row_pm_default : ez_blend_row_default;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2)
+            func = premul ? ez_blend_row_pm_avx2 : ez_blend_row_avx2;
+        else if (cpu & EZ_CPU_SSE2)
+            func = premul ? ez_blend_row_pm_sse2 : ez_blend_row_sse2;
+    }
+#endif /* EZ_SIMD_X86 */
+
+    blend_func[k] = func;
+    return func;
+}
+
+
+/*
+ * Blend a row of w pixels of src over dst, with straight colors:
+ * a_res = a_src + a_dst*(255-a_src)/255 and
+ * c_res = (c_src*a_src + c_dst*a_dst*(255-a_src)/255) / a_res.
+*/
+
+void ez_blend_row_default (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    int i, k, a_src, t, a_res, c;
+
+    for (i = 0; i < w*4; i += 4) {
+        a_src = src[i+3];
+        t = dst[i+3] * (255-a_src);
+        a_res = a_src + t / 255;
+
+        if (a_res == 0) {
+            dst[i] = dst[i+1] = dst[i+2] = dst[i+3] = 0;
+            continue;
+        }
+
+        for (k = 0; k < 3; k++) {
+            c = (src[i+k] * a_src + dst[i+k] * t / 255) / a_res;
+            dst[i+k] = c < 255 ? c : 255;
+        }
+        dst[i+3] = a_res;
+    }
+}
+
+
+/*
+ * Blend a row of w pixels of src over dst, with premultiplied colors:
+ * c_res = c_src + c_dst*(255-a_src)/255 rounded, for each channel.
+*/
+
+void ez_blend_row_pm_default (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    int i, k, ia, c;
+
+    for (i = 0; i < w*4; i += 4) {
+        ia = 255 - src[i+3];
+        for (k = 0; k < 4; k++) {
+            c = dst[i+k] * ia + 128;
+            c = src[i+k] + ((c + (c >> 8)) >> 8);
+            dst[i+k] = c < 255 ? c : 255;
+        }
+    }
+}
+
+
+/*
+ * Choose the function which fills a row of w pixels with the value val.
+*/
+
+ez_fill_func ez_fill_get_func (void)
+{
+    static ez_fill_func fill_func = NULL;
+
+    if (fill_func != NULL) return fill_func;
+    fill_func = ez_fill_row_default;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2) fill_func = ez_fill_row_avx2;
+        else if (cpu & EZ_CPU_SSE2) fill_func = ez_fill_row_sse2;
+    }
+#endif /* EZ_SIMD_X86 */
+
+    return fill_func;
+}
+
+
+void ez_fill_row_default (Ez_uint32 *dst, Ez_uint32 val, int w)
+{
+    int x;
+    for (x = 0; x < w; x++) dst[x] = val;
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * Vectorized blending functions, with the same results as the default ones.
+ *
+ * For straight colors, the channels of 4 or 8 pixels are processed in
+ * float lanes: the products are below 2^24 hence exact, and the divisions
+ * are correctly rounded, so their truncations are the integer divisions.
+ * For premultiplied colors, the channels are processed in 16 bit lanes.
+*/
+
+EZ_TARGET ("sse2")
+void ez_blend_row_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    __m128i m8 = _mm_set1_epi32 (0xFF), ps, pd, sh, c, res;
+    __m128 f255 = _mm_set1_ps (255), f1 = _mm_set1_ps (1),
+           as, t, a_res, den, num;
+    int x, k;
+
+    for (x = 0; x+4 <= w; x += 4) {
+        ps = _mm_loadu_si128 ((__m128i *) (src + x*4));
+        pd = _mm_loadu_si128 ((__m128i *) (dst + x*4));
+        as = _mm_cvtepi32_ps (_mm_srli_epi32 (ps, 24));
+        t  = _mm_mul_ps (_mm_cvtepi32_ps (_mm_srli_epi32 (pd, 24)),
+                         _mm_sub_ps (f255, as));
+        a_res = _mm_add_ps (as,
+                    _mm_cvtepi32_ps (_mm_cvttps_epi32 (_mm_div_ps (t, f255))));
+        den = _mm_max_ps (a_res, f1);           /* If a_res = 0, c_res = 0 */
+        res = _mm_slli_epi32 (_mm_cvttps_epi32 (a_res), 24);
+
+        for (k = 0; k < 3; k++) {
+            sh = _mm_cvtsi32_si128 (8*k);
+            num = _mm_mul_ps (t, _mm_cvtepi32_ps (
+                      _mm_and_si128 (_mm_srl_epi32 (pd, sh), m8)));
+            num = _mm_cvtepi32_ps (_mm_cvttps_epi32 (_mm_div_ps (num, f255)));
+            num = _mm_add_ps (num, _mm_mul_ps (as, _mm_cvtepi32_ps (
+                      _mm_and_si128 (_mm_srl_epi32 (ps, sh), m8))));
+            /* Bounded before the truncation, SSE2 having no 32 bit min */
+            c = _mm_cvttps_epi32 (_mm_min_ps (_mm_div_ps (num, den), f255));
+            res = _mm_or_si128 (res, _mm_sll_epi32 (c, sh));
+        }
+        _mm_storeu_si128 ((__m128i *) (dst + x*4), res);
+    }
+    ez_blend_row_default (dst + x*4, src + x*4, w - x);
+}
+
+
+EZ_TARGET ("avx2")
+void ez_blend_row_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    __m256i m8 = _mm256_set1_epi32 (0xFF), k255 = _mm256_set1_epi32 (255),
+            ps, pd, c, res;
+    __m256 f255 = _mm256_set1_ps (255), f1 = _mm256_set1_ps (1),
+           as, t, a_res, den, num;
+    __m128i sh;
+    int x, k;
+
+    for (x = 0; x+8 <= w; x += 8) {
+        ps = _mm256_loadu_si256 ((__m256i *) (src + x*4));
+        pd = _mm256_loadu_si256 ((__m256i *) (dst + x*4));
+        as = _mm256_cvtepi32_ps (_mm256_srli_epi32 (ps, 24));
+        t  = _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_srli_epi32 (pd, 24)),
+                            _mm256_sub_ps (f255, as));
+        a_res = _mm256_add_ps (as, _mm256_cvtepi32_ps (
+                    _mm256_cvttps_epi32 (_mm256_div_ps (t, f255))));
+        den = _mm256_max_ps (a_res, f1);
+        res = _mm256_slli_epi32 (_mm256_cvttps_epi32 (a_res), 24);
+
+        for (k = 0; k < 3; k++) {
+            sh = _mm_cvtsi32_si128 (8*k);
+            num = _mm256_mul_ps (t, _mm256_cvtepi32_ps (
+                      _mm256_and_si256 (_mm256_srl_epi32 (pd, sh), m8)));
+            num = _mm256_cvtepi32_ps (_mm256_cvttps_epi32 (
+                      _mm256_div_ps (num, f255)));
+            num = _mm256_add_ps (num, _mm256_mul_ps (as, _mm256_cvtepi32_ps (
+                      _mm256_and_si256 (_mm256_srl_epi32 (ps, sh), m8))));
+            c = _mm256_min_epi32 (_mm256_cvttps_epi32 (
+                    _mm256_div_ps (num, den)), k255);
+            res = _mm256_or_si256 (res, _mm256_sll_epi32 (c, sh));
+        }
+        _mm256_storeu_si256 ((__m256i *) (dst + x*4), res);
+    }
+    ez_blend_row_default (dst + x*4, src + x*4, w - x);
+}
+
+
+EZ_TARGET ("sse2")
+void ez_blend_row_pm_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    __m128i zero = _mm_setzero_si128 (), k255 = _mm_set1_epi16 (255),
+            k128 = _mm_set1_epi16 (128), ps, pd, s, c[2];
+    int x, k;
+
+    for (x = 0; x+4 <= w; x += 4) {
+        ps = _mm_loadu_si128 ((__m128i *) (src + x*4));
+        pd = _mm_loadu_si128 ((__m128i *) (dst + x*4));
+        for (k = 0; k < 2; k++) {
+            s    = k ? _mm_unpackhi_epi8 (ps, zero) : _mm_unpacklo_epi8 (ps, zero);
+            c[k] = k ? _mm_unpackhi_epi8 (pd, zero) : _mm_unpacklo_epi8 (pd, zero);
+            /* 255 - a_src repeated on the 4 channels of each pixel */
+            s = _mm_sub_epi16 (k255,
+                    _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (s, 0xFF), 0xFF));
+            c[k] = _mm_add_epi16 (_mm_mullo_epi16 (c[k], s), k128);
+            c[k] = _mm_srli_epi16 (_mm_add_epi16 (c[k], _mm_srli_epi16 (c[k], 8)), 8);
+        }
+        _mm_storeu_si128 ((__m128i *) (dst + x*4),
+            _mm_adds_epu8 (ps, _mm_packus_epi16 (c[0], c[1])));
+    }
+    ez_blend_row_pm_default (dst + x*4, src + x*4, w - x);
+}
+
+
+EZ_TARGET ("avx2")
+void ez_blend_row_pm_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w)
+{
+    __m256i zero = _mm256_setzero_si256 (), k255 = _mm256_set1_epi16 (255),
+            k128 = _mm256_set1_epi16 (128), ps, pd, s, c[2];
+    int x, k;
+
+    /* Unpack and pack work inside each 128 bit lane, so they cancel out */
+    for (x = 0; x+8 <= w; x += 8) {
+        ps = _mm256_loadu_si256 ((__m256i *) (src + x*4));
+        pd = _mm256_loadu_si256 ((__m256i *) (dst + x*4));
+        for (k = 0; k < 2; k++) {
+            s    = k ? _mm256_unpackhi_epi8 (ps, zero) : _mm256_unpacklo_epi8 (ps, zero);
+            c[k] = k ? _mm256_unpackhi_epi8 (pd, zero) : _mm256_unpacklo_epi8 (pd, zero);
+            s = _mm256_sub_epi16 (k255, _mm256_shufflehi_epi16 (
+                    _mm256_shufflelo_epi16 (s, 0xFF), 0xFF));
+            c[k] = _mm256_add_epi16 (_mm256_mullo_epi16 (c[k], s), k128);
+            c[k] = _mm256_srli_epi16 (_mm256_add_epi16 (c[k],
+                       _mm256_srli_epi16 (c[k], 8)), 8);
+        }
+        _mm256_storeu_si256 ((__m256i *) (dst + x*4),
+            _mm256_adds_epu8 (ps, _mm256_packus_epi16 (c[0], c[1])));
+    }
+    ez_blend_row_pm_default (dst + x*4, src + x*4, w - x);
+}
+
+
+EZ_TARGET ("sse2")
+void ez_fill_row_sse2 (Ez_uint32 *dst, Ez_uint32 val, int w)
+{
+    __m128i v = _mm_set1_epi32 (val);
+    int x;
+
+    for (x = 0; x+4 <= w; x += 4)
+        _mm_storeu_si128 ((__m128i *) (dst+x), v);
+    for (; x < w; x++) dst[x] = val;
+}
+
+
+EZ_TARGET ("avx2")
+void ez_fill_row_avx2 (Ez_uint32 *dst, Ez_uint32 val, int w)
+{
+    __m256i v = _mm256_set1_epi32 (val);
+    int x;
+
+    for (x = 0; x+8 <= w; x += 8)
+        _mm256_storeu_si256 ((__m256i *) (dst+x), v);
+    for (; x < w; x++) dst[x] = val;
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
+/*
+ * Composite src into dst with the operator op and the constant alpha.
+ * The rows are converted to premultiplied colors if needed.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_comp_op (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h, int op, int alpha)
+{
+    Ez_band b;
+    double time1 = 0;
+    int res;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    /* Select the function before the threads */
+    ez_comp_get_func ();
+
+    ez_band_init (&b, ez_band_comp_op, dst, src, dst_x, dst_y, src_x, src_y, w, h);
+    b.op = op;
+    b.alpha = alpha;
+    res = ez_parallel_rows (&b, h, w);
+
+    if (ez_image_debug())
+        printf ("ez_image_comp_op %d  %.3f ms\n", op,
+            (ez_get_time() - time1)*1000);
+    return res;
+}
+
+
+void ez_band_comp_op (Ez_band *b, int y0, int y1)
+{
+    Ez_image *src = b->src, *dst = b->dst;
+    ez_comp_func comp_func = ez_comp_get_func ();
+    Ez_uint8 *s, *d, *tmp_s = NULL, *tmp_d = NULL;
+    int y, w = b->w, direct_s, direct_d;
+
+    direct_s = src->premul && src->has_alpha && b->alpha == 255;
+    direct_d = dst->premul && dst->has_alpha;
+    tmp_s = direct_s ? NULL : malloc (w*4);
+    tmp_d = direct_d ? NULL : malloc (w*4);
+    if ((!direct_s && tmp_s == NULL) || (!direct_d && tmp_d == NULL)) {
+        ez_error ("ez_band_comp_op: out of memory\n");
+        b->failed = 1;
+        goto free_tmp;
+    }
+
+    for (y = y0; y < y1; y++) {
+        s = src->pixels_rgba + ((y+b->src_y)*src->width + b->src_x)*4;
+        d = dst->pixels_rgba + ((y+b->dst_y)*dst->width + b->dst_x)*4;
+        if (! direct_s) {
+            ez_comp_load_row (tmp_s, s, w, src->premul, src->has_alpha, b->alpha);
+            s = tmp_s;
+        }
+        if (direct_d) {
+            comp_func (d, s, w, b->op);
+            continue;
+        }
+        ez_comp_load_row (tmp_d, d, w, dst->premul, dst->has_alpha, 255);
+        comp_func (tmp_d, s, w, b->op);
+        if (dst->premul)
+             memcpy (d, tmp_d, w*4);
+        else ez_unpremul_row (d, tmp_d, w);
+    }
+
+  free_tmp:
+    free (tmp_s);
+    free (tmp_d);
+}
+
+
+/*
+ * Load a row of w pixels as premultiplied colors, opaque if has_alpha is
+ * false, then multiplied by the constant alpha.
+*/
+
+void ez_comp_load_row (Ez_uint8 *dst, const Ez_uint8 *src, int w,
+    int premul, int has_alpha, int alpha)
+{
+    int i, k, a;
+
+    for (i = 0; i < w*4; i += 4) {
+        a = has_alpha ? src[i+3] : 255;
+        for (k = 0; k < 3; k++)
+            dst[i+k] = premul || !has_alpha ? src[i+k] : EZ_DIV255 (src[i+k] * a);
+        dst[i+3] = a;
+        if (alpha < 255)
+            for (k = 0; k < 4; k++)
+                dst[i+k] = EZ_DIV255 (dst[i+k] * alpha);
+    }
+}
+
+
+/*
+ * The operators, with premultiplied colors s, d and alphas as, ad in [0,1]:
+ * result = s*Fa + d*Fb + k*s*d for each channel and for the alpha, where
+ * Fa = a0 + sa*ad and Fb = b0 + sb*as. The coefficients are a0, sa, b0, sb, k.
+*/
+
+const signed char ez_comp_coefs[EZ_OP_LAST][5] = {
+    { 0, 0, 0, 0, 0 },      /* EZ_OP_CLEAR    0                 */
+    { 1, 0, 0, 0, 0 },      /* EZ_OP_SRC      s                 */
+    { 0, 0, 1, 0, 0 },      /* EZ_OP_DST      d                 */
+    { 1, 0, 1,-1, 0 },      /* EZ_OP_OVER     s + d*(1-as)      */
+    { 1,-1, 1, 0, 0 },      /* EZ_OP_DST_OVER s*(1-ad) + d      */
+    { 0, 1, 0, 0, 0 },      /* EZ_OP_IN       s*ad              */
+    { 0, 0, 0, 1, 0 },      /* EZ_OP_DST_IN   d*as              */
+    { 1,-1, 0, 0, 0 },      /* EZ_OP_OUT      s*(1-ad)          */
+    { 0, 0, 1,-1, 0 },      /* EZ_OP_DST_OUT  d*(1-as)          */
+    { 0, 1, 1,-1, 0 },      /* EZ_OP_ATOP     s*ad + d*(1-as)   */
+    { 1,-1, 0, 1, 0 },      /* EZ_OP_DST_ATOP s*(1-ad) + d*as   */
+    { 1,-1, 1,-1, 0 },      /* EZ_OP_XOR      s*(1-ad) + d*(1-as) */
+    { 1, 0, 1, 0, 0 },      /* EZ_OP_ADD      s + d             */
+    { 1,-1, 1,-1, 1 },      /* EZ_OP_MULTIPLY s*d + s*(1-ad) + d*(1-as) */
+    { 1, 0, 1, 0,-1 }       /* EZ_OP_SCREEN   s + d - s*d       */
+};
+
+
+/*
+ * Choose the fastest row compositing function which gives the same result as
+ * the default one for all the operators; the candidates are tried in order.
+*/
+
+ez_comp_func ez_comp_get_func (void)
+{
+    static ez_comp_func comp_func = NULL;
+    ez_comp_func cand[2];
+    int n = 0, i, op, nb = 65536+7, ok;
+    Ez_uint8 *src, *dst0, *dst1, *dst2;
+    Ez_uint32 r = 1;
+
+    if (comp_func != NULL) return comp_func;
+    comp_func = ez_comp_row_default;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2) cand[n++] = ez_comp_row_avx2;
+        if (cpu & EZ_CPU_SSE2) cand[n++] = ez_comp_row_sse2;
+    }
+#endif /* EZ_SIMD_X86 */
+    if (n == 0) return comp_func;
+
+    src = malloc (nb*4*4);
+    if (src == NULL) return comp_func;
+    dst0 = src + nb*4; dst1 = dst0 + nb*4; dst2 = dst1 + nb*4;
+
+    for (i = 0; i < nb*4; i++) {
+        r = r * 1103515245 + 12345;
+        src[i] = r >> 16; dst0[i] = r >> 24;
+    }
+    for (i = 0; i < nb; i++) {
+        src [i*4+3] = i & 255;
+        dst0[i*4+3] = i >> 8 & 255;
+    }
+
+    for (i = 0; i < n; i++) {
+        for (op = 0, ok = 1; op < EZ_OP_LAST && ok; op++) {
+            memcpy (dst1, dst0, nb*4);
+            ez_comp_row_default (dst1, src, nb, op);
+            memcpy (dst2, dst0, nb*4);
+            cand[i] (dst2, src, nb, op);
+            ok = memcmp (dst1, dst2, nb*4) == 0;
+        }
+        if (ok) { comp_func = cand[i]; break; }
+        if (ez_image_debug())
+            printf ("ez_comp_get_func  candidate %d rejected\n", i);
+    }
+
+    free (src);
+    return comp_func;
+}
+
+
+void ez_comp_row_default (Ez_uint8 *dst, const Ez_uint8 *src, int w, int op)
+{
+    const signed char *f = ez_comp_coefs[op];
+    int i, k, fa, fb, c;
+
+    for (i = 0; i < w*4; i += 4) {
+        fa = f[0]*255 + f[1]*dst[i+3];
+        fb = f[2]*255 + f[3]*src[i+3];
+        for (k = 0; k < 4; k++) {
+            c = EZ_DIV255 (src[i+k] * fa) + EZ_DIV255 (dst[i+k] * fb)
+                + f[4] * EZ_DIV255 (src[i+k] * dst[i+k]);
+            dst[i+k] = c < 0 ? 0 : c > 255 ? 255 : c;
+        }
+    }
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * Vectorized compositing functions, in 16 bit lanes: the products are at
+ * most 255*255, and the sums of 3 terms fit in signed 16 bit.
+*/
+
+EZ_TARGET ("sse2")
+void ez_comp_row_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int op)
+{
+    const signed char *f = ez_comp_coefs[op];
+    __m128i zero = _mm_setzero_si128 (), k128 = _mm_set1_epi16 (128),
+            a0 = _mm_set1_epi16 (f[0]*255), sa = _mm_set1_epi16 (f[1]),
+            b0 = _mm_set1_epi16 (f[2]*255), sb = _mm_set1_epi16 (f[3]),
+            kk = _mm_set1_epi16 (f[4]), ps, pd, s, d, fa, fb, t, c[2];
+    int x, k;
+
+#define EZ_DIV255_EPI16(x) \
+    (t = _mm_add_epi16 ((x), k128), \
+     _mm_srli_epi16 (_mm_add_epi16 (t, _mm_srli_epi16 (t, 8)), 8))
+
+    for (x = 0; x+4 <= w; x += 4) {
+        ps = _mm_loadu_si128 ((__m128i *) (src + x*4));
+        pd = _mm_loadu_si128 ((__m128i *) (dst + x*4));
+        for (k = 0; k < 2; k++) {
+            s = k ? _mm_unpackhi_epi8 (ps, zero) : _mm_unpacklo_epi8 (ps, zero);
+            d = k ? _mm_unpackhi_epi8 (pd, zero) : _mm_unpacklo_epi8 (pd, zero);
+            /* Alphas repeated on the 4 channels of each pixel */
+            fa = _mm_add_epi16 (a0, _mm_mullo_epi16 (sa,
+                     _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (d, 0xFF), 0xFF)));
+            fb = _mm_add_epi16 (b0, _mm_mullo_epi16 (sb,
+                     _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (s, 0xFF), 0xFF)));
+            c[k] = EZ_DIV255_EPI16 (_mm_mullo_epi16 (s, fa));
+            c[k] = _mm_add_epi16 (c[k], EZ_DIV255_EPI16 (_mm_mullo_epi16 (d, fb)));
+            c[k] = _mm_add_epi16 (c[k], _mm_mullo_epi16 (kk,
+                       EZ_DIV255_EPI16 (_mm_mullo_epi16 (s, d))));
+        }
+        _mm_storeu_si128 ((__m128i *) (dst + x*4), _mm_packus_epi16 (c[0], c[1]));
+    }
+    ez_comp_row_default (dst + x*4, src + x*4, w - x, op);
+
+#undef EZ_DIV255_EPI16
+}
+
+
+EZ_TARGET ("avx2")
+void ez_comp_row_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int op)
+{
+    const signed char *f = ez_comp_coefs[op];
+    __m256i zero = _mm256_setzero_si256 (), k128 = _mm256_set1_epi16 (128),
+            a0 = _mm256_set1_epi16 (f[0]*255), sa = _mm256_set1_epi16 (f[1]),
+            b0 = _mm256_set1_epi16 (f[2]*255), sb = _mm256_set1_epi16 (f[3]),
+            kk = _mm256_set1_epi16 (f[4]), ps, pd, s, d, fa, fb, t, c[2];
+    int x, k;
+
+#define EZ_DIV255_EPI16(x) \
+    (t = _mm256_add_epi16 ((x), k128), \
+     _mm256_srli_epi16 (_mm256_add_epi16 (t, _mm256_srli_epi16 (t, 8)), 8))
+
+    for (x = 0; x+8 <= w; x += 8) {
+        ps = _mm256_loadu_si256 ((__m256i *) (src + x*4));
+        pd = _mm256_loadu_si256 ((__m256i *) (dst + x*4));
+        for (k = 0; k < 2; k++) {
+            s = k ? _mm256_unpackhi_epi8 (ps, zero) : _mm256_unpacklo_epi8 (ps, zero);
+            d = k ? _mm256_unpackhi_epi8 (pd, zero) : _mm256_unpacklo_epi8 (pd, zero);
+            fa = _mm256_add_epi16 (a0, _mm256_mullo_epi16 (sa,
+                     _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (d, 0xFF), 0xFF)));
+            fb = _mm256_add_epi16 (b0, _mm256_mullo_epi16 (sb,
+                     _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (s, 0xFF), 0xFF)));
+            c[k] = EZ_DIV255_EPI16 (_mm256_mullo_epi16 (s, fa));
+            c[k] = _mm256_add_epi16 (c[k], EZ_DIV255_EPI16 (_mm256_mullo_epi16 (d, fb)));
+            c[k] = _mm256_add_epi16 (c[k], _mm256_mullo_epi16 (kk,
+                       EZ_DIV255_EPI16 (_mm256_mullo_epi16 (s, d))));
+        }
+        _mm256_storeu_si256 ((__m256i *) (dst + x*4),
+            _mm256_packus_epi16 (c[0], c[1]));
+    }
+    ez_comp_row_default (dst + x*4, src + x*4, w - x, op);
+
+#undef EZ_DIV255_EPI16
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
+/*
+ * Extract a rectangular region from an image
+*/
+
+void ez_image_copy_sub (Ez_image *src, Ez_image *dest , int src_x, int src_y)
+{
+    int tw4  = dest->width*4,
+        sw4  = src ->width*4,
+        sxy4 = (src_y*src->width + src_x)*4,
+        y, ty, sy;
+
+    for (y = ty = 0, sy = sxy4; y < dest->height; y++, ty += tw4, sy += sw4)
+        memcpy (dest->pixels_rgba + ty, src ->pixels_rgba + sy, tw4);
+}
+
+
+/*
+ * Transformations
+*/
+
+void ez_image_comp_symv (Ez_image *src, Ez_image *dst)
+{
+    Ez_band b;
+
+    ez_band_init (&b, ez_band_symv, dst, src, 0, 0, 0, 0, dst->width, dst->height);
+    ez_parallel_rows (&b, dst->height, dst->width);
+}
+
+
+void ez_image_comp_symh (Ez_image *src, Ez_image *dst)
+{
+    Ez_band b;
+
+    ez_band_init (&b, ez_band_symh, dst, src, 0, 0, 0, 0, dst->width, dst->height);
+    ez_parallel_rows (&b, dst->height, dst->width);
+}
+
+
+void ez_band_symv (Ez_band *b, int y0, int y1)
+{
+    int x, y, ts, td, tw = b->w;
+    Ez_uint32 *src_p = (Ez_uint32 *)b->src->pixels_rgba,
+              *dst_p = (Ez_uint32 *)b->dst->pixels_rgba;
+
+    for (y = y0, td = y0*tw ; y < y1  ; y++)
+    for (x = 0, ts = td+tw-1; x < tw; x++, td++, ts--)
+        dst_p[td] = src_p[ts];
+}
+
+
+void ez_band_symh (Ez_band *b, int y0, int y1)
+{
+    int y, tw4 = b->w*4;
+
+    for (y = y0; y < y1; y++)
+        memcpy (b->dst->pixels_rgba + y*tw4,
+                b->src->pixels_rgba + (b->h-1-y)*tw4, tw4);
+}
+
+
+/*
+ * Resampling filters: support radius and value at x.
+*/
+
+double ez_filter_support (int filter)
+{
+    switch (filter) {
+        case EZ_FILTER_BOX      : return 0.5;
+        case EZ_FILTER_BICUBIC  : return 2;
+        case EZ_FILTER_LANCZOS3 : return 3;
+        default                 : return 1;
+    }
+}
+
+
+double ez_filter_eval (int filter, double x)
+{
+    double a = -0.5, t;
+
+    if (x < 0) x = -x;
+    switch (filter) {
+        case EZ_FILTER_BOX :
+            return x <= 0.5 ? 1 : 0;
+        case EZ_FILTER_BICUBIC :        /* Keys cubic, a = -0.5 */
+            if (x < 1) return ((a+2)*x - (a+3))*x*x + 1;
+            if (x < 2) return ((a*x - 5*a)*x + 8*a)*x - 4*a;
+            return 0;
+        case EZ_FILTER_LANCZOS3 :
+            if (x < 1E-8) return 1;
+            if (x >= 3) return 0;
+            t = M_PI*x;
+            return 3 * sin (t) * sin (t/3) / (t*t);
+        default :
+            return x < 1 ? 1-x : 0;
+    }
+}
+
+
+/*
+ * Compute the weights to resample src_n pixels into dst_n along one axis.
+ * When shrinking, the filter is stretched so as to average all the source
+ * pixels; the taps outside the source are dropped and the weights normalized.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_resize_weights_init (Ez_resize_weights *rw, int src_n, int dst_n, int filter)
+{
+    double scale = (double) src_n / dst_n, fs = scale > 1 ? scale : 1,
+           support = ez_filter_support (filter) * fs, center, sum, *w;
+    int i, j, x0, x1, n, acc;
+
+    rw->n = n = (int) ceil (support) * 2 + 1;
+    rw->fits16 = 1;
+    rw->start   = malloc (dst_n * sizeof(int));
+    rw->count   = malloc (dst_n * sizeof(int));
+    rw->weights = malloc (dst_n * n * sizeof(int));
+    w = malloc (n * sizeof(double));
+    if (rw->start == NULL || rw->count == NULL || rw->weights == NULL || w == NULL) {
+        ez_error ("ez_resize_weights_init: out of memory\n");
+        free (w);
+        ez_resize_weights_free (rw);
+        return -1;
+    }
+
+    for (i = 0; i < dst_n; i++)
+    {
+        /* Center of the pixel i in the source */
+        center = (i + 0.5) * scale;
+
+        if (filter == EZ_FILTER_NEAREST) {
+            x0 = (int) center; if (x0 > src_n-1) x0 = src_n-1;
+            rw->start[i] = x0; rw->count[i] = 1;
+            rw->weights[i*n] = 1 << EZ_RESIZE_BITS;
+            continue;
+        }
+
+        x0 = (int) floor (center - support + 0.5); if (x0 < 0) x0 = 0;
+        x1 = (int) floor (center + support + 0.5); if (x1 > src_n) x1 = src_n;
+        if (x1 - x0 > n) x1 = x0 + n;
+
+        for (sum = 0, j = x0; j < x1; j++) {
+            w[j-x0] = ez_filter_eval (filter, (j + 0.5 - center) / fs);
+            sum += w[j-x0];
+        }
+        /* No tap, for a box on a pixel border: take the nearest pixel */
+        if (sum == 0) {
+            x0 = (int) center; if (x0 > src_n-1) x0 = src_n-1;
+            x1 = x0+1; w[0] = sum = 1;
+        }
+
+        /* Fixed-point weights whose sum is exactly 1, the rest on the max */
+        rw->start[i] = x0; rw->count[i] = x1 - x0;
+        for (acc = 0, j = 0; j < x1-x0; j++) {
+            rw->weights[i*n+j] = (int) floor (w[j] / sum * (1 << EZ_RESIZE_BITS) + 0.5);
+            acc += rw->weights[i*n+j];
+        }
+        for (x1 = 0, j = 1; j < rw->count[i]; j++)
+            if (rw->weights[i*n+j] > rw->weights[i*n+x1]) x1 = j;
+        rw->weights[i*n+x1] += (1 << EZ_RESIZE_BITS) - acc;
+
+        for (j = 0; j < rw->count[i]; j++)
+            if (rw->weights[i*n+j] < -32768 || rw->weights[i*n+j] > 32767)
+                rw->fits16 = 0;
+    }
+
+    free (w);
+    return 0;
+}
+
+
+void ez_resize_weights_free (Ez_resize_weights *rw)
+{
+    free (rw->start);   rw->start   = NULL;
+    free (rw->count);   rw->count   = NULL;
+    free (rw->weights); rw->weights = NULL;
+}
+
+
+/*
+ * Resize img to w,h, ignoring its mipmap.
+ * Return new image, else NULL.
+*/
+
+Ez_image *ez_image_resize_to (Ez_image *img, int w, int h, int filter)
+{
+    Ez_image *res;
+
+    res = ez_image_create (w, h);
+    if (res == NULL) return NULL;
+    res->has_alpha = img->has_alpha;
+    res->opacity   = img->opacity;
+    res->premul    = img->premul;
+
+    if (ez_image_resample (img, res, filter) < 0) {
+        ez_image_destroy (res);
+        return NULL;
+    }
+    return res;
+}
+
+
+
+/*
+ * Free the mipmap pyramid of img.
+*/
+
+void ez_mip_free (Ez_image *img)
+{
+    if (img == NULL || img->mip == NULL) return;
+    ez_image_invalidate (img);
+    free (img->mip);
+    img->mip = NULL;
+}
+
+
+/*
+ * Get the level k of the mipmap of img, building the missing levels.
+ * Return the level, else NULL if img can't be reduced that much.
+*/
+
+Ez_image *ez_mip_level (Ez_image *img, int k)
+{
+    Ez_mipmap *mip = img->mip;
+    Ez_image *prev, *lev;
+
+    if (k == 0) return img;
+    if (k >= EZ_MIP_LEVELS) return NULL;
+
+    while (mip->nb < k) {
+        prev = mip->nb == 0 ? img : mip->level[mip->nb];
+        if (prev->width == 1 && prev->height == 1) return NULL;
+        lev = ez_image_resize_to (prev, prev->width  > 1 ? prev->width/2  : 1,
+                                        prev->height > 1 ? prev->height/2 : 1,
+                                  EZ_FILTER_BOX);
+        if (lev == NULL) return NULL;
+        mip->level[++mip->nb] = lev;
+        if (ez_image_debug ())
+            printf ("ez_mip_level  level %d  w = %d  h = %d\n",
+                mip->nb, lev->width, lev->height);
+    }
+    return mip->level[k];
+}
+
+
+/*
+ * Resize img to w,h smaller than img, from its mipmap. The level used is the
+ * last one at least as large as w,h, so that the filter has few taps; in
+ * trilinear mode, the result is blended with the resizing of the next level,
+ * by the fraction of octave between the level and w,h.
+ * Return new image, else NULL.
+*/
+
+Ez_image *ez_mip_resize (Ez_image *img, int w, int h, int filter)
+{
+    Ez_mipmap *mip = img->mip;
+    Ez_image *lev = img, *next, *res, *tmp;
+    int k = 0, t;
+    double r;
+
+    while (lev->width/2 >= w && lev->height/2 >= h &&
+           (next = ez_mip_level (img, k+1)) != NULL) {
+        lev = next; k++;
+    }
+
+    res = ez_image_resize_to (lev, w, h, filter);
+    if (res == NULL) return NULL;
+    res->opacity = img->opacity;
+    if (mip->mode != EZ_MIPMAP_TRILINEAR) return res;
+
+    next = ez_mip_level (img, k+1);
+    if (next == NULL) return res;
+
+    r = (double) lev->width / w;
+    if ((double) lev->height / h < r) r = (double) lev->height / h;
+    t = EZ_ROUND (log (r) / log (2) * 256);
+    if (t <= 0) return res;
+    if (t > 256) t = 256;
+
+    tmp = ez_image_resize_to (next, w, h, filter);
+    if (tmp != NULL) {
+        ez_image_lerp (res, tmp, t);
+        ez_image_destroy (tmp);
+    }
+    return res;
+}
+
+
+/*
+ * Blend src into dst of same size, with the weight t in 0..256 of src.
+ * The colors are premultiplied meanwhile; src is modified.
+*/
+
+void ez_image_lerp (Ez_image *dst, Ez_image *src, int t)
+{
+    int x, y, w = dst->width, conv = dst->has_alpha && !dst->premul;
+    Ez_uint32 *p, *q;
+
+    for (y = 0; y < dst->height; y++) {
+        p = (Ez_uint32 *) dst->pixels_rgba + y*w;
+        q = (Ez_uint32 *) src->pixels_rgba + y*w;
+        if (conv) {
+            ez_premul_row ((Ez_uint8 *) p, (Ez_uint8 *) p, w);
+            ez_premul_row ((Ez_uint8 *) q, (Ez_uint8 *) q, w);
+        }
+        for (x = 0; x < w; x++)
+            p[x] = EZ_LERP_PX (p[x], q[x], t);
+        if (conv) ez_unpremul_row ((Ez_uint8 *) p, (Ez_uint8 *) p, w);
     }
-
-    return xi_func;
 }
 
+/*
+ * Resample src into dst with a separable filter, one axis after the other.
+ * Horizontally first, the rows of src are resampled into a temporary image
+ * dst_w x src_h, whose columns are then resampled; vertically first, each row
+ * of dst is computed from a temporary row of src_w pixels. The cheapest order
+ * is chosen, knowing that the vertical pass, on contiguous rows, goes about 4
+ * times faster per tap. The colors are premultiplied by alpha meanwhile, so
+ * that the transparent pixels do not bleed.
+ * Return 0 on success, -1 on error.
+*/
 
-void ez_xi_fill_default (XImage *xi, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+int ez_image_resample (Ez_image *src, Ez_image *dst, int filter)
 {
-    int x, y, tx, ty, img_w = img->width;
-    Ez_uint8 cr, cg, cb;
-    double time1 = 0;
+    int src_w = src->width, src_h = src->height,
+        dst_w = dst->width, dst_h = dst->height, res = -1;
+    Ez_resample rs;
+    Ez_band b;
+    double cost_h, cost_v;
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    if (src_w <= 0 || src_h <= 0) return 0;
 
-    for (y = 0, ty = src_y * img_w; y < h; y++, ty += img_w)
-    for (x = 0, tx = (ty + src_x)*4; x < w; x++, tx += 4) {
-        cr = img->pixels_rgba[tx];
-        cg = img->pixels_rgba[tx+1];
-        cb = img->pixels_rgba[tx+2];
-        XPutPixel (xi, x, y, ez_get_RGB (cr, cg, cb));
+    memset (&rs, 0, sizeof(rs));
+    rs.premul = src->premul || src->has_alpha;
+    rs.conv = rs.premul && !src->premul;
+    if (ez_resize_weights_init (&rs.rw_x, src_w, dst_w, filter) < 0 ||
+        ez_resize_weights_init (&rs.rw_y, src_h, dst_h, filter) < 0) goto done;
+
+    /* Select the function before the threads */
+    ez_resample_get_func ();
+
+    cost_h = 4.0 * src_h * dst_w * rs.rw_x.n + 1.0 * dst_h * dst_w * rs.rw_y.n;
+    cost_v = 1.0 * dst_h * src_w * rs.rw_y.n + 4.0 * dst_h * dst_w * rs.rw_x.n;
+
+    ez_band_init (&b, NULL, dst, src, 0, 0, 0, 0, dst_w, dst_h);
+    b.data = &rs;
+
+    if (cost_h < cost_v) {
+        rs.tmp = malloc ((size_t) dst_w * src_h * 4);
+        if (rs.tmp == NULL) {
+            ez_error ("ez_image_resample: out of memory\n");
+            goto done;
+        }
+        b.func = ez_band_resample_h;
+        if (ez_parallel_rows (&b, src_h, dst_w * rs.rw_x.n) < 0) goto done;
+        b.func = ez_band_resample_v;
+        if (ez_parallel_rows (&b, dst_h, dst_w * rs.rw_y.n) < 0) goto done;
+    } else {
+        b.func = ez_band_resample_vh;
+        if (ez_parallel_rows (&b, dst_h,
+            src_w * rs.rw_y.n + dst_w * rs.rw_x.n) < 0) goto done;
     }
+    res = 0;
 
-    if (ez_image_debug())
-        printf ("ez_xi_fill_default %.3f ms\n", (ez_get_time() - time1)*1000);
+  done:
+    free (rs.tmp);
+    ez_resize_weights_free (&rs.rw_x);
+    ez_resize_weights_free (&rs.rw_y);
+    return res;
 }
 
 
-/* Speed gain compared to fill_default: 50% */
+/*
+ * Bands of ez_image_resample: horizontally the rows of src into tmp; then
+ * vertically tmp into the rows of dst; or both for each row of dst, through
+ * a temporary row. The negative lobes of the filters may overshoot alpha,
+ * so the rows of dst are bounded before being un-premultiplied.
+*/
 
-void ez_xi_fill_24 (XImage *xi, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+void ez_band_resample_h (Ez_band *b, int y0, int y1)
 {
-    int x, y, tx, ty, i, j, img_w = img->width,
-        dj = xi->bytes_per_line,
-        di = xi->bits_per_pixel / 8,
-        ir = ezx.trueColor.red.shift   / 8,
-        ig = ezx.trueColor.green.shift / 8,
-        ib = ezx.trueColor.blue.shift  / 8;
-    Ez_uint8 *data = (Ez_uint8 *) xi->data;
-    double time1 = 0;
-
-    if (ez_image_debug()) time1 = ez_get_time ();
+    Ez_resample *rs = b->data;
+    int src_w = b->src->width, dst_w = b->dst->width, y;
+    Ez_uint8 *row = NULL;
 
-    for (y = 0, ty = src_y * img_w, j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += di) {
-        data[i+ir] = img->pixels_rgba[tx];
-        data[i+ig] = img->pixels_rgba[tx+1];
-        data[i+ib] = img->pixels_rgba[tx+2];
+    if (rs->conv && (row = malloc ((size_t) src_w * 4)) == NULL) {
+        ez_error ("ez_band_resample_h: out of memory\n");
+        b->failed = 1;
+        return;
     }
 
-    if (ez_image_debug())
-        printf ("ez_xi_fill_24 %.3f ms\n", (ez_get_time() - time1)*1000);
+    for (y = y0; y < y1; y++)
+        ez_resample_row_h (rs->tmp + (size_t) y * dst_w * 4,
+            b->src->pixels_rgba + (size_t) y * src_w * 4, dst_w, &rs->rw_x,
+            row, src_w);
+    free (row);
 }
 
 
-Ez_image *ez_xi_test_create (void)
+void ez_band_resample_v (Ez_band *b, int y0, int y1)
 {
-    int w = 9, h = 13, t, tmax = w*h*4;
-    Ez_image *img = ez_image_create (w, h);
-    if (img == NULL) return NULL;
+    Ez_resample *rs = b->data;
+    int dst_w = b->dst->width, y;
+    Ez_uint8 *p;
 
-    for (t = 0; t < tmax; t += 4) {
-        img->pixels_rgba[t  ] = t*11/256;
-        img->pixels_rgba[t+1] = t*31/256;
-        img->pixels_rgba[t+2] = t* 7/256;
+    for (y = y0; y < y1; y++) {
+        p = b->dst->pixels_rgba + (size_t) y * dst_w * 4;
+        ez_resample_row_v (p, rs->tmp, dst_w, &rs->rw_y, y, 0);
+        if (rs->premul) {
+            ez_resample_bound_row (p, dst_w);
+            if (!b->dst->premul) ez_unpremul_row (p, p, dst_w);
+        }
     }
-
-    return img;
 }
 
 
-int ez_xi_diff (XImage *xi1, XImage *xi2)
-{
-    int ntot, i;
-    if (xi1 == NULL || xi2 == NULL) return -1;
+/*
+ * To premultiply the source rows once, the rows of dst are processed by
+ * groups whose source rows, at most EZ_RESAMPLE_ROWS, are premultiplied in
+ * rows; the contiguous rows are then resampled by the vectorized functions.
+*/
 
-    ntot = xi1->bytes_per_line * xi1->height;
-    for (i = 0; i < ntot; i++)
-        if (xi1->data[i] != xi2->data[i]) return -1;
+#define EZ_RESAMPLE_ROWS(n) (2*(n) + 64)
+
+void ez_band_resample_vh (Ez_band *b, int y0, int y1)
+{
+    Ez_resample *rs = b->data;
+    Ez_resize_weights *rw = &rs->rw_y;
+    int src_w = b->src->width, dst_w = b->dst->width, y, y2, j,
+        first = 0, last, max = EZ_RESAMPLE_ROWS (rw->n);
+    Ez_uint8 *tmp, *rows = NULL, *src = b->src->pixels_rgba, *p;
+
+    tmp = malloc ((size_t) src_w * 4);
+    if (rs->conv) rows = malloc ((size_t) src_w * 4 * max);
+    if (tmp == NULL || (rs->conv && rows == NULL)) {
+        ez_error ("ez_band_resample_vh: out of memory\n");
+        b->failed = 1;
+        goto done;
+    }
+
+    for (y = y0; y < y1; y = y2) {
+        y2 = y1;
+        if (rs->conv) {
+            first = rw->start[y];
+            last = first + rw->count[y];
+            for (y2 = y+1; y2 < y1 && rw->start[y2] >= first &&
+                 rw->start[y2] + rw->count[y2] - first <= max; y2++)
+                if (last < rw->start[y2] + rw->count[y2])
+                    last = rw->start[y2] + rw->count[y2];
+            ez_premul_row (rows, src + (size_t) first * src_w * 4,
+                (last - first) * src_w);
+        }
 
-    return 0;
+        for (j = y; j < y2; j++) {
+            p = b->dst->pixels_rgba + (size_t) j * dst_w * 4;
+            ez_resample_row_v (tmp, rs->conv ? rows : src, src_w, rw, j, first);
+            ez_resample_row_h (p, tmp, dst_w, &rs->rw_x, NULL, src_w);
+            if (rs->premul) {
+                ez_resample_bound_row (p, dst_w);
+                if (!b->dst->premul) ez_unpremul_row (p, p, dst_w);
+            }
+        }
+    }
+
+  done:
+    free (tmp);
+    free (rows);
 }
 
+#undef EZ_RESAMPLE_ROWS
+
 
 /*
- * Create a cutting mask from alpha channel and opacity threshold
+ * Compute a row of dst_w pixels from a row of src_w pixels. If row is not
+ * NULL, the source row is premultiplied in row first.
 */
 
-Pixmap ez_xmask_create (Ez_window win, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+#define EZ_RESIZE_CLAMP(v) \
+    ((v) < 0 ? 0 : (v) >= 255 << EZ_RESIZE_BITS ? 255 : (v) >> EZ_RESIZE_BITS)
+
+void ez_resample_row_h (Ez_uint8 *dst, const Ez_uint8 *src, int dst_w,
+    Ez_resize_weights *rw, Ez_uint8 *row, int src_w)
 {
-    Pixmap mask = None;
-    Ez_uint8 *data = NULL;
-    int bytes_per_line = (w+7)/8;
-    double time1 = 0, time2 = 0, time3 = 0;
+    int i, k, r, g, b, a, n = rw->n, *w;
+    const Ez_uint8 *s;
 
-    data = calloc (bytes_per_line*h, 1);
-    if (data == NULL) {
-        ez_error ("ez_xmask_create: out of memory\n");
-        return None;
+    if (row != NULL) {
+        ez_premul_row (row, src, src_w);
+        src = row;
     }
 
-    if (ez_image_debug()) time1 = ez_get_time ();
-
-    ez_xmask_fill (data, img, src_x, src_y, w, h);
+    for (i = 0; i < dst_w; i++, dst += 4)
+    {
+        s = src + rw->start[i]*4;
+        w = rw->weights + i*n;
+        r = g = b = a = 1 << (EZ_RESIZE_BITS-1);
+        for (k = 0; k < rw->count[i]; k++, s += 4) {
+            r += s[0] * w[k]; g += s[1] * w[k];
+            b += s[2] * w[k]; a += s[3] * w[k];
+        }
+        dst[0] = EZ_RESIZE_CLAMP (r); dst[1] = EZ_RESIZE_CLAMP (g);
+        dst[2] = EZ_RESIZE_CLAMP (b); dst[3] = EZ_RESIZE_CLAMP (a);
+    }
+}
 
-    if (ez_image_debug()) time2 = ez_get_time ();
 
-    mask = XCreateBitmapFromData (ezx.display, win, (char*) data, w, h);
-    if (mask == None)
-        ez_error ("ez_xmask_create: can't create bitmap");
+/*
+ * Compute the row y of dst from the rows of src, both w pixels wide; the
+ * first row of src is the row first of the source.
+*/
 
-    if (ez_image_debug()) {
-        time3 = ez_get_time ();
-        printf ("ez_xmask_create   fill %.3f ms   bitmap %.3f ms\n",
-            (time2-time1)*1000, (time3-time2)*1000);
-    }
+void ez_resample_row_v (Ez_uint8 *dst, const Ez_uint8 *src, int w,
+    Ez_resize_weights *rw, int y, int first)
+{
+    const Ez_uint8 *s = src + (size_t) (rw->start[y] - first) * w*4;
+    const int *wt = rw->weights + y*rw->n;
 
-    free (data);
-    return mask;
+    if (rw->fits16)
+         ez_resample_get_func () (dst, s, w*4, w*4, wt, rw->count[y]);
+    else ez_resample_col_default (dst, s, w*4, w*4, wt, rw->count[y]);
 }
 
 
-void ez_xmask_fill (Ez_uint8 *data, Ez_image *img,
-    int src_x, int src_y, int w, int h)
+/*
+ * Compute n bytes of dst as the sums of the count rows of src, separated by
+ * stride, with the weights w. The sums are made by blocks which stay in the
+ * cache; being local, they do not alias the rows.
+*/
+
+#define EZ_RESIZE_BLOCK 1024
+
+void ez_resample_col_default (Ez_uint8 *dst, const Ez_uint8 *src, int n,
+    int stride, const int *w, int count)
 {
+    int i, k, x0, x1, acc[EZ_RESIZE_BLOCK];
+    const Ez_uint8 *s;
+
+    for (x0 = 0; x0 < n; x0 = x1)
+    {
+        x1 = x0 + EZ_RESIZE_BLOCK < n ? x0 + EZ_RESIZE_BLOCK : n;
+        for (i = 0; i < x1-x0; i++)
+            acc[i] = 1 << (EZ_RESIZE_BITS-1);
 
-    int tx, mx, y, ty, i, j, bpl = (w+7)/8, img_w = img->width;
+        for (k = 0, s = src + x0; k < count; k++, s += stride)
+            for (i = 0; i < x1-x0; i++)
+                acc[i] += s[i] * w[k];
 
-    for (y = 0, ty = src_y * img_w ; y < h ; y++, ty += img_w)
-    for (tx = (ty+src_x)*4+3, mx = tx+w*4, i = y*bpl, j = 0 ; tx < mx ; tx += 4, j++) {
-        if (j == 8) { i++; j = 0; }
-        if (img->pixels_rgba[tx] < img->opacity) continue;
-        data[i] |= 1 << j;
+        for (i = 0; i < x1-x0; i++)
+            dst[x0+i] = EZ_RESIZE_CLAMP (acc[i]);
     }
 }
 
-#elif defined EZ_BASE_WIN32
+#undef EZ_RESIZE_BLOCK
+
 
 /*
- * Display a sub-image with transparency.
- * DIB = Device Independent Bitmap
+ * Choose the fastest column resampling function; they all give the same
+ * result, for weights holding in 16 bits.
 */
 
-void ez_image_draw_dib (HDC hdc_dst, Ez_image *img, int x, int y,
-    int src_x, int src_y, int w, int h)
+ez_resample_func ez_resample_get_func (void)
 {
-    HDC hdc = NULL;
-    HBITMAP hbitmap = NULL;
-    BITMAPINFO bmi;
-    Ez_uint8 *data;
+    static ez_resample_func resample_func = NULL;
 
-    /* Create a DC for the bitmap */
-    hdc = CreateCompatibleDC(hdc_dst);
-    if (hdc == NULL) {
-        ez_error ("ez_image_draw_dib: can't create compatible DC\n");
-        return;
+    if (resample_func != NULL) return resample_func;
+    resample_func = ez_resample_col_default;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2) resample_func = ez_resample_col_avx2;
+        else if (cpu & EZ_CPU_SSE2) resample_func = ez_resample_col_sse2;
     }
+#endif /* EZ_SIMD_X86 */
 
-    ZeroMemory(&bmi, sizeof(BITMAPINFO));
-    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmi.bmiHeader.biWidth = w;
-    bmi.bmiHeader.biHeight = -h;  /* negative height for Origin at top left */
-    bmi.bmiHeader.biPlanes = 1;
-    bmi.bmiHeader.biBitCount = 32;
-    bmi.bmiHeader.biCompression = BI_RGB;
-    bmi.bmiHeader.biSizeImage = w * h * 4;
+    return resample_func;
+}
 
-    hbitmap = CreateDIBSection (hdc_dst, &bmi, DIB_RGB_COLORS, (void **) &data, NULL, 0);
-    if (hbitmap == NULL) {
-        ez_error ("ez_image_draw_dib: can't create DIB Section\n");
-        goto final;
-    }
-    SelectObject (hdc, hbitmap);
 
-    if (!img->has_alpha)
-         ez_dib_fill_noalpha   (data, img, src_x, src_y, w, h);
-    else if (img->opacity >= 0)
-         ez_dib_fill_opacity   (data, img, src_x, src_y, w, h);
-    else ez_dib_fill_truealpha (data, img, src_x, src_y, w, h);
+#ifdef EZ_SIMD_X86
 
-    if (img->has_alpha) {
-        BLENDFUNCTION bf;
+/*
+ * The bytes of 2 rows are interleaved in 16-bit lanes, then multiplied by
+ * their 2 weights and summed at once by madd, in 32-bit lanes.
+*/
 
-        bf.BlendOp = AC_SRC_OVER;
-        bf.BlendFlags = 0;
-        bf.AlphaFormat = AC_SRC_ALPHA;  /* alpha channel premultiplied */
-        bf.SourceConstantAlpha = 0xff;
+#define EZ_RESIZE_WEIGHTS_2(w0,w1) \
+    ((int) ((Ez_uint32) (w1) << 16 | ((Ez_uint32) (w0) & 0xffff)))
 
-        if (AlphaBlend (hdc_dst, x, y, w, h, hdc, 0, 0, w, h, bf) == FALSE)
-            ez_error ("ez_image_draw_dib: AlphaBlend failed\n");
-    } else {
-        if (BitBlt (hdc_dst, x, y, w, h, hdc, 0, 0, SRCCOPY ) == 0)
-            ez_error ("ez_image_draw_dib: bitblt failed\n");
-    }
+EZ_TARGET ("sse2")
+void ez_resample_col_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int n,
+    int stride, const int *w, int count)
+{
+    __m128i z = _mm_setzero_si128 (), a[4], p, q, lo, hi, wk;
+    const Ez_uint8 *s;
+    int x, k, i;
 
-  final:
-    if (hbitmap != NULL) DeleteObject (hbitmap);
-    if (hdc != NULL) DeleteDC (hdc);
+    for (x = 0; x+16 <= n; x += 16)
+    {
+        for (i = 0; i < 4; i++)
+            a[i] = _mm_set1_epi32 (1 << (EZ_RESIZE_BITS-1));
+
+        for (k = 0, s = src + x; k < count; k += 2, s += 2*stride) {
+            p = _mm_loadu_si128 ((const __m128i *) s);
+            if (k+1 < count) {
+                q  = _mm_loadu_si128 ((const __m128i *) (s + stride));
+                wk = _mm_set1_epi32 (EZ_RESIZE_WEIGHTS_2 (w[k], w[k+1]));
+            } else {
+                q  = z;
+                wk = _mm_set1_epi32 (EZ_RESIZE_WEIGHTS_2 (w[k], 0));
+            }
+            lo = _mm_unpacklo_epi8 (p, z); hi = _mm_unpackhi_epi8 (p, z);
+            p  = _mm_unpacklo_epi8 (q, z); q  = _mm_unpackhi_epi8 (q, z);
+            a[0] = _mm_add_epi32 (a[0], _mm_madd_epi16 (_mm_unpacklo_epi16 (lo, p), wk));
+            a[1] = _mm_add_epi32 (a[1], _mm_madd_epi16 (_mm_unpackhi_epi16 (lo, p), wk));
+            a[2] = _mm_add_epi32 (a[2], _mm_madd_epi16 (_mm_unpacklo_epi16 (hi, q), wk));
+            a[3] = _mm_add_epi32 (a[3], _mm_madd_epi16 (_mm_unpackhi_epi16 (hi, q), wk));
+        }
+
+        /* Shift, then saturate as EZ_RESIZE_CLAMP */
+        for (i = 0; i < 4; i++)
+            a[i] = _mm_srai_epi32 (a[i], EZ_RESIZE_BITS);
+        _mm_storeu_si128 ((__m128i *) (dst + x), _mm_packus_epi16 (
+            _mm_packs_epi32 (a[0], a[1]), _mm_packs_epi32 (a[2], a[3])));
+    }
+    if (x < n)
+        ez_resample_col_default (dst + x, src + x, n - x, stride, w, count);
 }
 
 
-void ez_dib_fill_noalpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+/* Same with 2 lanes of 16 bytes, which unpack and pack back in place */
+
+EZ_TARGET ("avx2")
+void ez_resample_col_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int n,
+    int stride, const int *w, int count)
 {
-    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4;
-    double time1 = 0;
+    __m256i z = _mm256_setzero_si256 (), a[4], p, q, lo, hi, wk;
+    const Ez_uint8 *s;
+    int x, k, i;
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    for (x = 0; x+32 <= n; x += 32)
+    {
+        for (i = 0; i < 4; i++)
+            a[i] = _mm256_set1_epi32 (1 << (EZ_RESIZE_BITS-1));
+
+        for (k = 0, s = src + x; k < count; k += 2, s += 2*stride) {
+            p = _mm256_loadu_si256 ((const __m256i *) s);
+            if (k+1 < count) {
+                q  = _mm256_loadu_si256 ((const __m256i *) (s + stride));
+                wk = _mm256_set1_epi32 (EZ_RESIZE_WEIGHTS_2 (w[k], w[k+1]));
+            } else {
+                q  = z;
+                wk = _mm256_set1_epi32 (EZ_RESIZE_WEIGHTS_2 (w[k], 0));
+            }
+            lo = _mm256_unpacklo_epi8 (p, z); hi = _mm256_unpackhi_epi8 (p, z);
+            p  = _mm256_unpacklo_epi8 (q, z); q  = _mm256_unpackhi_epi8 (q, z);
+            a[0] = _mm256_add_epi32 (a[0], _mm256_madd_epi16 (_mm256_unpacklo_epi16 (lo, p), wk));
+            a[1] = _mm256_add_epi32 (a[1], _mm256_madd_epi16 (_mm256_unpackhi_epi16 (lo, p), wk));
+            a[2] = _mm256_add_epi32 (a[2], _mm256_madd_epi16 (_mm256_unpacklo_epi16 (hi, q), wk));
+            a[3] = _mm256_add_epi32 (a[3], _mm256_madd_epi16 (_mm256_unpackhi_epi16 (hi, q), wk));
+        }
 
-    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
-        data[i+3] = 0xff;
-        data[i+2] = img->pixels_rgba[tx];
-        data[i+1] = img->pixels_rgba[tx+1];
-        data[i  ] = img->pixels_rgba[tx+2];
+        for (i = 0; i < 4; i++)
+            a[i] = _mm256_srai_epi32 (a[i], EZ_RESIZE_BITS);
+        _mm256_storeu_si256 ((__m256i *) (dst + x), _mm256_packus_epi16 (
+            _mm256_packs_epi32 (a[0], a[1]), _mm256_packs_epi32 (a[2], a[3])));
     }
-
-    if (ez_image_debug())
-        printf ("ez_dib_fill_noalpha %.3f ms\n", (ez_get_time() - time1)*1000);
+    if (x < n)
+        ez_resample_col_sse2 (dst + x, src + x, n - x, stride, w, count);
 }
 
+#undef EZ_RESIZE_WEIGHTS_2
 
-void ez_dib_fill_opacity (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
-    int w, int h)
-{
-    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4;
-    double time1 = 0;
+#endif /* EZ_SIMD_X86 */
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+#undef EZ_RESIZE_CLAMP
 
-    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
-        if (img->pixels_rgba[tx+3] >= img->opacity) {
-            data[i+3] = 0xff;
-            data[i+2] = img->pixels_rgba[tx];
-            data[i+1] = img->pixels_rgba[tx+1];
-            data[i  ] = img->pixels_rgba[tx+2];
-        } else {
-            data[i+3] = 0;
-            data[i+2] = 0;
-            data[i+1] = 0;
-            data[i  ] = 0;
-        }
+
+/*
+ * Bound the premultiplied colors of a row by their alpha.
+*/
+
+void ez_resample_bound_row (Ez_uint8 *p, int w)
+{
+    int i;
+
+    for (i = 0; i < w*4; i += 4) {
+        if (p[i  ] > p[i+3]) p[i  ] = p[i+3];
+        if (p[i+1] > p[i+3]) p[i+1] = p[i+3];
+        if (p[i+2] > p[i+3]) p[i+2] = p[i+3];
     }
+}
 
-    if (ez_image_debug())
-        printf ("ez_dib_fill_opacity %.3f ms\n", (ez_get_time() - time1)*1000);
+
+void ez_rotate_get_size (double theta, int src_w, int src_h, int *dst_w, int *dst_h)
+{
+    double a = theta*M_PI/180, c = cos(a), s = sin(a),
+           w1 = fabs (c*src_w - s*src_h), h1 = fabs (s*src_w + c*src_h),
+           w2 = fabs (c*src_w + s*src_h), h2 = fabs (s*src_w - c*src_h);
+    *dst_w = EZ_ROUND (w1 > w2 ? w1 : w2);
+    *dst_h = EZ_ROUND (h1 > h2 ? h1 : h2);
 }
 
 
-void ez_dib_fill_truealpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+void ez_rotate_get_coords (double theta, int src_w, int src_h, int src_x, int src_y,
+    int *dst_x, int *dst_y)
 {
-    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4, a;
-    double time1 = 0;
+    double a = theta*M_PI/180, c = cos(a), s = sin(a);
+    double sx[4], sy[4], tx[4], ty[4], minx, miny;
+    int i;
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    /* Corners coordinates relative to the rotation center src */
+    sx[0] = 0     - src_x; sy[0] = 0     - src_y;
+    sx[1] = src_w - src_x; sy[1] = 0     - src_y;
+    sx[2] = src_w - src_x; sy[2] = src_h - src_y;
+    sx[3] = 0     - src_x; sy[3] = src_h - src_y;
 
-    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
-        data[i+3] = a = img->pixels_rgba[tx+3];
-        data[i+2] = img->pixels_rgba[tx  ]*a/255;
-        data[i+1] = img->pixels_rgba[tx+1]*a/255;
-        data[i  ] = img->pixels_rgba[tx+2]*a/255;
+    /* Corners rotation */
+    for (i = 0; i < 4; i++) {
+        tx[i] = c*sx[i] - s*sy[i];
+        ty[i] = s*sx[i] + c*sy[i];
+    }
+
+    /* Research of min */
+    minx = tx[0];
+    miny = ty[0];
+    for (i = 1; i < 4; i++) {
+        if (tx[i] < minx) minx = tx[i];
+        if (ty[i] < miny) miny = ty[i];
     }
 
-    if (ez_image_debug())
-        printf ("ez_dib_fill_truealpha %.3f ms\n", (ez_get_time() - time1)*1000);
+    *dst_x = EZ_ROUND (-minx);
+    *dst_y = EZ_ROUND (-miny);
 }
 
-#endif /* EZ_BASE_ */
-
 
 /*
- * Print a rectangular region of the image img in the terminal.
+ * Get the entry of spr for the angle theta rounded to a multiple of
+ * 360/steps, building its image if needed.
+ * Return the entry, else NULL.
 */
 
-void ez_image_print_rgba (Ez_image *img, int src_x, int src_y, int w, int h)
+Ez_sprite_entry *ez_sprite_get_entry (Ez_sprite *spr, double theta)
 {
-    int x, y;
-    Ez_uint8 *p;
+    Ez_sprite_entry *e;
+    double step = 360.0 / spr->steps;
+    int k;
 
-    printf (" y,x ");
-    for (x = src_x; x < src_x+w; x++)
-        printf ("|      %4d      ", x);
-    printf ("\n");
+    k = EZ_ROUND (fmod (theta, 360) / step) % spr->steps;
+    if (k < 0) k += spr->steps;
+    e = &spr->entry[k];
+    e->stamp = ++spr->clock;
+    if (e->img != NULL) return e;
 
-    for (y = src_y; y < src_y+h; y++) {
-        printf ("%4d ", y);
-        for (x = src_x; x < src_x+w; x++) {
-            p = img->pixels_rgba + (y*img->width+x)*4;
-            printf ("| %3d %3d %3d %3d", p[0], p[1], p[2], p[3]);
-        }
-        printf ("\n");
+    if (spr->base == NULL) {
+        spr->base = spr->scale == 1 ? spr->img :
+                    ez_image_scale (spr->img, spr->scale);
+        if (spr->base == NULL) return NULL;
     }
+
+    e->img = ez_image_rotate (spr->base, k * step, spr->quality);
+    if (e->img == NULL) return NULL;
+    ez_rotate_get_coords (k * step, spr->base->width, spr->base->height,
+        spr->hot_x, spr->hot_y, &e->hot_x, &e->hot_y);
+    e->size = e->img->width * e->img->height * 4;
+    spr->size += e->size;
+
+    if (ez_image_debug ())
+        printf ("ez_sprite_get_entry  angle = %.2f  w = %d  h = %d  size = %d\n",
+            k * step, e->img->width, e->img->height, spr->size);
+
+    ez_sprite_evict (spr, e);
+    return e;
+}
+
+
+void ez_sprite_free_entry (Ez_sprite *spr, Ez_sprite_entry *e)
+{
+    if (e->img == NULL) return;
+    ez_pixmap_destroy (e->pix);
+    ez_image_destroy (e->img);
+    e->pix = NULL;
+    e->img = NULL;
+    spr->size -= e->size;
 }
 
 
 /*
- * Fill image with a RGBA color
+ * Free the least recently used entries of spr, but keep, until its size is
+ * within the bound.
 */
 
-void ez_image_comp_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b,
-    Ez_uint8 a)
+void ez_sprite_evict (Ez_sprite *spr, Ez_sprite_entry *keep)
 {
-    int t, tmax4 = img->width * img->height * 4;
+    int i, k;
 
-    for (t = 0; t < tmax4; t += 4) {
-        img->pixels_rgba[t  ] = r;
-        img->pixels_rgba[t+1] = g;
-        img->pixels_rgba[t+2] = b;
-        img->pixels_rgba[t+3] = a;
+    while (spr->size > spr->limit) {
+        k = -1;
+        for (i = 0; i < spr->steps; i++)
+            if (spr->entry[i].img != NULL && &spr->entry[i] != keep &&
+                (k < 0 || spr->entry[i].stamp < spr->entry[k].stamp))
+                k = i;
+        if (k < 0) return;
+        ez_sprite_free_entry (spr, &spr->entry[k]);
     }
 }
 
 
 /*
- * Superimpose src into dst, without transparency
+ * Add to atlas an empty page of size w x h.
+ * Return the page, else NULL.
 */
 
-void ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
-    int src_x, int src_y, int w, int h)
+Ez_atlas_page *ez_atlas_new_page (Ez_atlas *atlas, int w, int h)
 {
-    int x, y, t_src, t_dst;
+    Ez_atlas_page *pages, *page;
 
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        t_src = ((y+src_y)*src->width+x+src_x)*4;
-        t_dst = ((y+dst_y)*dst->width+x+dst_x)*4;
+    pages = realloc (atlas->pages, (atlas->nb_pages+1) * sizeof(Ez_atlas_page));
+    if (pages == NULL) goto out_of_memory;
+    atlas->pages = pages;
+    page = &pages[atlas->nb_pages];
 
-        dst->pixels_rgba[t_dst  ] = src->pixels_rgba[t_src  ];
-        dst->pixels_rgba[t_dst+1] = src->pixels_rgba[t_src+1];
-        dst->pixels_rgba[t_dst+2] = src->pixels_rgba[t_src+2];
-        dst->pixels_rgba[t_dst+3] = src->pixels_rgba[t_src+3];
+    /* Each segment is at least 1 pixel wide */
+    page->seg = malloc (w * sizeof(Ez_skyline_seg));
+    if (page->seg == NULL) goto out_of_memory;
+    page->img = ez_image_create (w, h);
+    if (page->img == NULL) {
+        free (page->seg);
+        return NULL;
     }
+    page->pix = NULL;
+    page->seg[0].x = 0; page->seg[0].y = 0; page->seg[0].w = w;
+    page->nb_seg = 1;
+
+    atlas->nb_pages++;
+    return page;
+
+  out_of_memory:
+    ez_error ("ez_atlas_new_page: out of memory\n");
+    return NULL;
 }
 
 
 /*
- * Superimpose src into dst, with transparency
+ * Search in page the lowest place for an area w x h, the leftmost in case of
+ * tie, lying on the skyline.
+ * Return 0 and store the place in best_x,best_y, else -1 if there is no room.
 */
 
-void ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
-    int src_x, int src_y, int w, int h)
+int ez_skyline_find (Ez_atlas_page *page, int w, int h, int *best_x, int *best_y)
 {
-    int x, y, t_src, t_dst, a_src, a_dst, a_res;
+    Ez_skyline_seg *seg = page->seg;
+    int i, j, y, left, found = -1;
 
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        t_src = ((y+src_y)*src->width+x+src_x)*4;
-        t_dst = ((y+dst_y)*dst->width+x+dst_x)*4;
-
-        a_src = src->pixels_rgba[t_src+3];
-        a_dst = dst->pixels_rgba[t_dst+3];
-        a_res = a_src + a_dst * (255-a_src) / 255;
+    for (i = 0; i < page->nb_seg; i++) {
+        if (seg[i].x + w > page->img->width) break;
 
-        if (a_res == 0) {
-            dst->pixels_rgba[t_dst  ] = 0;
-            dst->pixels_rgba[t_dst+1] = 0;
-            dst->pixels_rgba[t_dst+2] = 0;
-            dst->pixels_rgba[t_dst+3] = 0;
-            continue;
+        /* The area rests on the highest segment below it */
+        for (j = i, y = 0, left = w; left > 0; j++) {
+            if (seg[j].y > y) y = seg[j].y;
+            left -= seg[j].w;
         }
+        if (y + h > page->img->height) continue;
 
-        dst->pixels_rgba[t_dst  ] =
-            ( src->pixels_rgba[t_src  ] * a_src +
-              dst->pixels_rgba[t_dst  ] * a_dst * (255-a_src) / 255 ) / a_res;
-        dst->pixels_rgba[t_dst+1] =
-            ( src->pixels_rgba[t_src+1] * a_src +
-              dst->pixels_rgba[t_dst+1] * a_dst * (255-a_src) / 255 ) / a_res;
-        dst->pixels_rgba[t_dst+2] =
-            ( src->pixels_rgba[t_src+2] * a_src +
-              dst->pixels_rgba[t_dst+2] * a_dst * (255-a_src) / 255 ) / a_res;
-        dst->pixels_rgba[t_dst+3] = a_res;
+        if (found < 0 || y < *best_y) {
+            *best_x = seg[i].x; *best_y = y;
+            found = 0;
+        }
     }
+    return found;
 }
 
 
 /*
- * Extract a rectangular region from an image
+ * Raise the skyline of page over the area x,y,w,h found by ez_skyline_find.
 */
 
-void ez_image_copy_sub (Ez_image *src, Ez_image *dest , int src_x, int src_y)
+void ez_skyline_insert (Ez_atlas_page *page, int x, int y, int w, int h)
 {
-    int tw4  = dest->width*4,
-        sw4  = src ->width*4,
-        sxy4 = (src_y*src->width + src_x)*4,
-        y, ty, sy;
+    Ez_skyline_seg *seg = page->seg;
+    int i, j, d;
 
-    for (y = ty = 0, sy = sxy4; y < dest->height; y++, ty += tw4, sy += sw4)
-        memcpy (dest->pixels_rgba + ty, src ->pixels_rgba + sy, tw4);
+    for (i = 0; seg[i].x != x; i++);
+
+    /* Segments covered by the area are cut or removed */
+    for (j = i; j < page->nb_seg && seg[j].x < x+w; j++) {
+        d = x+w - seg[j].x;
+        if (d < seg[j].w) {
+            seg[j].x += d; seg[j].w -= d;
+            break;
+        }
+    }
+    memmove (seg+i+1, seg+j, (page->nb_seg-j) * sizeof(Ez_skyline_seg));
+    page->nb_seg -= j-i-1;
+    seg[i].x = x; seg[i].y = y+h; seg[i].w = w;
+
+    /* Merge the neighbours at same height */
+    for (i = 0, j = 1; j < page->nb_seg; j++)
+        if (seg[j].y == seg[i].y) seg[i].w += seg[j].w;
+        else seg[++i] = seg[j];
+    page->nb_seg = i+1;
 }
 
 
 /*
- * Transformations
+ * Copy img at x,y in page, not premultiplied, and mark its pixmap out of date.
 */
 
-void ez_image_comp_symv (Ez_image *src, Ez_image *dst)
+void ez_atlas_copy (Ez_atlas_page *page, Ez_image *img, int x, int y)
 {
-    int dst_h = dst->height, dst_w = dst->width,
-        x, y, ts, td, tw = dst_w;
-    Ez_uint32 *src_p = (Ez_uint32 *)src->pixels_rgba,
-              *dst_p = (Ez_uint32 *)dst->pixels_rgba;
+    Ez_uint8 *d;
+    int j, i;
 
-    for (y = 0, td = 0      ; y < dst_h; y++)
-    for (x = 0, ts = td+tw-1; x < dst_w; x++, td++, ts--)
-        dst_p[td] = src_p[ts];
+    for (j = 0; j < img->height; j++) {
+        d = page->img->pixels_rgba + ((y+j) * page->img->width + x) * 4;
+        if (img->premul)
+            ez_unpremul_row (d, img->pixels_rgba + j*img->width*4, img->width);
+        else memcpy (d, img->pixels_rgba + j*img->width*4, img->width*4);
+        if (!img->has_alpha)
+            for (i = 0; i < img->width; i++) d[i*4+3] = 255;
+    }
+
+    if (img->has_alpha && !page->img->has_alpha) {
+        page->img->has_alpha = 1;
+        page->img->opacity = img->opacity;
+    }
+    ez_pixmap_destroy (page->pix);
+    page->pix = NULL;
 }
 
 
-void ez_image_comp_symh (Ez_image *src, Ez_image *dst)
+int ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta)
 {
-    int dst_h = dst->height, dst_w = dst->width,
-        y, ts, td, tw4 = dst_w*4, tdm4 = (dst_h-1)*tw4;
+    double inv[6];
 
-    for (td = y = 0, ts = tdm4; y < dst_h; y++, td += tw4, ts -= tw4)
-        memcpy (dst->pixels_rgba + td, src->pixels_rgba + ts, tw4);
+    ez_rotate_get_matrix (src, theta, inv);
+    return ez_transform_inv (src, dst, inv, EZ_FILTER_NEAREST);
 }
 
 
-void ez_image_expand (Ez_image *src, Ez_image *dst, double factor)
+int ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta)
 {
-    int x, y, t;
+    double inv[6];
 
-    for (t = y = 0; y < dst->height; y++)
-    for (    x = 0; x < dst->width ; x++, t+=4)
-        ez_bilinear_4points (src->pixels_rgba, dst->pixels_rgba,
-            src->width, src->height, x/factor, y/factor, t);
+    ez_rotate_get_matrix (src, theta, inv);
+    return ez_transform_inv (src, dst, inv, EZ_FILTER_BILINEAR);
 }
 
 
-void ez_image_shrink (Ez_image *src, Ez_image *dst, double factor)
+/*
+ * Matrix inv mapping the points of dst to those of src rotated of theta
+ * degrees; the rotation center 0,0 of src is at dst_x,dst_y in dst.
+*/
+
+void ez_rotate_get_matrix (Ez_image *src, double theta, double inv[6])
 {
-    int x, y, t;
+    double a = theta*M_PI/180, c = cos(a), s = sin(a);
+    int dst_x, dst_y;
+
+    ez_rotate_get_coords (theta, src->width, src->height, 0, 0, &dst_x, &dst_y);
 
-    for (t = y = 0; y < dst->height; y++)
-    for (    x = 0; x < dst->width ; x++, t+=4)
-        ez_bilinear_pane (src->pixels_rgba, dst->pixels_rgba,
-            src->width, src->height, x/factor, y/factor, t, factor);
+    inv[0] =  c; inv[1] = s; inv[2] = -c*dst_x - s*dst_y;
+    inv[3] = -s; inv[4] = c; inv[5] =  s*dst_x - c*dst_y;
 }
 
 
-void ez_rotate_get_size (double theta, int src_w, int src_h, int *dst_w, int *dst_h)
-{
-    double a = theta*M_PI/180, c = cos(a), s = sin(a),
-           w1 = fabs (c*src_w - s*src_h), h1 = fabs (s*src_w + c*src_h),
-           w2 = fabs (c*src_w + s*src_h), h2 = fabs (s*src_w - c*src_h);
-    *dst_w = EZ_ROUND (w1 > w2 ? w1 : w2);
-    *dst_h = EZ_ROUND (h1 > h2 ? h1 : h2);
-}
+/*
+ * Transform src into dst by the matrix inv, mapping the points of dst to those
+ * of src. Each row of dst is clipped to the span whose antecedents are in src,
+ * then walked with 16.16 fixed-point increments.
+ * Return 0 on success, -1 on error.
+*/
 
+#define EZ_FIX16(x) ((Ez_int64) floor ((x) * 65536 + 0.5))
 
-void ez_rotate_get_coords (double theta, int src_w, int src_h, int src_x, int src_y,
-    int *dst_x, int *dst_y)
+int ez_transform_inv (Ez_image *src, Ez_image *dst, const double inv[6], int filter)
 {
-    double a = theta*M_PI/180, c = cos(a), s = sin(a);
-    double sx[4], sy[4], tx[4], ty[4], minx, miny;
-    int i;
-
-    /* Corners coordinates relative to the rotation center src */
-    sx[0] = 0     - src_x; sy[0] = 0     - src_y;
-    sx[1] = src_w - src_x; sy[1] = 0     - src_y;
-    sx[2] = src_w - src_x; sy[2] = src_h - src_y;
-    sx[3] = 0     - src_x; sy[3] = src_h - src_y;
+    double m[6];
+    Ez_band b;
 
-    /* Corners rotation */
-    for (i = 0; i < 4; i++) {
-        tx[i] = c*sx[i] - s*sy[i];
-        ty[i] = s*sx[i] + c*sy[i];
-    }
+    if (src->width <= 0 || src->height <= 0) return 0;
 
-    /* Research of min */
-    minx = tx[0];
-    miny = ty[0];
-    for (i = 1; i < 4; i++) {
-        if (tx[i] < minx) minx = tx[i];
-        if (ty[i] < miny) miny = ty[i];
+    /* The fixed-point coordinates must hold in an int */
+    if (src->width >= 32768 || src->height >= 32768 ||
+        fabs (inv[0]) >= 32768 || fabs (inv[3]) >= 32768) {
+        ez_error ("ez_transform_inv: image or scale too large\n");
+        return -1;
     }
 
-    *dst_x = EZ_ROUND (-minx);
-    *dst_y = EZ_ROUND (-miny);
+    memcpy (m, inv, sizeof(m));
+    ez_band_init (&b, ez_band_transform, dst, src, 0, 0, 0, 0, dst->width,
+        dst->height);
+    b.op = filter;
+    b.data = m;
+    return ez_parallel_rows (&b, dst->height, dst->width);
 }
 
 
-void ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta)
+void ez_band_transform (Ez_band *b, int y0, int y1)
 {
-    double a = theta*M_PI/180, c = cos(-a), s = sin(-a), sx, sy;
-    int x, y, t, dx, dy, xn, yn, dst_x, dst_y,
-        src_w = src->width, src_h = src->height,
-        dst_w = dst->width, dst_h = dst->height;
-    Ez_uint32 *src_p = (Ez_uint32 *)src->pixels_rgba,
-              *dst_p = (Ez_uint32 *)dst->pixels_rgba;
-
-    /* We set the rotation center to 0,0 and we retrieve the center
-       coordinates dst_x,dst_y in dst */
-    ez_rotate_get_coords (theta, src_w, src_h, 0, 0, &dst_x, &dst_y);
+    Ez_image *src = b->src, *dst = b->dst;
+    const double *inv = b->data;
+    int src_w = src->width, src_h = src->height, dst_w = dst->width,
+        y, x0, x1, du = EZ_FIX16 (inv[0]), dv = EZ_FIX16 (inv[3]);
+    Ez_int64 u0, v0,
+             lo   = -32768,       /* -0.5 */
+             hi_u = ((Ez_int64) src_w << 16) - 32768,
+             hi_v = ((Ez_int64) src_h << 16) - 32768;
+    Ez_uint32 *dst_p = (Ez_uint32 *) dst->pixels_rgba + (size_t) y0 * dst_w;
 
-    for (t = y = 0, dy = -dst_y; y < dst_h; y++, dy++)
-    for (    x = 0, dx = -dst_x; x < dst_w; x++, dx++, t++)
+    for (y = y0; y < y1; y++, dst_p += dst_w)
     {
-        /* Coordinates of real antecedent and closest integer */
-        sx = c*dx - s*dy; xn = EZ_ROUND(sx);
-        sy = s*dx + c*dy; yn = EZ_ROUND(sy);
+        /* Antecedent of the first pixel of the row */
+        u0 = EZ_FIX16 (inv[1]*y + inv[2]);
+        v0 = EZ_FIX16 (inv[4]*y + inv[5]);
 
-        /* Antecedent outside? */
-        if (xn < 0 || xn >= src_w || yn < 0 || yn >= src_h)
-             dst_p[t] = 0;
-        else dst_p[t] = src_p[yn * src_w + xn];
+        x0 = 0; x1 = dst_w;
+        ez_transform_span (u0, du, lo, hi_u, &x0, &x1);
+        ez_transform_span (v0, dv, lo, hi_v, &x0, &x1);
+        if (x0 >= x1) continue;
+
+        u0 += (Ez_int64) x0 * du;
+        v0 += (Ez_int64) x0 * dv;
+        if (b->op == EZ_FILTER_NEAREST)
+             ez_transform_row_nearest  (dst_p + x0, src, u0, v0, du, dv, x1-x0);
+        else ez_transform_row_bilinear (dst_p + x0, src, u0, v0, du, dv, x1-x0);
     }
 }
 
+#undef EZ_FIX16
 
-void ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta)
-{
-    double a = theta*M_PI/180, c = cos(-a), s = sin(-a), sx, sy;
-    int x, y, t, dx, dy, dst_x, dst_y,
-        src_w = src->width, src_h = src->height,
-        dst_w = dst->width, dst_h = dst->height;
-    Ez_uint8 *src_p = src->pixels_rgba, *dst_p = dst->pixels_rgba;
-
-    /* We set the rotation center to 0,0 and we retrieve the center
-       coordinates dst_x,dst_y in dst */
-    ez_rotate_get_coords (theta, src_w, src_h, 0, 0, &dst_x, &dst_y);
 
-    for (t = y = 0, dy = -dst_y; y < dst_h; y++, dy++)
-    for (    x = 0, dx = -dst_x; x < dst_w; x++, dx++, t+=4)
-    {
-        /* Coordinates of real antecedent */
-        sx = c*dx - s*dy;
-        sy = s*dx + c*dy;
+/*
+ * Integer division rounded toward -infinity.
+*/
 
-        ez_bilinear_4points (src_p, dst_p, src_w, src_h, sx, sy, t);
-    }
+Ez_int64 ez_floor_div (Ez_int64 n, Ez_int64 d)
+{
+    Ez_int64 q = n / d;
+    if (q * d != n && (n < 0) != (d < 0)) q--;
+    return q;
 }
 
 
-void ez_bilinear_4points (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t)
+/*
+ * Reduce the span [x0,x1[ to the x such that lo <= u0 + x*du < hi.
+*/
+
+void ez_transform_span (Ez_int64 u0, Ez_int64 du, Ez_int64 lo, Ez_int64 hi,
+    int *x0, int *x1)
 {
-    double rx0, rx1, ry0, ry1, r00, r01, r10, r11;
-    int x0, y0, x1, y1, k00, k01, k10, k11;
+    Ez_int64 a, b;
 
-    /* Antecedent outside? */
-    if (sx < -0.5 || sx >= src_w-0.5 || sy < -0.5 || sy >= src_h-0.5) {
-        dst_p[t] = dst_p[t+1] = dst_p[t+2] = dst_p[t+3] = 0;
+    if (du == 0) {
+        if (u0 < lo || u0 >= hi) *x1 = *x0;
         return;
     }
 
-    /* Neighbors of real antecedent reel on the grid */
-    x0 = sx < 0 ? sx-1 : sx; x1 = x0+1;
-    y0 = sy < 0 ? sy-1 : sy; y1 = y0+1;
+    /* First x such that u >= lo, resp. u < hi, and first after */
+    if (du > 0) {
+        a = -ez_floor_div (u0 - lo, du);
+        b = -ez_floor_div (u0 - hi, du);
+    } else {
+        a = ez_floor_div (hi - u0, du) + 1;
+        b = ez_floor_div (lo - u0, du) + 1;
+    }
+
+    if (a > *x0) *x0 = a > *x1 ? *x1 : a;
+    if (b < *x1) *x1 = b < *x0 ? *x0 : b;
+}
 
-    /* Real distance */
-    rx0 = sx-x0; rx1 = x1-sx;
-    ry0 = sy-y0; ry1 = y1-sy;
-    r00 = ry0*rx0; r01 = ry0*rx1;
-    r10 = ry1*rx0; r11 = ry1*rx1;
 
-    /* Neighbours offsets */
-    k00 = (y0 * src_w + x0)*4; k01 = k00 + 4;
-    k10 = k00 + src_w*4;       k11 = k10 + 4;
+/*
+ * Rows of ez_transform_inv: n pixels whose antecedents start at u,v in src
+ * and increase of du,dv, in 16.16 fixed-point; they are all in
+ * [-0.5, src_w-0.5[ x [-0.5, src_h-0.5[.
+*/
 
-    /* Neighbour outside? We take the neighbour inside */
-    if      (x0 < 0     ) k00 = k01, k10 = k11;
-    else if (x1 >= src_w) k01 = k00, k11 = k10;
-    if      (y0 < 0     ) k00 = k10, k01 = k11;
-    else if (y1 >= src_h) k10 = k00, k11 = k01;
+void ez_transform_row_nearest (Ez_uint32 *dst, Ez_image *src,
+    int u, int v, int du, int dv, int n)
+{
+    Ez_uint32 *src_p = (Ez_uint32 *) src->pixels_rgba;
+    int src_w = src->width, i;
 
-    /* Bilinear interpolation of colors and alpha channel */
-    dst_p[t  ] = r11*src_p[k00  ] + r10*src_p[k01  ] + r01*src_p[k10  ] + r00*src_p[k11  ];
-    dst_p[t+1] = r11*src_p[k00+1] + r10*src_p[k01+1] + r01*src_p[k10+1] + r00*src_p[k11+1];
-    dst_p[t+2] = r11*src_p[k00+2] + r10*src_p[k01+2] + r01*src_p[k10+2] + r00*src_p[k11+2];
-    dst_p[t+3] = r11*src_p[k00+3] + r10*src_p[k01+3] + r01*src_p[k10+3] + r00*src_p[k11+3];
+    for (i = 0; i < n; i++, u += du, v += dv)
+        dst[i] = src_p[((v + 0x8000) >> 16) * src_w + ((u + 0x8000) >> 16)];
 }
 
 
-void ez_bilinear_pane (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t, double factor)
+void ez_transform_row_bilinear (Ez_uint32 *dst, Ez_image *src,
+    int u, int v, int du, int dv, int n)
 {
-    double d = 1/factor, d2 = d*d, r = d/2, v, rx, ry,
-           mx0 = sx-r, my0 = sy-r, mx1 = sx+r, my1 = sy+r;
-    int x, y, i,
-        x0 = EZ_ROUND (mx0), y0 = EZ_ROUND (my0),
-        x1 = EZ_ROUND (mx1), y1 = EZ_ROUND (my1);
+    Ez_uint32 *src_p = (Ez_uint32 *) src->pixels_rgba, *r0, *r1, p, q;
+    int src_w = src->width, src_h = src->height, i, x0, y0, x1, y1, fx, fy;
 
-    if (x0 < 0) x0 = 0; else if (x1 > src_w-1) x1 = src_w-1;
-    if (y0 < 0) y0 = 0; else if (y1 > src_h-1) y1 = src_h-1;
+    for (i = 0; i < n; i++, u += du, v += dv)
+    {
+        /* Neighbours of the antecedent on the grid, u,v >= -0.5 */
+        x0 = ((u + 0x10000) >> 16) - 1; fx = ((u + 0x10000) >> 8) & 0xff;
+        y0 = ((v + 0x10000) >> 16) - 1; fy = ((v + 0x10000) >> 8) & 0xff;
+        x1 = x0+1; y1 = y0+1;
 
-    if (x0 >= x1 || y0 >= y1) {
-        dst_p[t] = dst_p[t+1] = dst_p[t+2] = dst_p[t+3] = 0;
-        return;
-    }
+        /* Neighbour outside? We take the neighbour inside */
+        if (x0 < 0) x0 = 0; else if (x1 >= src_w) x1 = src_w-1;
+        if (y0 < 0) y0 = 0; else if (y1 >= src_h) y1 = src_h-1;
 
-    for (i = 0; i < 4; i++) {
-        v = 0;
-        for (x = x0; x <= x1; x++)
-        for (y = y0; y <= y1; y++) {
-            rx = x == x0 ? x0+0.5-mx0 : x == x1 ? mx1-x1+0.5 : 1;
-            ry = y == y0 ? y0+0.5-my0 : y == y1 ? my1-y1+0.5 : 1;
-            v += src_p[(y*src_w+x)*4+i] * rx * ry;
-        }
-        dst_p[t+i] = v / d2;
+        r0 = src_p + y0 * src_w;
+        r1 = src_p + y1 * src_w;
+        p = EZ_LERP_PX (r0[x0], r0[x1], fx);
+        q = EZ_LERP_PX (r1[x0], r1[x1], fx);
+        dst[i] = EZ_LERP_PX (p, q, fy);
     }
 }
 
@@ -1309,12 +4661,20 @@ int ez_pixmap_build_map (Ez_pixmap *pix, Ez_image *img)
     if (pix->map == None) return -1;
 
     xi_func = ez_xi_get_func ();
+    if (ez_xshm_available ()) {
+        xi = ez_xshm_create (img, 0, 0, img->width, img->height, xi_func);
+        if (xi != NULL) {
+            ez_xshm_put (pix->map, xi, 0, 0, img->width, img->height);
+            return 0;
+        }
+    }
+
     xi = ez_xi_create (img, 0, 0, img->width, img->height, xi_func);
     if (xi == NULL) return -1;
 
     XPutImage (ezx.display, pix->map, ezx.gc, xi, 0, 0, 0, 0,
         img->width, img->height);
-    XDestroyImage (xi);
+    ez_xi_destroy (xi);
 
     return 0;
 }
@@ -1322,43 +4682,116 @@ int ez_pixmap_build_map (Ez_pixmap *pix, Ez_image *img)
 
 void ez_pixmap_draw_area (Ez_window win, Ez_pixmap *pix, int x, int y)
 {
-    if (pix->mask != None) {
-        XSetClipOrigin (ezx.display, ezx.gc, x, y);
-        XSetClipMask (ezx.display, ezx.gc, pix->mask);
-    }
+    int src_x = 0, src_y = 0, w = pix->width, h = pix->height,
+        mask_x = x, mask_y = y;
 
-    XCopyArea(ezx.display, pix->map, win, ezx.gc, 0, 0,
-        pix->width, pix->height, x, y);
+    /* The mask replaces the clip of the damaged area */
+    if (ez_clip_area (win, &x, &y, &src_x, &src_y, &w, &h) < 0) return;
 
-    if (pix->mask != None) {
-        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
-        XSetClipMask (ezx.display, ezx.gc, None);
+    if (pix->pict != None) {
+        ez_xrender_composite (win, pix, src_x, src_y, x, y, w, h);
+        return;
     }
+
+    if (pix->mask != None) ez_gc_set_clip_mask (pix->mask, mask_x, mask_y);
+    else ez_clip_gc (win);
+
+    XCopyArea(ezx.display, pix->map, win, ezx.gc, src_x, src_y,
+        w, h, x, y);
+
+    if (pix->mask != None) ez_clip_gc (win);
 }
 
 
+/*
+ * Tile the area with a constant number of requests: the picture repeats, or
+ * the pixmap is the tile of the GC for a single XFillRectangle, clipped by the
+ * mask tiled once for all on the area.
+*/
+
 void ez_pixmap_tile_area (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
 {
-    int nx, ny;
+    int tx = x, ty = y, src_x = 0, src_y = 0, tw = w, th = h;
 
-    for (ny = 0; ny < h; ny += pix->height)
-    for (nx = 0; nx < w; nx += pix->width)
-    {
-        if (pix->mask != None) {
-            XSetClipOrigin (ezx.display, ezx.gc, x+nx, y+ny);
-            XSetClipMask (ezx.display, ezx.gc, pix->mask);
-        }
+    if (ez_clip_area (win, &tx, &ty, &src_x, &src_y, &tw, &th) < 0) return;
 
-        XCopyArea(ezx.display, pix->map, win, ezx.gc, 0, 0,
-            nx+pix->width  <= w ? pix->width  : w-nx,
-            ny+pix->height <= h ? pix->height : h-ny,
-            x+nx, y+ny);
+    if (pix->pict != None) {
+        ez_xrender_composite (win, pix, src_x, src_y, tx, ty, tw, th);
+        return;
     }
 
+    /* The mask replaces the clip of the damaged area */
     if (pix->mask != None) {
-        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
-        XSetClipMask (ezx.display, ezx.gc, None);
+        if (ez_pixmap_tile_mask (pix, w, h) < 0) return;
+        ez_gc_set_clip_mask (pix->tile_mask, x, y);
+    } else ez_clip_gc (win);
+
+    ez_gc_set_tile (pix->map, x, y);
+    ez_gc_set_fill_style (FillTiled);
+    XFillRectangle (ezx.display, win, ezx.gc, tx, ty, tw, th);
+    ez_gc_set_fill_style (FillSolid);
+
+    if (pix->mask != None) ez_clip_gc (win);
+}
+
+
+/*
+ * Ensure that pix->tile_mask holds the mask of pix tiled on at least w x h;
+ * it is kept for the next calls, and grown on demand.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_pixmap_tile_mask (Ez_pixmap *pix, int w, int h)
+{
+    GC gc;
+
+    if (pix->tile_mask != None && w <= pix->tile_w && h <= pix->tile_h)
+        return 0;
+
+    if (w < pix->tile_w) w = pix->tile_w;
+    if (h < pix->tile_h) h = pix->tile_h;
+    if (pix->tile_mask != None) XFreePixmap (ezx.display, pix->tile_mask);
+    pix->tile_w = pix->tile_h = 0;
+
+    pix->tile_mask = XCreatePixmap (ezx.display, ezx.root_win, w, h, 1);
+    if (pix->tile_mask == None) {
+        ez_error ("ez_pixmap_tile_mask: can't create bitmap\n");
+        return -1;
+    }
+    gc = XCreateGC (ezx.display, pix->tile_mask, 0, NULL);
+    XSetTile (ezx.display, gc, pix->mask);
+    XSetFillStyle (ezx.display, gc, FillTiled);
+    XFillRectangle (ezx.display, pix->tile_mask, gc, 0, 0, w, h);
+    XFreeGC (ezx.display, gc);
+
+    pix->tile_w = w; pix->tile_h = h;
+    return 0;
+}
+
+
+/*
+ * Copy the area r of the page pix at x,y in win. The mask of the page is left
+ * in the GC, to be reused by the next image of the same page.
+*/
+
+void ez_atlas_draw_area (Ez_window win, Ez_pixmap *pix, Ez_atlas_rect *r,
+    int x, int y)
+{
+    int src_x = r->x, src_y = r->y, w = r->w, h = r->h,
+        mask_x = x - r->x, mask_y = y - r->y;
+
+    if (ez_clip_area (win, &x, &y, &src_x, &src_y, &w, &h) < 0) return;
+
+    if (pix->pict != None) {
+        ez_xrender_composite (win, pix, src_x, src_y, x, y, w, h);
+        return;
     }
+
+    if (pix->mask != None) ez_gc_set_clip_mask (pix->mask, mask_x, mask_y);
+    else ez_clip_gc (win);
+
+    XCopyArea (ezx.display, pix->map, win, ezx.gc, src_x, src_y,
+        w, h, x, y);
 }
 
 #elif defined EZ_BASE_WIN32
@@ -1467,6 +4900,44 @@ void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int
     if (hdc != NULL) DeleteDC (hdc);
 }
 
+
+/*
+ * Copy the area r of the page pix, selected in hdc, at x,y in hdc_dst.
+*/
+
+void ez_atlas_draw_hmap (HDC hdc_dst, HDC hdc, Ez_pixmap *pix, Ez_atlas_rect *r,
+    int x, int y)
+{
+    if (pix->has_alpha) {
+        BLENDFUNCTION bf;
+
+        bf.BlendOp = AC_SRC_OVER;
+        bf.BlendFlags = 0;
+        bf.AlphaFormat = AC_SRC_ALPHA;  /* Alpha channel premultiplied */
+        bf.SourceConstantAlpha = 0xff;
+
+        if (AlphaBlend (hdc_dst, x, y, r->w, r->h, hdc,
+                r->x, r->y, r->w, r->h, bf) == FALSE)
+            ez_error ("ez_atlas_draw_hmap: AlphaBlend failed\n");
+    } else {
+        if (BitBlt (hdc_dst, x, y, r->w, r->h, hdc, r->x, r->y, SRCCOPY) == 0)
+            ez_error ("ez_atlas_draw_hmap: bitblt failed\n");
+    }
+}
+
+#elif defined EZ_BASE_MEMORY
+
+void ez_pixmap_tile_mem (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
+{
+    int nx, ny;
+
+    for (ny = 0; ny < h; ny += pix->height)
+    for (nx = 0; nx < w; nx += pix->width)
+        ez_image_draw_mem (win, pix->img, x+nx, y+ny, 0, 0,
+            nx+pix->width  <= w ? pix->width  : w-nx,
+            ny+pix->height <= h ? pix->height : h-ny);
+}
+
 #endif /* EZ_BASE_ */
 
 
@@ -1576,12 +5047,30 @@ typedef struct {
 
     Ez_uint8 *img_buffer, *img_buffer_end;
     Ez_uint8 *img_buffer_original;
+
+    int max_w, max_h;   /* Size of a thumbnail for a reduced decoding, or 0 */
 } Ez_stbi;
 
 
 void ez_refill_buffer (Ez_stbi *s);
 
 
+/*
+ * A regular file is mapped in memory, then decoded in place as a memory
+ * buffer: the decoders read its bytes directly, instead of through the small
+ * buffer of the callbacks. Pipes, devices, empty or too large files are read
+ * with stdio. To disable, define environment variable EZ_IMAGE_NOMMAP.
+*/
+
+typedef struct {
+    Ez_uint8 *addr;
+    int len;
+} Ez_stbi_map;
+
+int ez_stbi_map_file (Ez_stbi_map *m, char const *filename);
+void ez_stbi_unmap_file (Ez_stbi_map *m);
+
+
 /* Initialize a memory-decode context */
 
 void ez_stbi_start_mem (Ez_stbi *s, Ez_uint8 const *buffer, int len)
@@ -1590,6 +5079,7 @@ void ez_stbi_start_mem (Ez_stbi *s, Ez_uint8 const *buffer, int len)
     s->read_from_callbacks = 0;
     s->img_buffer = s->img_buffer_original = (Ez_uint8 *) buffer;
     s->img_buffer_end = (Ez_uint8 *) buffer+len;
+    s->max_w = s->max_h = 0;
 }
 
 
@@ -1602,6 +5092,7 @@ void ez_stbi_start_callbacks (Ez_stbi *s, Ez_stbi_io_callbacks *c, void *user)
     s->buflen = sizeof (s->buffer_start);
     s->read_from_callbacks = 1;
     s->img_buffer_original = s->buffer_start;
+    s->max_w = s->max_h = 0;
     ez_refill_buffer (s);
 }
 
@@ -1613,7 +5104,14 @@ int ez_io_read (void *user, char *data, int size)
 
 void ez_io_skip (void *user, unsigned n)
 {
-    fseek ((FILE*) user, n, SEEK_CUR);
+    char buf[256];
+    size_t k;
+
+    /* On a pipe, fseek fails: the bytes are read instead */
+    if (fseek ((FILE*) user, n, SEEK_CUR) == 0) return;
+    while (n > 0 &&
+           (k = fread (buf, 1, n < sizeof(buf) ? n : sizeof(buf), (FILE*) user)) > 0)
+        n -= k;
 }
 
 int ez_io_eof (void *user)
@@ -1679,18 +5177,112 @@ Ez_uint8 *ez_stbi_load_main (Ez_stbi *s, int *x, int *y, int *comp,
 Ez_uint8 *ez_stbi_load (char const *filename, int *x, int *y, int *comp,
     int req_comp)
 {
-    FILE *f = fopen (filename, "rb");
+    return ez_stbi_load_scaled (filename, x, y, comp, req_comp, 0, 0);
+}
+
+
+/*
+ * Same as ez_stbi_load, but a JPEG image may be decoded reduced by 2, 4 or 8,
+ * as long as it still covers its thumbnail in max_w x max_h (see
+ * ez_jpeg_scale_shift); the other formats are decoded at full size.
+*/
+
+Ez_uint8 *ez_stbi_load_scaled (char const *filename, int *x, int *y, int *comp,
+    int req_comp, int max_w, int max_h)
+{
+    FILE *f;
     Ez_uint8 *result;
+    Ez_stbi_map m;
+    Ez_stbi s;
+
+    if (ez_stbi_map_file (&m, filename) == 0) {
+        ez_stbi_start_mem (&s, m.addr, m.len);
+        s.max_w = max_w; s.max_h = max_h;
+        result = ez_stbi_load_main (&s, x, y, comp, req_comp);
+        ez_stbi_unmap_file (&m);
+        return result;
+    }
+
+    f = fopen (filename, "rb");
     if (!f) {
         ez_error ("ez_stbi_load: unable to open file \"%s\"\n", filename);
         return NULL;
     }
-    result = ez_stbi_load_from_file (f, x, y, comp, req_comp);
+    ez_start_file (&s, f);
+    s.max_w = max_w; s.max_h = max_h;
+    result = ez_stbi_load_main (&s, x, y, comp, req_comp);
     fclose (f);
     return result;
 }
 
 
+/* Return 0 on success, else -1 to fall back on stdio */
+
+int ez_stbi_map_file (Ez_stbi_map *m, char const *filename)
+{
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    struct stat st;
+    void *addr;
+    int fd;
+
+    if (getenv ("EZ_IMAGE_NOMMAP") != NULL) return -1;
+
+    fd = open (filename, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) ||
+        st.st_size <= 0 || st.st_size > INT_MAX) {
+        close (fd);
+        return -1;
+    }
+    addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);  /* The mapping stays valid */
+    if (addr == MAP_FAILED) return -1;
+#ifdef MADV_SEQUENTIAL
+    madvise (addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    m->addr = addr;
+    m->len = st.st_size;
+    return 0;
+
+#elif defined EZ_BASE_WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+
+    if (getenv ("EZ_IMAGE_NOMMAP") != NULL) return -1;
+
+    file = CreateFileA (filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return -1;
+    if (GetFileType (file) != FILE_TYPE_DISK || !GetFileSizeEx (file, &size) ||
+        size.QuadPart <= 0 || size.QuadPart > INT_MAX) {
+        CloseHandle (file);
+        return -1;
+    }
+    mapping = CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle (file);
+    if (mapping == NULL) return -1;
+    /* The view keeps the mapping alive */
+    m->addr = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle (mapping);
+    if (m->addr == NULL) return -1;
+
+    m->len = (int) size.QuadPart;
+    return 0;
+#endif /* EZ_BASE_ */
+}
+
+
+void ez_stbi_unmap_file (Ez_stbi_map *m)
+{
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    munmap (m->addr, m->len);
+#elif defined EZ_BASE_WIN32
+    UnmapViewOfFile (m->addr);
+#endif /* EZ_BASE_ */
+}
+
+
 Ez_uint8 *ez_stbi_load_from_file (FILE *f, int *x, int *y, int *comp,
     int req_comp)
 {
@@ -1994,6 +5586,8 @@ typedef struct {
 
     int scan_n, order[4];
     int restart_interval, todo;
+
+    int scale_shift;        /* Blocks decoded in (8 >> scale_shift)^2 pixels */
 } Ez_jpeg;
 
 
@@ -2261,6 +5855,26 @@ EZ_INLINE Ez_uint8 ez_jpeg_clamp (int x)
 
 typedef Ez_uint8 Ez_stbi_dequantize_t;
 
+typedef void (*Ez_idct_block_func)
+    (Ez_uint8 *out, int out_stride, short data[64], Ez_stbi_dequantize_t *dq);
+
+Ez_idct_block_func ez_jpeg_idct_get_func (int shift);
+void ez_jpeg_idct_block_4x4 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize);
+void ez_jpeg_idct_block_2x2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize);
+void ez_jpeg_idct_block_1x1 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize);
+int ez_jpeg_scale_shift (int img_w, int img_h, int max_w, int max_h);
+#ifdef EZ_SIMD_X86
+void ez_jpeg_transpose_sse2 (__m128i v[16]);
+void ez_jpeg_idct_block_sse2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize);
+void ez_jpeg_transpose_avx2 (__m256i v[8]);
+void ez_jpeg_idct_block_avx2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize);
+#endif /* EZ_SIMD_X86 */
+
 
 /* .344 seconds on 3*anemones.jpg */
 
@@ -2328,6 +5942,343 @@ void ez_jpeg_idct_block (Ez_uint8 *out, int out_stride, short data[64],
 }
 
 
+
+/*
+ * Reduced IDCT, for the decoding at 1/2, 1/4 or 1/8: the n x n lowest
+ * frequencies of the block give n x n pixels, which sample the full IDCT at
+ * the centers of its squares of 8/n x 8/n pixels. The scales and roundings
+ * are those of ez_jpeg_idct_block, so that a flat block gives the same pixels.
+*/
+
+/* 4 point IDCT: outputs x0+t0, x1+t1, x1-t1, x0-t0 */
+#define EZ_IDCT_1D_4(s0,s1,s2,s3)               \
+    int t0, t1, x0, x1;                         \
+    x0 = Ez_fsh ((s0)+(s2));                    \
+    x1 = Ez_fsh ((s0)-(s2));                    \
+    t0 = (s1)*Ez_f2f (1.306562965f) + (s3)*Ez_f2f (0.5411961f); \
+    t1 = (s1)*Ez_f2f (0.5411961f) - (s3)*Ez_f2f (1.306562965f);
+
+void ez_jpeg_idct_block_4x4 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    int i, val[16], *v=val;
+    Ez_stbi_dequantize_t *dq = dequantize;
+    Ez_uint8 *o;
+    short *d = data;
+
+    /* Columns */
+    for (i=0; i < 4; ++i, ++d, ++dq, ++v) {
+        EZ_IDCT_1D_4 (d[0]*dq[0], d[8]*dq[8], d[16]*dq[16], d[24]*dq[24])
+        x0 += 512; x1 += 512;
+        v[ 0] = (x0+t0) >> 10;
+        v[12] = (x0-t0) >> 10;
+        v[ 4] = (x1+t1) >> 10;
+        v[ 8] = (x1-t1) >> 10;
+    }
+
+    for (i=0, v=val, o=out; i < 4; ++i, v+=4, o+=out_stride) {
+        EZ_IDCT_1D_4 (v[0], v[1], v[2], v[3])
+        x0 += 65536 + (128<<17);
+        x1 += 65536 + (128<<17);
+        o[0] = ez_jpeg_clamp ((x0+t0) >> 17);
+        o[3] = ez_jpeg_clamp ((x0-t0) >> 17);
+        o[1] = ez_jpeg_clamp ((x1+t1) >> 17);
+        o[2] = ez_jpeg_clamp ((x1-t1) >> 17);
+    }
+}
+
+
+void ez_jpeg_idct_block_2x2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    int i, s0, s1, v[4];
+
+    /* Columns */
+    for (i=0; i < 2; ++i) {
+        s0 = data[i]   * dequantize[i];
+        s1 = data[8+i] * dequantize[8+i];
+        v[i]   = (Ez_fsh (s0+s1) + 512) >> 10;
+        v[2+i] = (Ez_fsh (s0-s1) + 512) >> 10;
+    }
+
+    for (i=0; i < 2; ++i, out+=out_stride) {
+        out[0] = ez_jpeg_clamp ((Ez_fsh (v[i*2]+v[i*2+1]) + 65536 + (128<<17)) >> 17);
+        out[1] = ez_jpeg_clamp ((Ez_fsh (v[i*2]-v[i*2+1]) + 65536 + (128<<17)) >> 17);
+    }
+}
+
+
+void ez_jpeg_idct_block_1x1 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    /* The mean of the block, rounded as in ez_jpeg_idct_block */
+    (void) out_stride;
+    out[0] = ez_jpeg_clamp (((data[0]*dequantize[0] + 4) >> 3) + 128);
+}
+
+
+/*
+ * Return the shift k in 0..3 of the reduced decoding of an image of size
+ * img_w x img_h, for a thumbnail in max_w x max_h (0 for a full decoding):
+ * the largest k such that the image reduced by 2^k still covers the image
+ * reduced to fit in max_w x max_h, keeping its aspect ratio.
+*/
+
+int ez_jpeg_scale_shift (int img_w, int img_h, int max_w, int max_h)
+{
+    int k = 0;
+
+    if (max_w <= 0 || max_h <= 0) return 0;
+    while (k < 3 && ((img_w >> (k+1)) >= max_w || (img_h >> (k+1)) >= max_h))
+        k++;
+    return k;
+}
+
+
+/*
+ * Choose the function which decodes the IDCT of a block in
+ * (8 >> shift)^2 pixels.
+*/
+
+Ez_idct_block_func ez_jpeg_idct_get_func (int shift)
+{
+    static Ez_idct_block_func idct_func = NULL;
+
+    if (shift == 1) return ez_jpeg_idct_block_4x4;
+    if (shift == 2) return ez_jpeg_idct_block_2x2;
+    if (shift == 3) return ez_jpeg_idct_block_1x1;
+
+    if (idct_func != NULL) return idct_func;
+    idct_func = ez_jpeg_idct_block;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2) idct_func = ez_jpeg_idct_block_avx2;
+        else if (cpu & EZ_CPU_SSE2) idct_func = ez_jpeg_idct_block_sse2;
+    }
+#endif /* EZ_SIMD_X86 */
+
+    return idct_func;
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * Vectorized IDCT, with the same results as ez_jpeg_idct_block: the 1D IDCT
+ * are computed in 32 bit lanes, with the same operations as EZ_IDCT_1D, the
+ * lane i of s[k] being the input k of the i-th 1D IDCT. The columns pass
+ * handles a row of 4 or 8 columns per vector; the block is then transposed
+ * for the rows pass, and transposed back to store the pixels.
+*/
+
+#define EZ_IDCT_1D_VEC(T, add, sub, mul, k, sl, s)      \
+    T t0, t1, t2, t3, p1, p2, p3, p4, p5, x0, x1, x2, x3; \
+    p2 = s[2];                                          \
+    p3 = s[6];                                          \
+    p1 = mul (add (p2, p3), k (Ez_f2f (0.5411961f)));   \
+    t2 = add (p1, mul (p3, k (Ez_f2f (-1.847759065f))));\
+    t3 = add (p1, mul (p2, k (Ez_f2f ( 0.765366865f))));\
+    p2 = s[0];                                          \
+    p3 = s[4];                                          \
+    t0 = sl (add (p2, p3), 12);                         \
+    t1 = sl (sub (p2, p3), 12);                         \
+    x0 = add (t0, t3);                                  \
+    x3 = sub (t0, t3);                                  \
+    x1 = add (t1, t2);                                  \
+    x2 = sub (t1, t2);                                  \
+    t0 = s[7];                                          \
+    t1 = s[5];                                          \
+    t2 = s[3];                                          \
+    t3 = s[1];                                          \
+    p3 = add (t0, t2);                                  \
+    p4 = add (t1, t3);                                  \
+    p1 = add (t0, t3);                                  \
+    p2 = add (t1, t2);                                  \
+    p5 = mul (add (p3, p4), k (Ez_f2f ( 1.175875602f)));\
+    t0 = mul (t0, k (Ez_f2f ( 0.298631336f)));          \
+    t1 = mul (t1, k (Ez_f2f ( 2.053119869f)));          \
+    t2 = mul (t2, k (Ez_f2f ( 3.072711026f)));          \
+    t3 = mul (t3, k (Ez_f2f ( 1.501321110f)));          \
+    p1 = add (p5, mul (p1, k (Ez_f2f (-0.899976223f))));\
+    p2 = add (p5, mul (p2, k (Ez_f2f (-2.562915447f))));\
+    p3 = mul (p3, k (Ez_f2f (-1.961570560f)));          \
+    p4 = mul (p4, k (Ez_f2f (-0.390180644f)));          \
+    t3 = add (t3, add (p1, p4));                        \
+    t2 = add (t2, add (p2, p3));                        \
+    t1 = add (t1, add (p2, p4));                        \
+    t0 = add (t0, add (p1, p3));
+
+/* Add the rounding bias to x0..x3, then store the outputs shifted by n */
+#define EZ_IDCT_OUT_VEC(add, sub, sr, bias, n, o)       \
+    x0 = add (x0, bias); x1 = add (x1, bias);           \
+    x2 = add (x2, bias); x3 = add (x3, bias);           \
+    o[0] = sr (add (x0, t3), n);                        \
+    o[7] = sr (sub (x0, t3), n);                        \
+    o[1] = sr (add (x1, t2), n);                        \
+    o[6] = sr (sub (x1, t2), n);                        \
+    o[2] = sr (add (x2, t1), n);                        \
+    o[5] = sr (sub (x2, t1), n);                        \
+    o[3] = sr (add (x3, t0), n);                        \
+    o[4] = sr (sub (x3, t0), n);
+
+/* Low 32 bits of the products of the lanes of a by those of c, as the
+   _mm_mullo_epi32 of SSE4.1 */
+#define EZ_MULLO_SSE2(a, c)                                             \
+    _mm_unpacklo_epi32 (                                                \
+        _mm_shuffle_epi32 (_mm_mul_epu32 (a, c), 0x08),                 \
+        _mm_shuffle_epi32 (_mm_mul_epu32 (_mm_srli_epi64 (a, 32),       \
+                                          _mm_srli_epi64 (c, 32)), 0x08))
+
+
+/* Transpose the 8x8 block v, where v[r*2+h] is row r, columns 4*h to 4*h+3 */
+
+EZ_TARGET ("sse2")
+void ez_jpeg_transpose_sse2 (__m128i v[16])
+{
+    __m128i u0, u1, u2, u3, w;
+    int b;
+
+    for (b = 0; b < 4; b++) {
+        /* Block b: rows 4*(b/2) to 4*(b/2)+3, columns 4*(b%2) to 4*(b%2)+3 */
+        __m128i *r = v + (b/2)*8 + (b%2);
+        u0 = _mm_unpacklo_epi32 (r[0], r[2]);
+        u1 = _mm_unpacklo_epi32 (r[4], r[6]);
+        u2 = _mm_unpackhi_epi32 (r[0], r[2]);
+        u3 = _mm_unpackhi_epi32 (r[4], r[6]);
+        r[0] = _mm_unpacklo_epi64 (u0, u1);
+        r[2] = _mm_unpackhi_epi64 (u0, u1);
+        r[4] = _mm_unpacklo_epi64 (u2, u3);
+        r[6] = _mm_unpackhi_epi64 (u2, u3);
+    }
+    /* Swap the blocks 1 and 2 */
+    for (b = 0; b < 4; b++) {
+        w = v[b*2+1]; v[b*2+1] = v[8+b*2]; v[8+b*2] = w;
+    }
+}
+
+
+EZ_TARGET ("sse2")
+void ez_jpeg_idct_block_sse2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    __m128i v[16], s[8], o[8], d, q, lo, hi, zero = _mm_setzero_si128 ();
+    int h, k;
+
+    /* Dequantize in 32 bits: v[k*2+h] is row k, columns 4*h to 4*h+3 */
+    for (k = 0; k < 8; k++) {
+        d  = _mm_loadu_si128 ((__m128i *) (data + k*8));
+        q  = _mm_unpacklo_epi8 (
+                 _mm_loadl_epi64 ((__m128i *) (dequantize + k*8)), zero);
+        lo = _mm_mullo_epi16 (d, q);
+        hi = _mm_mulhi_epi16 (d, q);
+        v[k*2]   = _mm_unpacklo_epi16 (lo, hi);
+        v[k*2+1] = _mm_unpackhi_epi16 (lo, hi);
+    }
+
+    /* Columns, keeping 2 extra bits of precision */
+    for (h = 0; h < 2; h++) {
+        for (k = 0; k < 8; k++) s[k] = v[k*2+h];
+        {
+            EZ_IDCT_1D_VEC (__m128i, _mm_add_epi32, _mm_sub_epi32,
+                EZ_MULLO_SSE2, _mm_set1_epi32, _mm_slli_epi32, s)
+            EZ_IDCT_OUT_VEC (_mm_add_epi32, _mm_sub_epi32, _mm_srai_epi32,
+                _mm_set1_epi32 (512), 10, o)
+        }
+        for (k = 0; k < 8; k++) v[k*2+h] = o[k];
+    }
+
+    /* Rows, with the rounding and the offset of 128 */
+    ez_jpeg_transpose_sse2 (v);
+    for (h = 0; h < 2; h++) {
+        for (k = 0; k < 8; k++) s[k] = v[k*2+h];
+        {
+            EZ_IDCT_1D_VEC (__m128i, _mm_add_epi32, _mm_sub_epi32,
+                EZ_MULLO_SSE2, _mm_set1_epi32, _mm_slli_epi32, s)
+            EZ_IDCT_OUT_VEC (_mm_add_epi32, _mm_sub_epi32, _mm_srai_epi32,
+                _mm_set1_epi32 (65536 + (128<<17)), 17, o)
+        }
+        for (k = 0; k < 8; k++) v[k*2+h] = o[k];
+    }
+
+    /* Clamp to 0..255 by saturation, as ez_jpeg_clamp */
+    ez_jpeg_transpose_sse2 (v);
+    for (k = 0; k < 8; k++, out += out_stride) {
+        d = _mm_packs_epi32 (v[k*2], v[k*2+1]);
+        _mm_storel_epi64 ((__m128i *) out, _mm_packus_epi16 (d, d));
+    }
+}
+
+
+/* Transpose the 8x8 block v, where v[r] is row r */
+
+EZ_TARGET ("avx2")
+void ez_jpeg_transpose_avx2 (__m256i v[8])
+{
+    __m256i t[8], u[8];
+    int k;
+
+    for (k = 0; k < 4; k++) {
+        t[k*2]   = _mm256_unpacklo_epi32 (v[k*2], v[k*2+1]);
+        t[k*2+1] = _mm256_unpackhi_epi32 (v[k*2], v[k*2+1]);
+    }
+    for (k = 0; k < 2; k++) {
+        u[k*4]   = _mm256_unpacklo_epi64 (t[k*4],   t[k*4+2]);
+        u[k*4+1] = _mm256_unpackhi_epi64 (t[k*4],   t[k*4+2]);
+        u[k*4+2] = _mm256_unpacklo_epi64 (t[k*4+1], t[k*4+3]);
+        u[k*4+3] = _mm256_unpackhi_epi64 (t[k*4+1], t[k*4+3]);
+    }
+    for (k = 0; k < 4; k++) {
+        v[k]   = _mm256_permute2x128_si256 (u[k], u[k+4], 0x20);
+        v[k+4] = _mm256_permute2x128_si256 (u[k], u[k+4], 0x31);
+    }
+}
+
+
+EZ_TARGET ("avx2")
+void ez_jpeg_idct_block_avx2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    __m256i v[8];
+    __m128i d;
+    int k;
+
+    /* Dequantize in 32 bits: v[k] is row k */
+    for (k = 0; k < 8; k++)
+        v[k] = _mm256_mullo_epi32 (
+            _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((__m128i *) (data + k*8))),
+            _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((__m128i *) (dequantize + k*8))));
+
+    /* Columns, keeping 2 extra bits of precision */
+    {
+        EZ_IDCT_1D_VEC (__m256i, _mm256_add_epi32, _mm256_sub_epi32,
+            _mm256_mullo_epi32, _mm256_set1_epi32, _mm256_slli_epi32, v)
+        EZ_IDCT_OUT_VEC (_mm256_add_epi32, _mm256_sub_epi32, _mm256_srai_epi32,
+            _mm256_set1_epi32 (512), 10, v)
+    }
+
+    /* Rows, with the rounding and the offset of 128 */
+    ez_jpeg_transpose_avx2 (v);
+    {
+        EZ_IDCT_1D_VEC (__m256i, _mm256_add_epi32, _mm256_sub_epi32,
+            _mm256_mullo_epi32, _mm256_set1_epi32, _mm256_slli_epi32, v)
+        EZ_IDCT_OUT_VEC (_mm256_add_epi32, _mm256_sub_epi32, _mm256_srai_epi32,
+            _mm256_set1_epi32 (65536 + (128<<17)), 17, v)
+    }
+
+    /* Clamp to 0..255 by saturation, as ez_jpeg_clamp */
+    ez_jpeg_transpose_avx2 (v);
+    for (k = 0; k < 8; k++, out += out_stride) {
+        d = _mm_packs_epi32 (_mm256_castsi256_si128 (v[k]),
+                             _mm256_extracti128_si256 (v[k], 1));
+        _mm_storel_epi64 ((__m128i *) out, _mm_packus_epi16 (d, d));
+    }
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
 #define EZ_MARKER_NONE  0xff
 
 /* If there's a pending marker from the entropy stream, return that
@@ -2371,6 +6322,9 @@ void ez_jpeg_reset (Ez_jpeg *j)
 
 int ez_jpeg_parse_entropy_coded_data (Ez_jpeg *z)
 {
+    Ez_idct_block_func idct_block = ez_jpeg_idct_get_func (z->scale_shift);
+    int bs = 8 >> z->scale_shift;   /* Size of the decoded blocks */
+
     ez_jpeg_reset (z);
     if (z->scan_n == 1) {
         int i, j;
@@ -2380,13 +6334,13 @@ int ez_jpeg_parse_entropy_coded_data (Ez_jpeg *z)
            in trivial scanline order
            number of blocks to do just depends on how many actual "pixels" this
            component has, independent of interleaved MCU blocking and such */
-        int w = (z->img_comp[n].x+7) >> 3;
-        int h = (z->img_comp[n].y+7) >> 3;
+        int w = (z->img_comp[n].x+bs-1) / bs;
+        int h = (z->img_comp[n].y+bs-1) / bs;
         for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                 if (!ez_jpeg_decode_block (z, data, z->huff_dc+z->img_comp[n].hd,
                     z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                ez_jpeg_idct_block (z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8,
+                idct_block (z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs,
                     z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
 
                 /* Every data block is an MCU, so countdown the restart interval */
@@ -2411,13 +6365,13 @@ int ez_jpeg_parse_entropy_coded_data (Ez_jpeg *z)
                        determined by the basic H and V specified for the component */
                     for (y=0; y < z->img_comp[n].v; ++y) {
                         for (x=0; x < z->img_comp[n].h; ++x) {
-                            int x2 = (i*z->img_comp[n].h + x)*8;
-                            int y2 = (j*z->img_comp[n].v + y)*8;
+                            int x2 = (i*z->img_comp[n].h + x)*bs;
+                            int y2 = (j*z->img_comp[n].v + y)*bs;
                             if (!ez_jpeg_decode_block (z, data,
                                 z->huff_dc+z->img_comp[n].hd,
                                 z->huff_ac+z->img_comp[n].ha, n)) return 0;
 
-                            ez_jpeg_idct_block (
+                            idct_block (
                                 z->img_comp[n].data+z->img_comp[n].w2*y2+x2,
                                 z->img_comp[n].w2, data,
                                 z->dequant[z->img_comp[n].tq]);
@@ -2570,7 +6524,7 @@ int ez_jpeg_process_scan_header (Ez_jpeg *z)
 int ez_jpeg_process_frame_header (Ez_jpeg *z, int scan)
 {
     Ez_stbi *s = z->s;
-    int Lf, p, i, q, h_max=1, v_max=1, c;
+    int Lf, p, i, q, h_max=1, v_max=1, c, bs, r;
     Lf = ez_buffer_get16 (s); if (Lf < 11) {
         ez_error ("ez_jpeg_process_frame_header: corrupt JPEG: bad SOF len\n");
         return 0;
@@ -2649,16 +6603,24 @@ int ez_jpeg_process_frame_header (Ez_jpeg *z, int scan)
     z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
     z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+    /* For a thumbnail, the blocks are decoded in bs x bs pixels, and all
+       the sizes in pixels below are reduced by r+1, rounding up */
+    z->scale_shift = ez_jpeg_scale_shift (s->img_x, s->img_y, s->max_w, s->max_h);
+    bs = 8 >> z->scale_shift;
+    r = (1 << z->scale_shift) - 1;
+
     for (i=0; i < s->img_n; ++i) {
         /* Number of effective pixels (e.g. for non-interleaved MCU) */
         z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
         z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
+        z->img_comp[i].x = (z->img_comp[i].x + r) >> z->scale_shift;
+        z->img_comp[i].y = (z->img_comp[i].y + r) >> z->scale_shift;
         /* To simplify generation, we'll allocate enough memory to decode
            the bogus oversized data from using interleaved MCUs and their
            big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
            discard the extra data until colorspace conversion */
-        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * bs;
+        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * bs;
         z->img_comp[i].raw_data = malloc (z->img_comp[i].w2 * z->img_comp[i].h2+15);
         if (z->img_comp[i].raw_data == NULL) {
             for (--i; i >= 0; --i) {
@@ -2674,6 +6636,9 @@ int ez_jpeg_process_frame_header (Ez_jpeg *z, int scan)
         z->img_comp[i].linebuf = NULL;
     }
 
+    s->img_x = (s->img_x + r) >> z->scale_shift;
+    s->img_y = (s->img_y + r) >> z->scale_shift;
+
     return 1;
 }
 
@@ -2752,6 +6717,29 @@ int ez_jpeg_decode_image (Ez_jpeg *j)
 typedef Ez_uint8* (*Ez_resample_row_func)
     (Ez_uint8 *out, Ez_uint8 *in0, Ez_uint8 *in1, int w, int hs);
 
+Ez_resample_row_func ez_jpeg_resample_get_func (int hs, int vs);
+#ifdef EZ_SIMD_X86
+Ez_uint8 *ez_jpeg_resample_row_h_2_sse2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs);
+Ez_uint8 *ez_jpeg_resample_row_h_2_avx2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs);
+Ez_uint8 *ez_jpeg_resample_row_hv_2_sse2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs);
+Ez_uint8 *ez_jpeg_resample_row_hv_2_avx2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs);
+#endif /* EZ_SIMD_X86 */
+
+typedef void (*Ez_YCbCr_to_RGB_func) (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step);
+
+Ez_YCbCr_to_RGB_func ez_jpeg_YCbCr_get_func (void);
+#ifdef EZ_SIMD_X86
+void ez_jpeg_YCbCr_to_RGB_row_sse2 (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step);
+void ez_jpeg_YCbCr_to_RGB_row_avx2 (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step);
+#endif /* EZ_SIMD_X86 */
+
 #define div4(x) ((Ez_uint8) ((x) >> 2))
 
 
@@ -2880,6 +6868,352 @@ void ez_jpeg_YCbCr_to_RGB_row (Ez_uint8 *out, const Ez_uint8 *y,
 }
 
 
+/*
+ * Choose the function which resamples a row for the expansion factors hs, vs.
+*/
+
+Ez_resample_row_func ez_jpeg_resample_get_func (int hs, int vs)
+{
+    static Ez_resample_row_func h_2_func = NULL, hv_2_func = NULL;
+
+    if (h_2_func == NULL) {
+        h_2_func  = ez_jpeg_resample_row_h_2;
+        hv_2_func = ez_jpeg_resample_row_hv_2;
+#ifdef EZ_SIMD_X86
+        {
+            int cpu = ez_cpu_features ();
+            if (cpu & EZ_CPU_AVX2) {
+                h_2_func  = ez_jpeg_resample_row_h_2_avx2;
+                hv_2_func = ez_jpeg_resample_row_hv_2_avx2;
+            } else if (cpu & EZ_CPU_SSE2) {
+                h_2_func  = ez_jpeg_resample_row_h_2_sse2;
+                hv_2_func = ez_jpeg_resample_row_hv_2_sse2;
+            }
+        }
+#endif /* EZ_SIMD_X86 */
+    }
+
+    if (hs == 1 && vs == 1) return ez_jpeg_resample_row_1;
+    if (hs == 1 && vs == 2) return ez_jpeg_resample_row_v_2;
+    if (hs == 2 && vs == 1) return h_2_func;
+    if (hs == 2 && vs == 2) return hv_2_func;
+    return ez_jpeg_resample_row_generic;
+}
+
+
+/*
+ * Choose the function which converts a row from YCbCr to RGB.
+*/
+
+Ez_YCbCr_to_RGB_func ez_jpeg_YCbCr_get_func (void)
+{
+    static Ez_YCbCr_to_RGB_func YCbCr_func = NULL;
+
+    if (YCbCr_func != NULL) return YCbCr_func;
+    YCbCr_func = ez_jpeg_YCbCr_to_RGB_row;
+
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_AVX2) YCbCr_func = ez_jpeg_YCbCr_to_RGB_row_avx2;
+        else if (cpu & EZ_CPU_SSE2) YCbCr_func = ez_jpeg_YCbCr_to_RGB_row_sse2;
+    }
+#endif /* EZ_SIMD_X86 */
+
+    return YCbCr_func;
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * Vectorized resampling and color conversion, with the same results as the
+ * default functions.
+ *
+ * The resampled samples are computed in 16 bit lanes; an even sample e and
+ * the next odd sample o are stored together as the 16 bit value e | o << 8.
+ * The middle samples are vectorized, the edges are done as in the default.
+*/
+
+EZ_TARGET ("sse2")
+Ez_uint8 *ez_jpeg_resample_row_h_2_sse2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs)
+{
+    __m128i zero = _mm_setzero_si128 (), k2 = _mm_set1_epi16 (2),
+            prev, cur, next, n;
+    int i;
+    Ez_uint8 *input = in_near;
+
+    if (w == 1) {
+        out[0] = out[1] = input[0];
+        return out;
+    }
+
+    out[0] = input[0];
+    out[1] = div4 (input[0]*3 + input[1] + 2);
+    for (i=1; i+8 < w; i += 8) {
+        prev = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (input+i-1)), zero);
+        cur  = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (input+i  )), zero);
+        next = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (input+i+1)), zero);
+        n = _mm_add_epi16 (_mm_add_epi16 (cur, _mm_add_epi16 (cur, cur)), k2);
+        _mm_storeu_si128 ((__m128i *) (out+i*2), _mm_or_si128 (
+            _mm_srli_epi16 (_mm_add_epi16 (n, prev), 2),
+            _mm_slli_epi16 (_mm_srli_epi16 (_mm_add_epi16 (n, next), 2), 8)));
+    }
+    for (; i < w-1; ++i) {
+        int n = 3*input[i]+2;
+        out[i*2+0] = div4 (n+input[i-1]);
+        out[i*2+1] = div4 (n+input[i+1]);
+    }
+    out[i*2+0] = div4 (input[w-2]*3 + input[w-1] + 2);
+    out[i*2+1] = input[w-1];
+
+    (void) in_far;
+    (void) hs;
+
+    return out;
+}
+
+
+EZ_TARGET ("avx2")
+Ez_uint8 *ez_jpeg_resample_row_h_2_avx2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs)
+{
+    __m256i k2 = _mm256_set1_epi16 (2), prev, cur, next, n;
+    int i;
+    Ez_uint8 *input = in_near;
+
+    if (w == 1) {
+        out[0] = out[1] = input[0];
+        return out;
+    }
+
+    out[0] = input[0];
+    out[1] = div4 (input[0]*3 + input[1] + 2);
+    for (i=1; i+16 < w; i += 16) {
+        prev = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (input+i-1)));
+        cur  = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (input+i  )));
+        next = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (input+i+1)));
+        n = _mm256_add_epi16 (_mm256_add_epi16 (cur, _mm256_add_epi16 (cur, cur)), k2);
+        _mm256_storeu_si256 ((__m256i *) (out+i*2), _mm256_or_si256 (
+            _mm256_srli_epi16 (_mm256_add_epi16 (n, prev), 2),
+            _mm256_slli_epi16 (_mm256_srli_epi16 (_mm256_add_epi16 (n, next), 2), 8)));
+    }
+    for (; i < w-1; ++i) {
+        int n = 3*input[i]+2;
+        out[i*2+0] = div4 (n+input[i-1]);
+        out[i*2+1] = div4 (n+input[i+1]);
+    }
+    out[i*2+0] = div4 (input[w-2]*3 + input[w-1] + 2);
+    out[i*2+1] = input[w-1];
+
+    (void) in_far;
+    (void) hs;
+
+    return out;
+}
+
+
+EZ_TARGET ("sse2")
+Ez_uint8 *ez_jpeg_resample_row_hv_2_sse2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs)
+{
+    __m128i zero = _mm_setzero_si128 (), k8 = _mm_set1_epi16 (8),
+            t0, t1, u0, u1;
+    int i;
+
+    if (w == 1) {
+        out[0] = out[1] = div4 (3*in_near[0] + in_far[0] + 2);
+        return out;
+    }
+
+    out[0] = div4 (3*in_near[0] + in_far[0] + 2);
+    /* t0, t1 are 3*in_near + in_far at i-1 and i */
+    for (i=1; i+8 <= w; i += 8) {
+        t0 = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (in_near+i-1)), zero);
+        t1 = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (in_near+i  )), zero);
+        t0 = _mm_add_epi16 (_mm_add_epi16 (t0, _mm_add_epi16 (t0, t0)),
+             _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (in_far+i-1)), zero));
+        t1 = _mm_add_epi16 (_mm_add_epi16 (t1, _mm_add_epi16 (t1, t1)),
+             _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (in_far+i  )), zero));
+        u0 = _mm_add_epi16 (_mm_add_epi16 (t0, _mm_add_epi16 (t0, t0)),
+                            _mm_add_epi16 (t1, k8));
+        u1 = _mm_add_epi16 (_mm_add_epi16 (t1, _mm_add_epi16 (t1, t1)),
+                            _mm_add_epi16 (t0, k8));
+        _mm_storeu_si128 ((__m128i *) (out+i*2-1), _mm_or_si128 (
+            _mm_srli_epi16 (u0, 4), _mm_slli_epi16 (_mm_srli_epi16 (u1, 4), 8)));
+    }
+    for (; i < w; ++i) {
+        int s0 = 3*in_near[i-1] + in_far[i-1], s1 = 3*in_near[i] + in_far[i];
+        out[i*2-1] = div16 (3*s0 + s1 + 8);
+        out[i*2  ] = div16 (3*s1 + s0 + 8);
+    }
+    out[w*2-1] = div4 (3*in_near[w-1] + in_far[w-1] + 2);
+
+    (void) hs;
+
+    return out;
+}
+
+
+EZ_TARGET ("avx2")
+Ez_uint8 *ez_jpeg_resample_row_hv_2_avx2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs)
+{
+    __m256i k8 = _mm256_set1_epi16 (8), t0, t1, u0, u1;
+    int i;
+
+    if (w == 1) {
+        out[0] = out[1] = div4 (3*in_near[0] + in_far[0] + 2);
+        return out;
+    }
+
+    out[0] = div4 (3*in_near[0] + in_far[0] + 2);
+    for (i=1; i+16 <= w; i += 16) {
+        t0 = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (in_near+i-1)));
+        t1 = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (in_near+i  )));
+        t0 = _mm256_add_epi16 (_mm256_add_epi16 (t0, _mm256_add_epi16 (t0, t0)),
+             _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (in_far+i-1))));
+        t1 = _mm256_add_epi16 (_mm256_add_epi16 (t1, _mm256_add_epi16 (t1, t1)),
+             _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (in_far+i  ))));
+        u0 = _mm256_add_epi16 (_mm256_add_epi16 (t0, _mm256_add_epi16 (t0, t0)),
+                               _mm256_add_epi16 (t1, k8));
+        u1 = _mm256_add_epi16 (_mm256_add_epi16 (t1, _mm256_add_epi16 (t1, t1)),
+                               _mm256_add_epi16 (t0, k8));
+        _mm256_storeu_si256 ((__m256i *) (out+i*2-1), _mm256_or_si256 (
+            _mm256_srli_epi16 (u0, 4),
+            _mm256_slli_epi16 (_mm256_srli_epi16 (u1, 4), 8)));
+    }
+    for (; i < w; ++i) {
+        int s0 = 3*in_near[i-1] + in_far[i-1], s1 = 3*in_near[i] + in_far[i];
+        out[i*2-1] = div16 (3*s0 + s1 + 8);
+        out[i*2  ] = div16 (3*s1 + s0 + 8);
+    }
+    out[w*2-1] = div4 (3*in_near[w-1] + in_far[w-1] + 2);
+
+    (void) hs;
+
+    return out;
+}
+
+
+/*
+ * The products c*C of the chroma c in -128..127 by a fixed point constant C
+ * are computed exactly in 32 bit lanes by _mm_madd_epi16, on the pairs
+ * (c << 8, c) and (C >> 8, C & 255). The results are clamped by saturation
+ * when packed, and RGBA pixels are written directly when step is 4.
+*/
+
+#define EZ_YCBCR_K(C)  (((C) >> 8 & 0xFFFF) | ((C) & 255) << 16)
+
+EZ_TARGET ("sse2")
+void ez_jpeg_YCbCr_to_RGB_row_sse2 (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step)
+{
+    __m128i zero = _mm_setzero_si128 (), k128 = _mm_set1_epi16 (128),
+            k255 = _mm_set1_epi16 (255), round = _mm_set1_epi32 (32768),
+            kr  = _mm_set1_epi32 (EZ_YCBCR_K ( Ez_float2fixed (1.40200f))),
+            kb  = _mm_set1_epi32 (EZ_YCBCR_K ( Ez_float2fixed (1.77200f))),
+            kgr = _mm_set1_epi32 (EZ_YCBCR_K (-Ez_float2fixed (0.71414f))),
+            kgb = _mm_set1_epi32 (EZ_YCBCR_K (-Ez_float2fixed (0.34414f))),
+            yv, cb, cr, c[2], d[2], yf, r[2], g[2], b[2], rb, ga;
+    int i, k;
+
+    if (step != 4) {
+        ez_jpeg_YCbCr_to_RGB_row (out, y, pcb, pcr, count, step);
+        return;
+    }
+
+    for (i=0; i+8 <= count; i += 8) {
+        yv = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) (y+i)), zero);
+        cb = _mm_sub_epi16 (_mm_unpacklo_epi8 (
+                 _mm_loadl_epi64 ((__m128i *) (pcb+i)), zero), k128);
+        cr = _mm_sub_epi16 (_mm_unpacklo_epi8 (
+                 _mm_loadl_epi64 ((__m128i *) (pcr+i)), zero), k128);
+        c[0] = _mm_unpacklo_epi16 (_mm_slli_epi16 (cr, 8), cr);
+        c[1] = _mm_unpackhi_epi16 (_mm_slli_epi16 (cr, 8), cr);
+        d[0] = _mm_unpacklo_epi16 (_mm_slli_epi16 (cb, 8), cb);
+        d[1] = _mm_unpackhi_epi16 (_mm_slli_epi16 (cb, 8), cb);
+        for (k = 0; k < 2; k++) {
+            yf = k ? _mm_unpackhi_epi16 (yv, zero) : _mm_unpacklo_epi16 (yv, zero);
+            yf = _mm_add_epi32 (_mm_slli_epi32 (yf, 16), round);
+            r[k] = _mm_srai_epi32 (_mm_add_epi32 (yf, _mm_madd_epi16 (c[k], kr)), 16);
+            g[k] = _mm_srai_epi32 (_mm_add_epi32 (yf, _mm_add_epi32 (
+                       _mm_madd_epi16 (c[k], kgr), _mm_madd_epi16 (d[k], kgb))), 16);
+            b[k] = _mm_srai_epi32 (_mm_add_epi32 (yf, _mm_madd_epi16 (d[k], kb)), 16);
+        }
+        rb = _mm_packus_epi16 (_mm_packs_epi32 (r[0], r[1]),
+                               _mm_packs_epi32 (b[0], b[1]));
+        ga = _mm_packus_epi16 (_mm_packs_epi32 (g[0], g[1]), k255);
+        r[0] = _mm_unpacklo_epi8 (rb, ga);      /* r g r g ... */
+        b[0] = _mm_unpackhi_epi8 (rb, ga);      /* b a b a ... */
+        _mm_storeu_si128 ((__m128i *) out,      _mm_unpacklo_epi16 (r[0], b[0]));
+        _mm_storeu_si128 ((__m128i *) (out+16), _mm_unpackhi_epi16 (r[0], b[0]));
+        out += 32;
+    }
+    ez_jpeg_YCbCr_to_RGB_row (out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+
+EZ_TARGET ("avx2")
+void ez_jpeg_YCbCr_to_RGB_row_avx2 (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step)
+{
+    __m256i zero = _mm256_setzero_si256 (), k128 = _mm256_set1_epi16 (128),
+            k255 = _mm256_set1_epi16 (255), round = _mm256_set1_epi32 (32768),
+            kr  = _mm256_set1_epi32 (EZ_YCBCR_K ( Ez_float2fixed (1.40200f))),
+            kb  = _mm256_set1_epi32 (EZ_YCBCR_K ( Ez_float2fixed (1.77200f))),
+            kgr = _mm256_set1_epi32 (EZ_YCBCR_K (-Ez_float2fixed (0.71414f))),
+            kgb = _mm256_set1_epi32 (EZ_YCBCR_K (-Ez_float2fixed (0.34414f))),
+            yv, cb, cr, c[2], d[2], yf, r[2], g[2], b[2], rb, ga, lo, hi;
+    int i, k;
+
+    if (step != 4) {
+        ez_jpeg_YCbCr_to_RGB_row (out, y, pcb, pcr, count, step);
+        return;
+    }
+
+    /* Unpack and pack work inside each 128 bit lane, so they cancel out */
+    for (i=0; i+16 <= count; i += 16) {
+        yv = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((__m128i *) (y+i)));
+        cb = _mm256_sub_epi16 (_mm256_cvtepu8_epi16 (
+                 _mm_loadu_si128 ((__m128i *) (pcb+i))), k128);
+        cr = _mm256_sub_epi16 (_mm256_cvtepu8_epi16 (
+                 _mm_loadu_si128 ((__m128i *) (pcr+i))), k128);
+        c[0] = _mm256_unpacklo_epi16 (_mm256_slli_epi16 (cr, 8), cr);
+        c[1] = _mm256_unpackhi_epi16 (_mm256_slli_epi16 (cr, 8), cr);
+        d[0] = _mm256_unpacklo_epi16 (_mm256_slli_epi16 (cb, 8), cb);
+        d[1] = _mm256_unpackhi_epi16 (_mm256_slli_epi16 (cb, 8), cb);
+        for (k = 0; k < 2; k++) {
+            yf = k ? _mm256_unpackhi_epi16 (yv, zero) : _mm256_unpacklo_epi16 (yv, zero);
+            yf = _mm256_add_epi32 (_mm256_slli_epi32 (yf, 16), round);
+            r[k] = _mm256_srai_epi32 (_mm256_add_epi32 (yf,
+                       _mm256_madd_epi16 (c[k], kr)), 16);
+            g[k] = _mm256_srai_epi32 (_mm256_add_epi32 (yf, _mm256_add_epi32 (
+                       _mm256_madd_epi16 (c[k], kgr),
+                       _mm256_madd_epi16 (d[k], kgb))), 16);
+            b[k] = _mm256_srai_epi32 (_mm256_add_epi32 (yf,
+                       _mm256_madd_epi16 (d[k], kb)), 16);
+        }
+        rb = _mm256_packus_epi16 (_mm256_packs_epi32 (r[0], r[1]),
+                                  _mm256_packs_epi32 (b[0], b[1]));
+        ga = _mm256_packus_epi16 (_mm256_packs_epi32 (g[0], g[1]), k255);
+        r[0] = _mm256_unpacklo_epi8 (rb, ga);
+        b[0] = _mm256_unpackhi_epi8 (rb, ga);
+        lo = _mm256_unpacklo_epi16 (r[0], b[0]);   /* Pixels 0-3 and 8-11 */
+        hi = _mm256_unpackhi_epi16 (r[0], b[0]);   /* Pixels 4-7 and 12-15 */
+        _mm256_storeu_si256 ((__m256i *) out,
+            _mm256_permute2x128_si256 (lo, hi, 0x20));
+        _mm256_storeu_si256 ((__m256i *) (out+32),
+            _mm256_permute2x128_si256 (lo, hi, 0x31));
+        out += 64;
+    }
+    ez_jpeg_YCbCr_to_RGB_row (out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
 /* clean up the temporary component buffers */
 
 void ez_jpeg_cleanup (Ez_jpeg *j)
@@ -2938,6 +7272,7 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
         Ez_uint8 *coutput[4];
 
         Ez_stbi_resample res_comp[4];
+        Ez_YCbCr_to_RGB_func YCbCr_to_RGB = ez_jpeg_YCbCr_get_func ();
 
         for (k=0; k < decode_n; ++k) {
             Ez_stbi_resample *r = &res_comp[k];
@@ -2958,11 +7293,7 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
             r->ypos    = 0;
             r->line0   = r->line1 = z->img_comp[k].data;
 
-            if      (r->hs == 1 && r->vs == 1) r->resample = ez_jpeg_resample_row_1;
-            else if (r->hs == 1 && r->vs == 2) r->resample = ez_jpeg_resample_row_v_2;
-            else if (r->hs == 2 && r->vs == 1) r->resample = ez_jpeg_resample_row_h_2;
-            else if (r->hs == 2 && r->vs == 2) r->resample = ez_jpeg_resample_row_hv_2;
-            else                               r->resample = ez_jpeg_resample_row_generic;
+            r->resample = ez_jpeg_resample_get_func (r->hs, r->vs);
         }
 
         /* can't error after this so, this is safe */
@@ -2993,7 +7324,7 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
             if (n >= 3) {
                 Ez_uint8 *y = coutput[0];
                 if (z->s->img_n == 3) {
-                    ez_jpeg_YCbCr_to_RGB_row (out, y, coutput[1], coutput[2],
+                    YCbCr_to_RGB (out, y, coutput[1], coutput[2],
                         z->s->img_x, n);
                 } else
                     for (i=0; i < z->s->img_x; ++i) {
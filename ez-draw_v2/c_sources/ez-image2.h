@@ -24,6 +24,12 @@ typedef struct {
     Ez_uint8 *pixels_rgba;
     int has_alpha;
     int opacity;
+    int premul;
+    void *mip;                      /* Mipmap pyramid, or NULL */
+#ifdef EZ_BASE_XLIB
+    Pixmap xmask;                   /* Mask kept by ez_image_paint, or None */
+    int xmask_opacity;              /* Opacity of xmask */
+#endif /* EZ_BASE_ */
 } Ez_image;
 
 typedef struct {
@@ -35,12 +41,70 @@ typedef struct {
     int width, height;
 #ifdef EZ_BASE_XLIB
     Pixmap map, mask;
+    XID pict;                       /* ARGB32 Picture of map, or None */
+    Pixmap tile_mask;               /* mask tiled by ez_pixmap_tile, or None */
+    int tile_w, tile_h;             /* Size of tile_mask */
 #elif defined EZ_BASE_WIN32
     HBITMAP hmap;
     int has_alpha;
+#elif defined EZ_BASE_MEMORY
+    Ez_image *img;                  /* Copy of the image */
 #endif /* EZ_BASE_ */
 } Ez_pixmap;
 
+/* Rotated version of a sprite, for one quantized angle */
+typedef struct {
+    Ez_image *img;                  /* Rotated image, NULL if not built */
+    Ez_pixmap *pix;                 /* Pixmap of img, NULL if not built */
+    int hot_x, hot_y;               /* Hotspot in img */
+    int size;                       /* Size in bytes */
+    unsigned long stamp;            /* Date of last use */
+} Ez_sprite_entry;
+
+typedef struct {
+    Ez_image *img;                  /* Source image, not copied */
+    Ez_image *base;                 /* img scaled, or img */
+    int hot_x, hot_y;               /* Hotspot in base */
+    int steps;                      /* Number of angles on a turn */
+    double scale;                   /* Factor applied to img */
+    int quality;                    /* Rotation quality, see ez_image_rotate */
+    Ez_sprite_entry *entry;         /* One entry per angle */
+    int size;                       /* Total size in bytes */
+    int limit;                      /* Bound for size */
+    unsigned long clock;            /* To date the entries */
+} Ez_sprite;
+
+/* Location of an image packed in an atlas */
+typedef struct {
+    int page;                       /* Page containing the image */
+    int x, y, w, h;                 /* Area in the page */
+} Ez_atlas_rect;
+
+typedef struct {
+    int page_w, page_h;             /* Default size of the pages */
+    int nb_pages;                   /* Pages number */
+    void *pages;                    /* Private, see Ez_atlas_page */
+    int nb_rects, max_rects;        /* Images number, allocated size */
+    Ez_atlas_rect *rect;            /* Indexed by the id of the images */
+} Ez_atlas;
+
+/* Operators of ez_image_composite */
+enum {
+    EZ_OP_CLEAR, EZ_OP_SRC, EZ_OP_DST, EZ_OP_OVER, EZ_OP_DST_OVER,
+    EZ_OP_IN, EZ_OP_DST_IN, EZ_OP_OUT, EZ_OP_DST_OUT, EZ_OP_ATOP,
+    EZ_OP_DST_ATOP, EZ_OP_XOR, EZ_OP_ADD, EZ_OP_MULTIPLY, EZ_OP_SCREEN,
+    EZ_OP_LAST
+};
+
+/* Filters of ez_image_transform and ez_image_resize */
+enum {
+    EZ_FILTER_NEAREST, EZ_FILTER_BILINEAR, EZ_FILTER_BOX, EZ_FILTER_BICUBIC,
+    EZ_FILTER_LANCZOS3
+};
+
+/* Modes of ez_image_set_mipmap */
+enum { EZ_MIPMAP_NONE, EZ_MIPMAP_NEAREST, EZ_MIPMAP_TRILINEAR };
+
 
 /* Public functions */
 
@@ -49,11 +113,14 @@ void ez_image_destroy (Ez_image *img);
 Ez_image *ez_image_create (int w, int h);
 Ez_image *ez_image_dup (Ez_image *img);
 Ez_image *ez_image_load (const char *filename);
+Ez_image *ez_image_load_scaled (const char *filename, int max_w, int max_h);
 
 void ez_image_set_alpha (Ez_image *img, int has_alpha);
 int  ez_image_has_alpha (Ez_image *img);
 void ez_image_set_opacity (Ez_image *img, int opacity);
 int  ez_image_get_opacity (Ez_image *img);
+void ez_image_set_premul (Ez_image *img, int premul);
+int  ez_image_get_premul (Ez_image *img);
 
 void ez_image_paint (Ez_window win, Ez_image *img, int x, int y);
 void ez_image_paint_sub (Ez_window win, Ez_image *img, int x, int y,
@@ -64,14 +131,25 @@ void ez_image_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b, Ez_u
 void ez_image_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y);
 void ez_image_blend_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
     int src_x, int src_y, int w, int h);
+void ez_image_composite (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int op, int alpha);
+void ez_image_composite_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h, int op, int alpha);
 
 Ez_image *ez_image_extract (Ez_image *img, int src_x, int src_y, int w, int h);
 Ez_image *ez_image_sym_ver (Ez_image *img);
 Ez_image *ez_image_sym_hor (Ez_image *img);
 Ez_image *ez_image_scale (Ez_image *img, double factor);
+Ez_image *ez_image_resize (Ez_image *img, int w, int h, int filter);
 Ez_image *ez_image_rotate (Ez_image *img, double theta, int quality);
 void ez_image_rotate_point (Ez_image *img, double theta, int src_x, int src_y,
     int *dst_x, int *dst_y);
+int ez_image_transform (Ez_image *src, Ez_image *dst, const double matrix[6],
+    int filter);
+
+void ez_image_set_mipmap (Ez_image *img, int mode);
+int  ez_image_get_mipmap (Ez_image *img);
+void ez_image_invalidate (Ez_image *img);
 
 Ez_pixmap *ez_pixmap_new (void);
 void ez_pixmap_destroy (Ez_pixmap *pix);
@@ -79,6 +157,28 @@ Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img);
 void ez_pixmap_paint (Ez_window win, Ez_pixmap *pix, int x, int y);
 void ez_pixmap_tile (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h);
 
+Ez_sprite *ez_sprite_create (Ez_image *img, int hot_x, int hot_y, int steps,
+    double scale, int quality);
+void ez_sprite_destroy (Ez_sprite *spr);
+void ez_sprite_set_limit (Ez_sprite *spr, int nbytes);
+void ez_sprite_flush (Ez_sprite *spr);
+Ez_image *ez_sprite_get_image (Ez_sprite *spr, double theta, int *hot_x, int *hot_y);
+Ez_pixmap *ez_sprite_get_pixmap (Ez_sprite *spr, double theta, int *hot_x, int *hot_y);
+void ez_sprite_paint (Ez_window win, Ez_sprite *spr, double theta, int x, int y);
+
+Ez_atlas *ez_atlas_create (int page_w, int page_h);
+void ez_atlas_destroy (Ez_atlas *atlas);
+int ez_atlas_add (Ez_atlas *atlas, Ez_image *img);
+void ez_atlas_paint (Ez_window win, Ez_atlas *atlas, int id, int x, int y);
+void ez_atlas_begin (Ez_window win);
+void ez_atlas_end (void);
+
+void ez_image_cache_limit (int nbytes);
+void ez_image_cache_flush (void);
+
+void ez_image_set_threads (int nb);
+int ez_image_get_threads (void);
+
 Ez_rgb *ez_win_to_rgb(Ez_window my_win);
 Ez_image *ez_win_to_image(Ez_window my_win);
 Ez_rgb *ez_image_to_rgb(Ez_image *my_img);
@@ -92,12 +192,36 @@ Ez_uint32 ez_compose_rgba_color(unsigned char r, unsigned char g,
 /* Private functions */
 #ifdef EZ_PRIVATE_DEFS
 
+/* Vectorized functions are selected at runtime on x86 with gcc or clang */
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define EZ_SIMD_X86 1
+#define EZ_TARGET(isa) __attribute__ ((target (isa)))
+#include <immintrin.h>
+#endif
+
+/* For the pool of threads */
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+#include <pthread.h>
+#include <unistd.h>
+#endif /* EZ_BASE_ */
+
+/* For the MIT-SHM shared XImage and XRender */
+#ifdef EZ_BASE_XLIB
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+#endif /* EZ_BASE_ */
+
 int ez_image_debug (void);
 
 int ez_image_confine_sub_coords (Ez_image *img, int *src_x, int *src_y,
     int *w, int *h);
 int ez_confine_coord (int *t, int *r, int tmax);
 
+enum { EZ_CPU_SSE2 = 1, EZ_CPU_SSSE3 = 2, EZ_CPU_AVX2 = 4 };
+int ez_cpu_features (void);
+
 #ifdef EZ_BASE_XLIB
 
 void ez_image_draw_pict (Ez_window win, Ez_image *img, int x, int y,
@@ -109,11 +233,21 @@ void ez_image_draw_xi (Ez_window win, Ez_image *img, int x, int y,
     int src_x, int src_y, int w, int h);
 XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
     ez_xi_func xi_func);
+void ez_xi_destroy (XImage *xi);
 ez_xi_func ez_xi_get_func (void);
 void ez_xi_fill_default (XImage *xi, Ez_image *img, int src_x, int src_y,
     int w, int h);
 void ez_xi_fill_24 (XImage *xi, Ez_image *img, int src_x, int src_y,
     int w, int h);
+#ifdef EZ_SIMD_X86
+void ez_xi_fill_32_sse2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xi_shuffle_mask (Ez_uint8 mask[16]);
+void ez_xi_fill_32_ssse3 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xi_fill_32_avx2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+#endif /* EZ_SIMD_X86 */
 Ez_image *ez_xi_test_create (void);
 int ez_xi_diff (XImage *xi1, XImage *xi2);
 
@@ -121,6 +255,70 @@ Pixmap ez_xmask_create (Ez_window win, Ez_image *img, int src_x, int src_y,
     int w, int h);
 void ez_xmask_fill (Ez_uint8 *data, Ez_image *img,
     int src_x, int src_y, int w, int h);
+Pixmap ez_image_get_xmask (Ez_image *img);
+
+typedef void (*ez_xmask_func)(Ez_uint8 *, const Ez_uint8 *, int, int);
+
+ez_xmask_func ez_xmask_get_func (void);
+void ez_xmask_row_default (Ez_uint8 *dst, const Ez_uint8 *src, int w, int opacity);
+#ifdef EZ_SIMD_X86
+void ez_xmask_row_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int opacity);
+void ez_xmask_row_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int opacity);
+#endif /* EZ_SIMD_X86 */
+
+/* LRU cache of XImage (depth > 1) and mask data (depth 1) */
+#define EZ_XCACHE_MAX   16
+#define EZ_XCACHE_LIMIT (16*1024*1024)
+
+typedef struct {
+    int width, height, depth;       /* Key */
+    int size;                       /* Size in bytes */
+    unsigned long stamp;            /* Date of last use */
+    void *buf;                      /* XImage or mask data */
+} Ez_xcache_entry;
+
+typedef struct {
+    Ez_xcache_entry entry[EZ_XCACHE_MAX];
+    int nb;                         /* Entries number */
+    int size;                       /* Total size in bytes */
+    int limit;                      /* Bound for size */
+    unsigned long clock;            /* To date the entries */
+} Ez_xcache;
+
+void *ez_xcache_get (int w, int h, int depth);
+void ez_xcache_put (void *buf, int w, int h, int depth, int size);
+void ez_xcache_evict (void);
+void ez_xcache_free_buf (void *buf, int depth);
+
+/* MIT-SHM shared XImage, kept alive across calls */
+typedef struct {
+    int state;                      /* -1 unavailable, 0 untested, 1 ok */
+    XShmSegmentInfo info;           /* Segment shared with the X server */
+    XImage *xi;                     /* XImage whose data is the segment */
+    int width, height;              /* Capacity of xi */
+    int pending;                    /* An XShmPutImage is not synchronized */
+} Ez_xshm;
+
+int ez_xshm_available (void);
+int ez_xshm_error (Display *display, XErrorEvent *xev);
+int ez_xshm_alloc (int w, int h);
+void ez_xshm_free (void);
+XImage *ez_xshm_create (Ez_image *img, int src_x, int src_y, int w, int h,
+    ez_xi_func xi_func);
+void ez_xshm_put (Drawable d, XImage *xi, int x, int y, int w, int h);
+
+/* XRender extension, to composite the pixmaps with their alpha channel */
+typedef struct {
+    int state;                      /* -1 unavailable, 0 untested, 1 ok */
+    XRenderPictFormat *argb;        /* Format of the pixmaps, depth 32 */
+    XRenderPictFormat *screen;      /* Format of the windows */
+    GC gc;                          /* To draw in the pixmaps of depth 32 */
+} Ez_xrender;
+
+int ez_xrender_available (void);
+int ez_xrender_build_map (Ez_pixmap *pix, Ez_image *img);
+void ez_xrender_composite (Drawable d, Ez_pixmap *pix, int src_x, int src_y,
+    int x, int y, int w, int h);
 
 #elif defined EZ_BASE_WIN32
 
@@ -133,39 +331,267 @@ void ez_dib_fill_opacity (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
 void ez_dib_fill_truealpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
     int w, int h);
 
+#elif defined EZ_BASE_MEMORY
+
+void ez_image_draw_mem (Ez_window win, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h);
+
+#endif /* EZ_BASE_ */
+
+/* Pool of threads, which process the rows of the images by bands */
+#define EZ_THREADS_MAX  64
+#define EZ_PARALLEL_MIN (256*256)       /* Below this cost, run serially */
+
+typedef struct Ez_band Ez_band;
+typedef void (*ez_band_func)(Ez_band *, int, int);
+
+struct Ez_band {
+    ez_band_func func;              /* Process the rows y0 to y1-1 */
+    Ez_image *dst, *src;
+    int dst_x, dst_y, src_x, src_y; /* Rectangle w x h */
+    int w, h;
+    int op, alpha;                  /* Parameters of the operation */
+    void *data;
+    int failed;                     /* Set by a band on error */
+#ifdef EZ_BASE_XLIB
+    XImage *xi;
+    ez_xi_func xi_func;
+#elif defined EZ_BASE_WIN32
+    Ez_uint8 *dib;
+#endif /* EZ_BASE_ */
+};
+
+typedef struct {
+    int requested;                  /* Number of threads, 0 for default */
+    int nb;                         /* Threads with the caller, 0 if stopped */
+    int started;                    /* Worker threads */
+    int busy;                       /* A job is running */
+    int quit;                       /* The workers must exit */
+    Ez_band *job;                   /* Job in progress, cut in bands */
+    int job_h, job_bands;
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+    int next_band;                  /* Next band to process */
+    int active;                     /* Workers running the job */
+    unsigned long gen;              /* Jobs counter */
+    pthread_t thread[EZ_THREADS_MAX];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_start, cond_done;
+#elif defined EZ_BASE_WIN32
+    volatile LONG next_band;
+    volatile LONG active;
+    HANDLE thread[EZ_THREADS_MAX];
+    HANDLE sem_start, ev_done;
+#endif /* EZ_BASE_ */
+} Ez_pool;
+
+void ez_band_init (Ez_band *b, ez_band_func func, Ez_image *dst, Ez_image *src,
+    int dst_x, int dst_y, int src_x, int src_y, int w, int h);
+int ez_parallel_rows (Ez_band *b, int h, int cost);
+int ez_cpu_count (void);
+int ez_pool_start (void);
+void ez_pool_stop (void);
+void ez_pool_run (void);
+int ez_pool_claim (void);
+#if defined EZ_BASE_XLIB || defined EZ_BASE_MEMORY
+void *ez_pool_worker (void *arg);
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_pool_worker (LPVOID arg);
+#endif /* EZ_BASE_ */
+
+void ez_band_premul (Ez_band *b, int y0, int y1);
+void ez_band_over (Ez_band *b, int y0, int y1);
+void ez_band_blend (Ez_band *b, int y0, int y1);
+void ez_band_comp_op (Ez_band *b, int y0, int y1);
+void ez_band_symv (Ez_band *b, int y0, int y1);
+void ez_band_symh (Ez_band *b, int y0, int y1);
+void ez_band_transform (Ez_band *b, int y0, int y1);
+void ez_band_resample_h (Ez_band *b, int y0, int y1);
+void ez_band_resample_v (Ez_band *b, int y0, int y1);
+void ez_band_resample_vh (Ez_band *b, int y0, int y1);
+#ifdef EZ_BASE_XLIB
+void ez_xi_fill (XImage *xi, Ez_image *img, int src_x, int src_y, int w, int h,
+    ez_xi_func xi_func);
+void ez_band_xi (Ez_band *b, int y0, int y1);
+#elif defined EZ_BASE_WIN32
+void ez_band_dib (Ez_band *b, int y0, int y1);
 #endif /* EZ_BASE_ */
 
 void ez_image_print_rgba (Ez_image *img, int src_x, int src_y, int w, int h);
 void ez_image_comp_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b,
     Ez_uint8 a);
-void ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+int ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
     int src_x, int src_y, int w, int h);
-void ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+int ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
     int src_x, int src_y, int w, int h);
+void ez_premul_row (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+void ez_unpremul_row (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+
+typedef void (*ez_blend_func)(Ez_uint8 *, const Ez_uint8 *, int);
+typedef void (*ez_fill_func)(Ez_uint32 *, Ez_uint32, int);
+
+ez_blend_func ez_blend_get_func (int premul);
+void ez_blend_row_default (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+void ez_blend_row_pm_default (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+ez_fill_func ez_fill_get_func (void);
+void ez_fill_row_default (Ez_uint32 *dst, Ez_uint32 val, int w);
+#ifdef EZ_SIMD_X86
+void ez_blend_row_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+void ez_blend_row_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+void ez_blend_row_pm_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+void ez_blend_row_pm_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w);
+void ez_fill_row_sse2 (Ez_uint32 *dst, Ez_uint32 val, int w);
+void ez_fill_row_avx2 (Ez_uint32 *dst, Ez_uint32 val, int w);
+#endif /* EZ_SIMD_X86 */
+
+/* x/255 rounded, for 0 <= x <= 255*255 */
+#define EZ_DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+typedef void (*ez_comp_func)(Ez_uint8 *, const Ez_uint8 *, int, int);
+
+int ez_image_comp_op (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h, int op, int alpha);
+void ez_comp_load_row (Ez_uint8 *dst, const Ez_uint8 *src, int w,
+    int premul, int has_alpha, int alpha);
+extern const signed char ez_comp_coefs[EZ_OP_LAST][5];
+ez_comp_func ez_comp_get_func (void);
+void ez_comp_row_default (Ez_uint8 *dst, const Ez_uint8 *src, int w, int op);
+#ifdef EZ_SIMD_X86
+void ez_comp_row_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int op);
+void ez_comp_row_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int w, int op);
+#endif /* EZ_SIMD_X86 */
 
 void ez_image_copy_sub (Ez_image *src, Ez_image *dest , int src_x, int src_y);
 void ez_image_comp_symv (Ez_image *src, Ez_image *dst);
 void ez_image_comp_symh (Ez_image *src, Ez_image *dst);
-void ez_image_expand (Ez_image *src, Ez_image *dst, double factor);
-void ez_image_shrink (Ez_image *src, Ez_image *dst, double factor);
+
+/* Weights of a resampling along one axis, in 2.14 fixed-point */
+#define EZ_RESIZE_BITS 14
+
+typedef struct {
+    int n;                          /* Max number of taps */
+    int *start;                     /* First source pixel for each pixel */
+    int *count;                     /* Number of taps for each pixel */
+    int *weights;                   /* n weights for each pixel */
+    int fits16;                     /* All the weights hold in 16 bits */
+} Ez_resize_weights;
+
+typedef struct {
+    Ez_resize_weights rw_x, rw_y;
+    Ez_uint8 *tmp;                  /* Rows resampled horizontally first */
+    int premul;                     /* Resample premultiplied colors */
+    int conv;                       /* Premultiply the source rows */
+} Ez_resample;
+
+typedef void (*ez_resample_func)(Ez_uint8 *, const Ez_uint8 *, int, int,
+    const int *, int);
+
+double ez_filter_support (int filter);
+double ez_filter_eval (int filter, double x);
+int ez_resize_weights_init (Ez_resize_weights *rw, int src_n, int dst_n, int filter);
+void ez_resize_weights_free (Ez_resize_weights *rw);
+int ez_image_resample (Ez_image *src, Ez_image *dst, int filter);
+Ez_image *ez_image_resize_to (Ez_image *img, int w, int h, int filter);
+void ez_resample_row_h (Ez_uint8 *dst, const Ez_uint8 *src, int dst_w,
+    Ez_resize_weights *rw, Ez_uint8 *row, int src_w);
+void ez_resample_row_v (Ez_uint8 *dst, const Ez_uint8 *src, int w,
+    Ez_resize_weights *rw, int y, int first);
+void ez_resample_bound_row (Ez_uint8 *p, int w);
+ez_resample_func ez_resample_get_func (void);
+void ez_resample_col_default (Ez_uint8 *dst, const Ez_uint8 *src, int n,
+    int stride, const int *w, int count);
+#ifdef EZ_SIMD_X86
+void ez_resample_col_sse2 (Ez_uint8 *dst, const Ez_uint8 *src, int n,
+    int stride, const int *w, int count);
+void ez_resample_col_avx2 (Ez_uint8 *dst, const Ez_uint8 *src, int n,
+    int stride, const int *w, int count);
+#endif /* EZ_SIMD_X86 */
+
+/* Mipmap pyramid: level[k] is the image reduced k times by 2, for 1 <= k <= nb */
+#define EZ_MIP_LEVELS 16
+
+typedef struct {
+    int mode;                       /* EZ_MIPMAP_NEAREST or _TRILINEAR */
+    int nb;                         /* Number of levels built */
+    Ez_image *level[EZ_MIP_LEVELS]; /* level[0] is unused: the image itself */
+} Ez_mipmap;
+
+void ez_mip_free (Ez_image *img);
+Ez_image *ez_mip_level (Ez_image *img, int k);
+Ez_image *ez_mip_resize (Ez_image *img, int w, int h, int filter);
+void ez_image_lerp (Ez_image *dst, Ez_image *src, int t);
+
 void ez_rotate_get_size (double theta, int src_w, int src_h, int *dst_w, int *dst_h);
 void ez_rotate_get_coords (double theta, int src_w, int src_h, int src_x, int src_y,
     int *dst_x, int *dst_y);
-void ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta);
-void ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta);
-void ez_bilinear_4points (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t);
-void ez_bilinear_pane (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t, double factor);
+int ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta);
+int ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta);
+void ez_rotate_get_matrix (Ez_image *src, double theta, double inv[6]);
+
+/* Default bound for the memory of the rotated versions of a sprite */
+#define EZ_SPRITE_LIMIT (4*1024*1024)
+
+Ez_sprite_entry *ez_sprite_get_entry (Ez_sprite *spr, double theta);
+void ez_sprite_free_entry (Ez_sprite *spr, Ez_sprite_entry *e);
+void ez_sprite_evict (Ez_sprite *spr, Ez_sprite_entry *keep);
+
+/* Page of an atlas; the free space is above a skyline of segments */
+typedef struct {
+    int x, y, w;                    /* Segment at height y */
+} Ez_skyline_seg;
+
+typedef struct {
+    Ez_image *img;                  /* Pixels of the page */
+    Ez_pixmap *pix;                 /* Built from img, NULL if out of date */
+    Ez_skyline_seg *seg;            /* Skyline, from left to right */
+    int nb_seg;                     /* Segments number */
+} Ez_atlas_page;
+
+/* Batch of ez_atlas_paint between ez_atlas_begin and ez_atlas_end */
+typedef struct {
+    int on;                         /* In a batch */
+    Ez_window win;
+#ifdef EZ_BASE_WIN32
+    HDC hdc;                        /* DC of the pages */
+    HBITMAP hmap;                   /* Page selected in hdc */
+#endif /* EZ_BASE_ */
+} Ez_atlas_batch;
+
+Ez_atlas_page *ez_atlas_new_page (Ez_atlas *atlas, int w, int h);
+int ez_skyline_find (Ez_atlas_page *page, int w, int h, int *best_x, int *best_y);
+void ez_skyline_insert (Ez_atlas_page *page, int x, int y, int w, int h);
+void ez_atlas_copy (Ez_atlas_page *page, Ez_image *img, int x, int y);
+
+/* Interpolate 2 pixels p,q with weight f in 0..256 of q, 2 channels at once */
+#define EZ_LERP_PX(p,q,f) \
+    (((((p) & 0xff00ff) * (256-(f)) + ((q) & 0xff00ff) * (f) + 0x800080) >> 8 \
+      & 0xff00ff) | \
+     ((((p) >> 8 & 0xff00ff) * (256-(f)) + ((q) >> 8 & 0xff00ff) * (f) + 0x800080) \
+      & 0xff00ff00))
+
+int ez_transform_inv (Ez_image *src, Ez_image *dst, const double inv[6], int filter);
+Ez_int64 ez_floor_div (Ez_int64 n, Ez_int64 d);
+void ez_transform_span (Ez_int64 u0, Ez_int64 du, Ez_int64 lo, Ez_int64 hi,
+    int *x0, int *x1);
+void ez_transform_row_nearest (Ez_uint32 *dst, Ez_image *src,
+    int u, int v, int du, int dv, int n);
+void ez_transform_row_bilinear (Ez_uint32 *dst, Ez_image *src,
+    int u, int v, int du, int dv, int n);
 
 #ifdef EZ_BASE_XLIB
 int ez_pixmap_build_map (Ez_pixmap *pix, Ez_image *img);
 void ez_pixmap_draw_area (Ez_window win, Ez_pixmap *pix, int x, int y);
 void ez_pixmap_tile_area (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h);
+int ez_pixmap_tile_mask (Ez_pixmap *pix, int w, int h);
+void ez_atlas_draw_area (Ez_window win, Ez_pixmap *pix, Ez_atlas_rect *r,
+    int x, int y);
 #elif defined EZ_BASE_WIN32
 int ez_pixmap_build_hmap (Ez_pixmap *pix, Ez_image *img);
 void ez_pixmap_draw_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y);
 void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int h);
+void ez_atlas_draw_hmap (HDC hdc_dst, HDC hdc, Ez_pixmap *pix, Ez_atlas_rect *r,
+    int x, int y);
+#elif defined EZ_BASE_MEMORY
+void ez_pixmap_tile_mem (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h);
 #endif /* EZ_BASE_ */
 
 #endif /* EZ_PRIVATE_DEFS */
@@ -203,6 +629,8 @@ enum {
 /* Load image by filename, open file, or memory buffer */
 Ez_uint8 *ez_stbi_load_from_memory (Ez_uint8 const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 Ez_uint8 *ez_stbi_load (char const *filename, int *x, int *y, int *comp, int req_comp);
+/* JPEG may be decoded reduced by 2, 4 or 8 for a thumbnail in max_w x max_h */
+Ez_uint8 *ez_stbi_load_scaled (char const *filename, int *x, int *y, int *comp, int req_comp, int max_w, int max_h);
 Ez_uint8 *ez_stbi_load_from_file (FILE *f, int *x, int *y, int *comp, int req_comp);
 /* for ez_stbi_load_from_file, file pointer is left pointing immediately after image */
 
@@ -247,6 +675,8 @@ int   ez_stbi_zlib_decode_noheader_buffer (char *obuffer, int olen, const char *
 
 #define ez_stbi_load_from_memory    stbi_load_from_memory
 #define ez_stbi_load                stbi_load
+#define ez_stbi_load_scaled(filename, x, y, comp, req_comp, max_w, max_h) \
+    stbi_load (filename, x, y, comp, req_comp)
 #define ez_stbi_load_from_file      stbi_load_from_file
 
 #define Ez_stbi_io_callbacks        stbi_io_callbacks
@@ -1,3 +1,4 @@
+#define EZ_PRIVATE_DEFS 1
 #include "ez-draw2.h"
 #include "ez-image2.h"
 
@@ -5,19 +6,39 @@
 extern Ez_X ezx;
 
 
-#ifndef _WIN32
+#ifdef EZ_BASE_MEMORY
+Ez_uint8 *mem_capscreen( Ez_window my_win, int *pwidth, int *pheight)
+{
+	int i;
+	Ez_uint8 *bp;
+
+	*pwidth = my_win->width;
+	*pheight = my_win->height;
+	bp = malloc( my_win->width * my_win->height * 3 );
+	if(bp == NULL)
+	{
+		fprintf( stderr, "Not allocated memory\n" );
+		return NULL;
+	}
+	for( i = 0; i < my_win->width * my_win->height; i++ )
+	{
+		bp[i * 3] = my_win->pixels_rgba[i * 4];
+		bp[i * 3 + 1] = my_win->pixels_rgba[i * 4 + 1];
+		bp[i * 3 + 2] = my_win->pixels_rgba[i * 4 + 2];
+	}
+	return bp;
+}
+
+#elif !defined _WIN32
 Ez_uint8 *x11_capscreen( Ez_window my_win, int *pwidth, int *pheight)
 {
 	int lx, ly;
 	int width, height;
-	XWindowAttributes xwa;
-	XGetWindowAttributes(ezx.display, my_win, &xwa);
+	ez_window_get_size(my_win, &width, &height);
 
 
-	width = xwa.width;
-	height = xwa.height;
-	*pwidth = xwa.width;
-	*pheight = xwa.height;
+	*pwidth = width;
+	*pheight = height;
 	XImage *m = XGetImage( ezx.display, my_win, 0, 0, width, height, AllPlanes, XYPixmap);
 
 	if( m->bitmap_pad != 32 )
@@ -133,7 +154,9 @@ Ez_rgb *ez_win_to_rgb(Ez_window my_win)
 	Ez_uint8 *arr;
 	int width;
 	int height;	
-#ifndef _WIN32
+#ifdef EZ_BASE_MEMORY
+	arr = mem_capscreen( my_win, &width, &height);
+#elif !defined _WIN32
 	arr = x11_capscreen( my_win, &width, &height);
 #else
 	arr = win_capscreen( my_win, &width, &height);
@@ -155,26 +178,31 @@ return rgb;
 
 Ez_image *ez_win_to_image(Ez_window my_win)
 {
+#ifdef EZ_BASE_MEMORY
+	/* The surface already has the layout of an image */
+	Ez_image *img;
+	if(my_win == None)
+		return NULL;
+	img = ez_image_create(my_win->width, my_win->height);
+	if(img == NULL)
+		return NULL;
+	memcpy(img->pixels_rgba, my_win->pixels_rgba, my_win->width * my_win->height * 4);
+	return img;
+#else
 	int i = 0;
 	int k = 0;
 	Ez_rgb *rgb = ez_win_to_rgb(my_win);
 	if(rgb == NULL || rgb->pixels_rgb == NULL || rgb->height < 1 || rgb->width < 1)
 		return NULL;
-	Ez_image *img	= malloc(sizeof(Ez_image));
+	/* ez_image_create initializes all the fields of the image */
+	Ez_image *img = ez_image_create(rgb->width, rgb->height);
 	if(img == NULL )
 	{
 		free(rgb->pixels_rgb);
 		free(rgb);
 		return NULL;
-	}		
-	Ez_uint8 *rgba = malloc(rgb->height * rgb->width * 4);
-	if(rgba == NULL )
-	{
-		free(img);
-		free(rgb->pixels_rgb);
-		free(rgb);
-		return NULL;
 	}
+	Ez_uint8 *rgba = img->pixels_rgba;
 	while (i < rgb->height * rgb->width * 3)
 	{
 		rgba[k]= rgb->pixels_rgb[i];
@@ -184,13 +212,11 @@ Ez_image *ez_win_to_image(Ez_window my_win)
 		i +=3;
 		k +=4;
 	}
+	free(rgb->pixels_rgb);
 	free(rgb);
-	img->pixels_rgba = rgba;
-	img->width = rgb->width;
-	img->height = rgb->height;
-	img->has_alpha = 0;
 	img->opacity = 1;
 	return img;		
+#endif
 }
 
 Ez_rgb *ez_image_to_rgb(Ez_image *my_img)
@@ -210,9 +236,15 @@ Ez_rgb *ez_image_to_rgb(Ez_image *my_img)
 	int k = 0;
 	while (i < my_img->height * my_img->width * 4)
 	{
-		arr[k]= my_img->pixels_rgba[i];
-		arr[k + 1] = my_img->pixels_rgba[i + 1];
-		arr[k + 2] = my_img->pixels_rgba[i + 2];
+		Ez_uint8 c[4];
+		/* The colors of a premultiplied image are made straight */
+		if(my_img->premul)
+			ez_unpremul_row(c, my_img->pixels_rgba + i, 1);
+		else
+			memcpy(c, my_img->pixels_rgba + i, 4);
+		arr[k]= c[0];
+		arr[k + 1] = c[1];
+		arr[k + 2] = c[2];
 		i +=4;
 		k +=3;
 	}
@@ -255,6 +287,10 @@ int ez_set_pixel_image(Ez_image *my_img, int x, int y, Ez_uint32 color1)
 	my_img->pixels_rgba[ipix + 1] = (color1 >> 8) & 0xFF;
 	my_img->pixels_rgba[ipix + 2] = (color1 >> 16) & 0xFF;
  	my_img->pixels_rgba[ipix + 3] = (color1 >> 24) & 0xFF;
+	/* The color is given straight */
+	if(my_img->premul)
+		ez_premul_row(my_img->pixels_rgba + ipix, my_img->pixels_rgba + ipix, 1);
+	ez_image_invalidate (my_img);
  	return ipix;
 }
 
@@ -0,0 +1,129 @@
+/*
+ * test_blend.c: check that the vectorized row blending functions of ez-image
+ * give the same results as the default ones, with straight and premultiplied
+ * colors, on all the couples of alpha and all the couples of colors.
+ *
+ * Build and run with:  make test
+ *
+ * This program is free software under the terms of the
+ * GNU Lesser General Public License (LGPL) version 2.1.
+*/
+
+#define EZ_PRIVATE_DEFS 1
+#include "ez-image2.h"
+
+/* A row holds all the couples of colors c_src, c_dst */
+#define ROW_W 65536
+
+typedef struct {
+    const char *name;
+    ez_blend_func func;
+    int premul;
+    int nb_err;                     /* Couples of alpha which differ */
+} Test_func;
+
+
+/*
+ * Fill the rows for the alphas a_src and a_dst. On each channel, the couples
+ * of colors of src and dst run through all the values, in different orders.
+*/
+
+void fill_rows (Ez_uint8 *src, Ez_uint8 *dst, int a_src, int a_dst)
+{
+    int i, lo, hi;
+
+    for (i = 0; i < ROW_W; i++) {
+        lo = i & 255; hi = i >> 8;
+        src[i*4+0] = lo;      dst[i*4+0] = hi;
+        src[i*4+1] = hi;      dst[i*4+1] = lo;
+        src[i*4+2] = lo ^ hi; dst[i*4+2] = lo;
+        src[i*4+3] = a_src;   dst[i*4+3] = a_dst;
+    }
+}
+
+
+/*
+ * Compare the n functions of t, all for straight or premultiplied colors, to
+ * the default function on all the couples of alpha. The number of couples
+ * which differ is counted in t[k].nb_err.
+*/
+
+void test_funcs (Test_func *t, int n, Ez_uint8 *src, Ez_uint8 *dst0,
+    Ez_uint8 *dst1, Ez_uint8 *dst2)
+{
+    ez_blend_func ref = t[0].premul ? ez_blend_row_pm_default
+                                    : ez_blend_row_default;
+    int a_src, a_dst, i, k;
+
+    for (a_src = 0; a_src < 256; a_src++)
+    for (a_dst = 0; a_dst < 256; a_dst++) {
+        fill_rows (src, dst0, a_src, a_dst);
+        memcpy (dst1, dst0, ROW_W*4);
+        ref (dst1, src, ROW_W);
+
+        for (k = 0; k < n; k++) {
+            memcpy (dst2, dst0, ROW_W*4);
+            t[k].func (dst2, src, ROW_W);
+            if (memcmp (dst1, dst2, ROW_W*4) == 0) continue;
+
+            for (i = 0; memcmp (dst1+i*4, dst2+i*4, 4) == 0; i++) ;
+            if (t[k].nb_err++ < 10)
+                printf ("%s: src %d,%d,%d,%d  dst %d,%d,%d,%d  gives "
+                    "%d,%d,%d,%d instead of %d,%d,%d,%d\n", t[k].name,
+                    src [i*4], src [i*4+1], src [i*4+2], src [i*4+3],
+                    dst0[i*4], dst0[i*4+1], dst0[i*4+2], dst0[i*4+3],
+                    dst2[i*4], dst2[i*4+1], dst2[i*4+2], dst2[i*4+3],
+                    dst1[i*4], dst1[i*4+1], dst1[i*4+2], dst1[i*4+3]);
+        }
+    }
+}
+
+
+int main ()
+{
+    Test_func t[2][2];
+    Ez_uint8 *src, *dst0, *dst1, *dst2;
+    int n = 0, k, premul, res = 0;
+
+    memset (t, 0, sizeof(t));
+#ifdef EZ_SIMD_X86
+    {
+        int cpu = ez_cpu_features ();
+        if (cpu & EZ_CPU_SSE2) {
+            t[0][n].name = "ez_blend_row_sse2";
+            t[0][n].func = ez_blend_row_sse2;
+            t[1][n].name = "ez_blend_row_pm_sse2";
+            t[1][n].func = ez_blend_row_pm_sse2;
+            n++;
+        }
+        if (cpu & EZ_CPU_AVX2) {
+            t[0][n].name = "ez_blend_row_avx2";
+            t[0][n].func = ez_blend_row_avx2;
+            t[1][n].name = "ez_blend_row_pm_avx2";
+            t[1][n].func = ez_blend_row_pm_avx2;
+            n++;
+        }
+    }
+#endif /* EZ_SIMD_X86 */
+    if (n == 0) {
+        printf ("No vectorized blending function to test\n");
+        return 0;
+    }
+
+    src = malloc (ROW_W*4*4);
+    if (src == NULL) { printf ("Out of memory\n"); return 1; }
+    dst0 = src + ROW_W*4; dst1 = dst0 + ROW_W*4; dst2 = dst1 + ROW_W*4;
+
+    for (premul = 0; premul < 2; premul++) {
+        for (k = 0; k < n; k++) t[premul][k].premul = premul;
+        test_funcs (t[premul], n, src, dst0, dst1, dst2);
+        for (k = 0; k < n; k++) {
+            printf ("%-22s %s\n", t[premul][k].name,
+                t[premul][k].nb_err == 0 ? "ok" : "FAILED");
+            if (t[premul][k].nb_err > 0) res = 1;
+        }
+    }
+
+    free (src);
+    return res;
+}